@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "libcalc.h"
+#include "libcalc_program.h"
+#include "libcalc_batch.h"
+
+#define DEFAULT_JOBS 1000000
+/* programs differing only by their last operation */
+#define PROGRAMS 64
+/* distinct bindings of the variables */
+#define BINDINGS 256
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Evaluate jobs sharing a common prefix, one by one then as a batch.
+ */
+int main(int argc, char **argv)
+{
+    size_t jobs = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_JOBS;
+    static ca_program_t programs[PROGRAMS];
+    static ca_value_t bindings[BINDINGS][4];
+    const ca_program_t **progs = calloc(jobs, sizeof(ca_program_t *));
+    const ca_value_t **vars = calloc(jobs, sizeof(ca_value_t *));
+    ca_value_t *results = calloc(jobs, sizeof(ca_value_t));
+    ca_batch_t batch;
+
+    if (progs == NULL || vars == NULL || results == NULL || ca_batch_initialize(&batch) < 0)
+        exit(1);
+
+    for (size_t p = 0; p < PROGRAMS; p++) {
+        char source[128];
+        snprintf(source, sizeof(source), "((a * b + c * d) * (a - c) + b * d) %% 1000003 + %zu", p);
+        if (ca_compile(programs + p, source, CA_SYNTAX_INFIX) < 0)
+            exit(1);
+    }
+    for (size_t b = 0; b < BINDINGS; b++)
+        for (size_t v = 0; v < 4; v++)
+            bindings[b][v] = (b * 7919 + v * 104729) % 10007;
+    for (size_t i = 0; i < jobs; i++) {
+        progs[i] = programs + i % PROGRAMS;
+        vars[i] = bindings[i / PROGRAMS % BINDINGS];
+    }
+
+    double start = now();
+    for (size_t i = 0; i < jobs; i++)
+        if (ca_eval(programs + i % PROGRAMS, vars[i], 4, results + i) < 0)
+            exit(1);
+    double elapsed = now() - start;
+    printf("%zu jobs, one by one  %8.3f s %6.2f ns/job\n", jobs, elapsed, elapsed * 1e9 / jobs);
+
+    start = now();
+    if (ca_batch_eval(&batch, progs, vars, jobs, results, NULL) < 0)
+        exit(1);
+    elapsed = now() - start;
+    printf("%zu jobs, as a batch  %8.3f s %6.2f ns/job\n", jobs, elapsed, elapsed * 1e9 / jobs);
+    printf("%zu operations applied, %zu computed, %.1f%% deduplicated\n", batch.stats.operations,
+           batch.stats.computed, 100.0 * (batch.stats.operations - batch.stats.computed) / batch.stats.operations);
+
+    ca_batch_cleanup(&batch);
+    for (size_t p = 0; p < PROGRAMS; p++)
+        ca_program_cleanup(programs + p);
+    free(results);
+    free(vars);
+    free(progs);
+    return 0;
+}
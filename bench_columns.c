@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcalc.h"
+#include "libcalc_program.h"
+#include "libcalc_columns.h"
+
+#define DEFAULT_ROWS (8UL << 20)
+#define STRIPE (1UL << 16)
+
+/**
+ * The formula applied to each row, as a stack of operations.
+ */
+#define FORMULA "a b * 3 / a b - + b 7 % +"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int column(size_t rows, unsigned long seed)
+{
+    ca_value_t *values = malloc(STRIPE * sizeof(ca_value_t));
+    FILE *file = tmpfile();
+    if (values == NULL || file == NULL) {
+        perror("bench_columns");
+        exit(1);
+    }
+    int fd = dup(fileno(file));
+    fclose(file);
+
+    for (size_t first = 0; first < rows; first += STRIPE) {
+        size_t count = rows - first < STRIPE ? rows - first : STRIPE;
+        for (size_t i = 0; i < count; i++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            values[i] = (ca_value_t) (seed >> 34) - (1L << 29);
+        }
+        if (write(fd, values, count * sizeof(ca_value_t)) != (ssize_t) (count * sizeof(ca_value_t))) {
+            perror("bench_columns");
+            exit(1);
+        }
+    }
+    free(values);
+    return fd;
+}
+
+/**
+ * Apply the formula row by row, pushing the values of each row and
+ * applying its operations to the stack.
+ */
+static void rows_by_stack(const int *inputs, int output, size_t rows)
+{
+    ca_value_t *a = malloc(3 * STRIPE * sizeof(ca_value_t)), *b = a + STRIPE, *results = b + STRIPE;
+    ca_calc_t calc;
+
+    if (a == NULL || ca_initialize(&calc, 8) < 0)
+        exit(1);
+
+    for (size_t first = 0; first < rows; first += STRIPE) {
+        size_t count = rows - first < STRIPE ? rows - first : STRIPE, length = count * sizeof(ca_value_t);
+        if (pread(inputs[0], a, length, first * sizeof(ca_value_t)) != (ssize_t) length ||
+            pread(inputs[1], b, length, first * sizeof(ca_value_t)) != (ssize_t) length)
+            exit(1);
+
+        for (size_t i = 0; i < count; i++) {
+            ca_push(&calc, a[i]);
+            ca_push(&calc, b[i]);
+            ca_operate(&calc, CA_OP_MULTIPLY);
+            ca_push(&calc, 3);
+            ca_operate(&calc, CA_OP_DIVIDE);
+            ca_push(&calc, a[i]);
+            ca_push(&calc, b[i]);
+            ca_operate(&calc, CA_OP_SUBSTRACT);
+            ca_operate(&calc, CA_OP_ADD);
+            ca_push(&calc, b[i]);
+            ca_push(&calc, 7);
+            ca_operate(&calc, CA_OP_MODULO);
+            ca_operate(&calc, CA_OP_ADD);
+            results[i] = ca_pop(&calc);
+        }
+
+        if (pwrite(output, results, length, first * sizeof(ca_value_t)) != (ssize_t) length)
+            exit(1);
+    }
+    ca_cleanup(&calc);
+    free(a);
+}
+
+/**
+ * Apply a formula to every row of two column files, row by row on a
+ * stack and with ca_columns_eval on one thread and one per cpu.
+ */
+int main(int argc, char **argv)
+{
+    size_t rows = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ROWS;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int inputs[2] = { column(rows, 1), column(rows, 2) };
+    FILE *file = tmpfile();
+    int output = fileno(file);
+    ca_program_t prog;
+    ca_columns_stats_t stats;
+
+    if (ca_compile(&prog, FORMULA, CA_SYNTAX_RPN) < 0)
+        exit(1);
+
+    double start = now();
+    rows_by_stack(inputs, output, rows);
+    double elapsed = now() - start;
+    printf("%zu rows, stack row by row %4s %8.3f s %6.3f ns/row\n", rows, "", elapsed, elapsed * 1e9 / rows);
+
+    unsigned threads[2] = { 1, cpus > 1 ? cpus : 1 };
+    for (unsigned t = 0; t < (threads[1] > 1 ? 2 : 1); t++) {
+        start = now();
+        if (ca_columns_eval(&prog, inputs, output, 0, threads[t], &stats) < 0)
+            exit(1);
+        elapsed = now() - start;
+        printf("%zu rows, columns, %2u threads %8.3f s %6.3f ns/row\n", rows, stats.threads, elapsed,
+               elapsed * 1e9 / rows);
+    }
+
+    ca_program_cleanup(&prog);
+    fclose(file);
+    close(inputs[0]);
+    close(inputs[1]);
+    return 0;
+}
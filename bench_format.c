@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "libcalc.h"
+#include "libcalc_format.h"
+
+#define DEFAULT_VALUES 1000000
+#define BUFFER_SIZE (1 << 16)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Dump a large stack to /dev/null with printf and with the writer.
+ */
+int main(int argc, char **argv)
+{
+    size_t values = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_VALUES;
+    ca_calc_t calc;
+    ca_writer_t writer;
+
+    int fd = open("/dev/null", O_WRONLY);
+    FILE *out = fdopen(fd, "w");
+    if (out == NULL || ca_initialize(&calc, values) < 0 || ca_writer_initialize(&writer, fd, NULL, BUFFER_SIZE) < 0)
+        exit(1);
+
+    unsigned long seed = 42;
+    for (size_t i = 0; i < values; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        ca_push(&calc, (long) seed >> (seed % 64));
+    }
+
+    double start = now();
+    ca_value_t *v;
+    ca_stack_for_each(&calc, v) {
+        fprintf(out, " %ld", *v);
+    }
+    fflush(out);
+    double elapsed = now() - start;
+    printf("dump of %zu values, %-12s %8.3f ms\n", values, "printf", elapsed * 1e3);
+
+    start = now();
+    if (ca_dump(&writer, &calc, CA_DUMP_TEXT) || ca_writer_flush(&writer))
+        exit(1);
+    elapsed = now() - start;
+    printf("dump of %zu values, %-12s %8.3f ms\n", values, "text", elapsed * 1e3);
+
+    start = now();
+    if (ca_dump(&writer, &calc, CA_DUMP_BINARY) || ca_writer_flush(&writer))
+        exit(1);
+    elapsed = now() - start;
+    printf("dump of %zu values, %-12s %8.3f ms\n", values, "binary", elapsed * 1e3);
+
+    ca_writer_cleanup(&writer);
+    ca_cleanup(&calc);
+    fclose(out);
+    return 0;
+}
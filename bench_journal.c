@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "libcalc.h"
+#include "libcalc_journal.h"
+
+#define DEFAULT_OPERATIONS 100000
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Accumulate values in a journaled context, committing groups of
+ * several sizes.
+ */
+int main(int argc, char **argv)
+{
+    size_t operations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_OPERATIONS;
+    static const size_t groups[] = { 1, 16, 256, 4096 };
+    char path[] = "/tmp/bench_journal.XXXXXX";
+
+    if (mkdtemp(path) == NULL)
+        exit(1);
+
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        char log[sizeof(path) + 16], snapshot[sizeof(log) + 16];
+        ca_journal_t journal;
+        ca_calc_t calc;
+
+        snprintf(log, sizeof(log), "%s/log", path);
+        snprintf(snapshot, sizeof(snapshot), "%s.snapshot", log);
+        unlink(log);
+        unlink(snapshot);
+
+        /* a single group of records takes long to sync, do less */
+        size_t count = groups[g] == 1 ? operations / 100 : operations;
+        if (ca_initialize(&calc, 16) < 0 || ca_journal_open(&journal, log, &calc, groups[g]) < 0)
+            exit(1);
+        ca_journal_push(&journal, &calc, 0);
+
+        double start = now();
+        for (size_t i = 0; i < count; i++) {
+            ca_journal_push(&journal, &calc, i & 0xff);
+            ca_journal_operate(&journal, &calc, CA_OP_ADD);
+        }
+        ca_journal_commit(&journal);
+        double elapsed = now() - start;
+        printf("%zu journaled accumulations, groups of %-5zu %8.3f s %9.1f ns/op\n", count, groups[g],
+               elapsed, elapsed * 1e9 / count);
+
+        start = now();
+        ca_journal_close(&journal);
+        if (ca_journal_open(&journal, log, &calc, groups[g]) < 0)
+            exit(1);
+        elapsed = now() - start;
+        printf("%zu journaled accumulations, replay           %8.3f s\n", count, elapsed);
+
+        ca_journal_close(&journal);
+        ca_cleanup(&calc);
+        unlink(log);
+        unlink(snapshot);
+    }
+    rmdir(path);
+    return 0;
+}
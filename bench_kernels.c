@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "libcalc.h"
+#include "libcalc_kernels.h"
+
+#define DEFAULT_VALUES (32UL << 20)
+#define ROUNDS 8
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fill(ca_calc_t *calc, size_t values)
+{
+    ca_remove(calc, 0);
+    for (size_t i = 0; i < values; i++)
+        ca_push(calc, (ca_value_t) (i * 2654435761UL % 1000003) - 500000);
+}
+
+/**
+ * Sum a large stack with the kernels selected for the cpu, set
+ * LIBCALC_ISA to compare the instruction sets.
+ */
+int main(int argc, char **argv)
+{
+    size_t values = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_VALUES;
+    ca_calc_t calc;
+    double elapsed = 0;
+
+    if (ca_initialize(&calc, values) < 0)
+        exit(1);
+
+    for (unsigned r = 0; r < ROUNDS; r++) {
+        fill(&calc, values);
+        double start = now();
+        if (ca_sum(&calc, values) < 0)
+            exit(1);
+        elapsed += now() - start;
+    }
+    printf("sum of %zu values, %-8s kernels %8.3f s %6.3f ns/value\n", values, ca_kernels_isa(),
+           elapsed / ROUNDS, elapsed * 1e9 / ROUNDS / values);
+
+    fill(&calc, values);
+    double start = now();
+    while (ca_count(&calc) > 1)
+        ca_operate(&calc, CA_OP_ADD);
+    elapsed = now() - start;
+    printf("sum of %zu values, additions        %8.3f s %6.3f ns/value\n", values, elapsed, elapsed * 1e9 / values);
+
+    ca_cleanup(&calc);
+    return 0;
+}
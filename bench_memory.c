@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "libcalc.h"
+#include "libcalc_memory.h"
+
+#define DEFAULT_VALUES (32UL << 20)
+#define DEFAULT_CONTEXTS 65536
+#define CONTEXT_SIZE 256
+#define ROUNDS (8UL << 20)
+
+static const struct {
+    const char *name;
+    int mapped;
+    unsigned flags;
+    /** A stack in a temporary file, for large stacks only */
+    int file;
+} modes[] = {
+    { "calloc", 0, 0, 0 },
+    { "mapped", 1, 0, 0 },
+    { "huge pages", 1, CA_MEMORY_HUGE_PAGES, 0 },
+    { "huge pages, numa local", 1, CA_MEMORY_HUGE_PAGES | CA_MEMORY_NUMA_LOCAL, 0 },
+    { "file", 0, 0, 1 },
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Push values on a large stack then add them all.
+ */
+static void bench_reduction(size_t values)
+{
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        ca_calc_t calc;
+        int retval = modes[m].file ? ca_initialize_file(&calc, values, NULL, 0) :
+            modes[m].mapped ? ca_initialize_mapped(&calc, values, modes[m].flags) : ca_initialize(&calc, values);
+        if (retval < 0)
+            exit(1);
+
+        double start = now();
+        for (size_t i = 0; i < values; i++)
+            ca_push(&calc, i & 0xff);
+        while (ca_count(&calc) > 1)
+            ca_operate(&calc, CA_OP_ADD);
+        double elapsed = now() - start;
+
+        printf("reduction of %zu values, %-24s %8.3f s %6.2f ns/value\n", values, modes[m].name,
+               elapsed, elapsed * 1e9 / values);
+        ca_cleanup(&calc);
+    }
+}
+
+/**
+ * Accumulate values in contexts picked at random.
+ */
+static void bench_contexts(size_t count)
+{
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        ca_pool_t pool;
+        ca_calc_t *calcs = NULL;
+
+        if (modes[m].file)
+            continue;
+
+        if (modes[m].mapped) {
+            if (ca_pool_initialize(&pool, count, CONTEXT_SIZE, modes[m].flags) < 0)
+                exit(1);
+        } else {
+            calcs = calloc(count, sizeof(ca_calc_t));
+            for (size_t i = 0; i < count; i++)
+                if (calcs == NULL || ca_initialize(calcs + i, CONTEXT_SIZE) < 0)
+                    exit(1);
+        }
+
+        unsigned long seed = 42;
+        for (size_t i = 0; i < count; i++)
+            ca_push(calcs ? calcs + i : ca_pool_get(&pool, i), 0);
+
+        double start = now();
+        for (size_t r = 0; r < ROUNDS; r++) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            ca_calc_t *calc = calcs ? calcs + (seed >> 33) % count : ca_pool_get(&pool, (seed >> 33) % count);
+            ca_push(calc, 1);
+            ca_operate(calc, CA_OP_ADD);
+        }
+        double elapsed = now() - start;
+
+        printf("%lu random accumulations over %zu contexts, %-24s %8.3f s %6.2f ns/op\n", ROUNDS, count,
+               modes[m].name, elapsed, elapsed * 1e9 / ROUNDS);
+
+        if (calcs) {
+            for (size_t i = 0; i < count; i++)
+                ca_cleanup(calcs + i);
+            free(calcs);
+        } else {
+            ca_pool_cleanup(&pool);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t values = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_VALUES;
+    size_t contexts = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_CONTEXTS;
+
+    bench_reduction(values);
+    bench_contexts(contexts);
+    return 0;
+}
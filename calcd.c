@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "libcalc.h"
+#include "libcalc_format.h"
+
+#define STACK_SIZE 64
+/* size of the input and output buffers of each connection */
+#define BUFFER_SIZE 4096
+/* longest response, "ok " followed by a value and a newline */
+#define RESPONSE_SIZE (CA_VALUE_DIGITS + 4)
+#define MAX_EVENTS 256
+
+/**
+ * A client, with its own context.
+ */
+typedef struct connection {
+    int fd;
+    ca_calc_t calc;
+    /** The requests read and not run yet */
+    char in[BUFFER_SIZE];
+    size_t in_used;
+    /** The responses not sent yet */
+    ca_writer_t out;
+    /** The events waited for */
+    unsigned events;
+    /** Set by quit, the connection is closed once the responses are sent */
+    int closing;
+} connection_t;
+
+/**
+ * A thread serving the connections it accepted.
+ */
+typedef struct worker {
+    pthread_t thread;
+    int epoll;
+    int listener;
+    unsigned cpu;
+} worker_t;
+
+static const struct {
+    const char *command;
+    ca_operation_t op;
+} operations[] = {
+    { "+", CA_OP_ADD },
+    { "-", CA_OP_SUBSTRACT },
+    { "*", CA_OP_MULTIPLY },
+    { "/", CA_OP_DIVIDE },
+    { "%", CA_OP_MODULO },
+    { "**", CA_OP_POWER },
+    { "sqrt", CA_OP_SQUARE_ROOT },
+    { "<<", CA_OP_LEFT_SHIFT },
+    { ">>", CA_OP_RIGHT_SHIFT },
+    { "==", CA_OP_EQUAL },
+    { "!=", CA_OP_NOT_EQUAL },
+    { "<", CA_OP_LESS },
+    { "<=", CA_OP_LESS_EQUAL },
+    { ">", CA_OP_GREATER },
+    { ">=", CA_OP_GREATER_EQUAL },
+    { "dup", CA_OP_DUPLICATE },
+    { "swap", CA_OP_SWAP },
+    { "over", CA_OP_OVER },
+    { "rot", CA_OP_ROTATE },
+    { "drop", CA_OP_DROP },
+};
+
+#define OPERATION_COUNT (sizeof(operations) / sizeof(operations[0]))
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: calcd [-t threads] socket\n"
+            "\n"
+            "Serve calculators on a unix domain socket, each connection having its\n"
+            "own stack. Clients send the commands of the calculator, one per line,\n"
+            "and may send many before reading the responses. Each command is\n"
+            "answered by a line: \"ok\" followed by the top of the stack, \"ok\" for\n"
+            "an empty stack, or \"error\". quit closes the connection.\n"
+            "\n"
+            "The connections are served by one thread per cpu, or by the given\n"
+            "number of threads.\n");
+    exit(1);
+}
+
+/**
+ * Run a command.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int run(connection_t *conn, const char *line)
+{
+    ca_calc_t *calc = &conn->calc;
+
+    for (size_t i = 0; i < OPERATION_COUNT; i++)
+        if (strcmp(line, operations[i].command) == 0)
+            return ca_operate(calc, operations[i].op);
+
+    if (strcmp(line, "pop") == 0) {
+        if (ca_count(calc) == 0)
+            return -1;
+        ca_pop(calc);
+        return 0;
+    }
+    if (strcmp(line, "empty") == 0) {
+        ca_remove(calc, 0);
+        return 0;
+    }
+    if (strcmp(line, "quit") == 0) {
+        conn->closing = 1;
+        return 0;
+    }
+
+    char *end;
+    errno = 0;
+    ca_value_t value = strtol(line, &end, 10);
+    if (errno == ERANGE || end == line || *end != '\0' || ca_space_left(calc) == 0)
+        return -1;
+    ca_push(calc, value);
+    return 0;
+}
+
+/**
+ * Run the complete lines read, while there is room for their response.
+ */
+static void run_lines(connection_t *conn)
+{
+    size_t start = 0;
+    char *newline;
+
+    while (!conn->closing && conn->out.size - conn->out.used >= RESPONSE_SIZE &&
+           (newline = memchr(conn->in + start, '\n', conn->in_used - start))) {
+        char *line = conn->in + start;
+
+        start = newline + 1 - conn->in;
+        if (newline > line && newline[-1] == '\r')
+            newline--;
+        *newline = '\0';
+
+        if (run(conn, line)) {
+            ca_writer_write(&conn->out, "error\n", 6);
+        } else if (ca_count(&conn->calc)) {
+            ca_writer_write(&conn->out, "ok ", 3);
+            ca_writer_value(&conn->out, ca_top(&conn->calc));
+            ca_writer_write(&conn->out, "\n", 1);
+        } else {
+            ca_writer_write(&conn->out, "ok\n", 3);
+        }
+    }
+
+    memmove(conn->in, conn->in + start, conn->in_used - start);
+    conn->in_used -= start;
+}
+
+/**
+ * Send the pending responses in a single write.
+ *
+ * @return 0 on success, -1 if the connection is broken.
+ */
+static int send_responses(connection_t *conn)
+{
+    if (conn->out.used == 0)
+        return 0;
+
+    ssize_t sent = send(conn->fd, conn->out.buffer, conn->out.used, MSG_NOSIGNAL);
+    if (sent < 0)
+        return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+    memmove(conn->out.buffer, conn->out.buffer + sent, conn->out.used - sent);
+    conn->out.used -= sent;
+    return 0;
+}
+
+static void close_connection(worker_t *worker, connection_t *conn)
+{
+    epoll_ctl(worker->epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    ca_writer_cleanup(&conn->out);
+    ca_cleanup(&conn->calc);
+    free(conn);
+}
+
+/**
+ * Read requests, run them and send their responses in batches.
+ *
+ * While responses are pending the connection is not read, so that a
+ * client not reading its responses does not make the daemon buffer
+ * them without bounds.
+ */
+static void serve(worker_t *worker, connection_t *conn, unsigned events)
+{
+    if (events & (EPOLLERR | EPOLLHUP))
+        goto close;
+
+    if ((events & EPOLLIN) && conn->out.used == 0 && !conn->closing) {
+        ssize_t received = recv(conn->fd, conn->in + conn->in_used, BUFFER_SIZE - conn->in_used, 0);
+        if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR))
+            goto close;
+        if (received > 0)
+            conn->in_used += received;
+    }
+
+    do {
+        run_lines(conn);
+        if (send_responses(conn))
+            goto close;
+    } while (conn->out.used == 0 && !conn->closing && memchr(conn->in, '\n', conn->in_used));
+
+    if (conn->in_used == BUFFER_SIZE && !memchr(conn->in, '\n', conn->in_used)) {
+        fprintf(stderr, "request too long, closing connection.\n");
+        goto close;
+    }
+    if (conn->closing && conn->out.used == 0)
+        goto close;
+
+    unsigned wanted = conn->out.used ? EPOLLOUT : EPOLLIN;
+    if (wanted != conn->events) {
+        struct epoll_event event = { .events = wanted, .data.ptr = conn };
+        if (epoll_ctl(worker->epoll, EPOLL_CTL_MOD, conn->fd, &event) < 0)
+            goto close;
+        conn->events = wanted;
+    }
+    return;
+
+close:
+    close_connection(worker, conn);
+}
+
+static void accept_connections(worker_t *worker)
+{
+    for (;;) {
+        int fd = accept4(worker->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR)
+                perror("accept");
+            return;
+        }
+
+        connection_t *conn = malloc(sizeof(connection_t));
+        if (conn == NULL || ca_initialize(&conn->calc, STACK_SIZE) < 0) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        if (ca_writer_initialize(&conn->out, -1, NULL, BUFFER_SIZE) < 0) {
+            ca_cleanup(&conn->calc);
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->in_used = 0;
+        conn->events = EPOLLIN;
+        conn->closing = 0;
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("epoll_ctl");
+            close_connection(worker, conn);
+        }
+    }
+}
+
+static void *work(void *arg)
+{
+    worker_t *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    for (;;) {
+        int count = epoll_wait(worker->epoll, events, MAX_EVENTS, -1);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_connections(worker);
+            else
+                serve(worker, events[i].data.ptr, events[i].events);
+        }
+    }
+    return NULL;
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct stat st;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path is too long.\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    /* a socket left by a previous daemon */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long cpus = threads > 0 ? threads : 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't')
+            threads = strtol(optarg, NULL, 10);
+        else
+            usage();
+    }
+    if (optind + 1 != argc || threads < 1)
+        usage();
+
+    const char *path = argv[optind];
+    int listener = listen_on(path);
+    if (listener < 0)
+        exit(1);
+
+    /* the workers inherit the mask, main waits for the signals */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    if (workers == NULL)
+        exit(1);
+
+    for (long i = 0; i < threads; i++) {
+        /* a single worker is woken to accept each connection */
+        struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+
+        workers[i].listener = listener;
+        workers[i].cpu = i % cpus;
+        workers[i].epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].epoll < 0 || epoll_ctl(workers[i].epoll, EPOLL_CTL_ADD, listener, &event) < 0) {
+            perror("epoll");
+            exit(1);
+        }
+        if (pthread_create(&workers[i].thread, NULL, work, workers + i)) {
+            fprintf(stderr, "unable to start worker.\n");
+            exit(1);
+        }
+    }
+
+    int signal;
+    sigwait(&signals, &signal);
+    unlink(path);
+    return 0;
+}
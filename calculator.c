@@ -2,32 +2,52 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include "libcalc.h"
+#include "libcalc_format.h"
 
 #define STACK_SIZE 64
 #define PROMPT "\n> "
 
-static void prompt(ca_calc_t *calc)
+static void prompt(ca_calc_t *calc, ca_writer_t *out)
 {
-    printf("stack:");
-    ca_value_t *v;
-    ca_stack_for_each(calc, v) {
-        printf(" %ld", *v);
-    }
-    printf(PROMPT);
+    /* the messages printed since the last prompt go first */
     fflush(stdout);
+    ca_writer_write(out, "stack:", 6);
+    if (ca_count(calc))
+        ca_writer_write(out, " ", 1);
+    ca_dump(out, calc, CA_DUMP_TEXT);
+    ca_writer_write(out, PROMPT, sizeof(PROMPT) - 1);
+    ca_writer_flush(out);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
+    unsigned digits = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        if (opt != 'd') {
+            fprintf(stderr, "usage: calculator [-d digits]\n\n"
+                    "With -d, compute with decimals having the given number of digits\n"
+                    "after the decimal point.\n");
+            exit(1);
+        }
+        digits = strtoul(optarg, NULL, 10);
+    }
+
     ca_calc_t calc;
-    if (ca_initialize(&calc, STACK_SIZE) < 0)
+    if (ca_initialize(&calc, STACK_SIZE) < 0 || ca_set_decimal(&calc, digits) < 0)
+        exit(1);
+
+    ca_writer_t out;
+    if (ca_writer_initialize(&out, STDOUT_FILENO, NULL, 4096) < 0)
         exit(1);
 
     char *line = NULL;
     size_t length;
 
-    prompt(&calc);
+    prompt(&calc, &out);
 
     while (getline(&line, &length, stdin) >= 0) {
         if (strcmp(line, "help\n") == 0) {
@@ -38,9 +58,16 @@ int main(void)
                    "*                   multiply\n"
                    "/                   divide\n"
                    "%%                   modulo\n"
+                   "**                  power\n"
                    "sqrt                square root\n"
                    "<<                  left shift\n"
                    ">>                  right shift\n"
+                   "== != < <= > >=     compare, giving 1 or 0\n"
+                   "dup                 duplicate the top value\n"
+                   "swap                exchange the two top values\n"
+                   "over                copy the value below the top\n"
+                   "rot                 move the third value to the top\n"
+                   "drop                remove the top value\n"
                    "pop                 pop a value from the stack\n"
                    "a number            push number on the stack\n"
                    "empty               empty the stack\n"
@@ -66,6 +93,9 @@ int main(void)
         else if (strcmp(line, "%\n") == 0) {
             ca_operate(&calc, CA_OP_MODULO);
         }
+        else if (strcmp(line, "**\n") == 0) {
+            ca_operate(&calc, CA_OP_POWER);
+        }
         else if (strcmp(line, "sqrt\n") == 0) {
             ca_operate(&calc, CA_OP_SQUARE_ROOT);
         }
@@ -75,6 +105,39 @@ int main(void)
         else if (strcmp(line, ">>\n") == 0) {
             ca_operate(&calc, CA_OP_RIGHT_SHIFT);
         }
+        else if (strcmp(line, "==\n") == 0) {
+            ca_operate(&calc, CA_OP_EQUAL);
+        }
+        else if (strcmp(line, "!=\n") == 0) {
+            ca_operate(&calc, CA_OP_NOT_EQUAL);
+        }
+        else if (strcmp(line, "<\n") == 0) {
+            ca_operate(&calc, CA_OP_LESS);
+        }
+        else if (strcmp(line, "<=\n") == 0) {
+            ca_operate(&calc, CA_OP_LESS_EQUAL);
+        }
+        else if (strcmp(line, ">\n") == 0) {
+            ca_operate(&calc, CA_OP_GREATER);
+        }
+        else if (strcmp(line, ">=\n") == 0) {
+            ca_operate(&calc, CA_OP_GREATER_EQUAL);
+        }
+        else if (strcmp(line, "dup\n") == 0) {
+            ca_operate(&calc, CA_OP_DUPLICATE);
+        }
+        else if (strcmp(line, "swap\n") == 0) {
+            ca_operate(&calc, CA_OP_SWAP);
+        }
+        else if (strcmp(line, "over\n") == 0) {
+            ca_operate(&calc, CA_OP_OVER);
+        }
+        else if (strcmp(line, "rot\n") == 0) {
+            ca_operate(&calc, CA_OP_ROTATE);
+        }
+        else if (strcmp(line, "drop\n") == 0) {
+            ca_operate(&calc, CA_OP_DROP);
+        }
         else if (strcmp(line, "pop\n") == 0) {
             if (ca_count(&calc) > 0)
                 ca_pop(&calc);
@@ -85,6 +148,17 @@ int main(void)
         else if (strcmp(line, "\n") == 0) {
             /* do nothing here */
         }
+        else if (digits) {
+            const char *end;
+            ca_value_t value;
+            if (ca_parse_decimal(line, digits, &value, &end) < 0 || *end != '\n') {
+                fprintf(stderr, "unable to parse command.\n");
+            } else if (ca_space_left(&calc)) {
+                ca_push(&calc, value);
+            } else {
+                fprintf(stderr, "stack is full.\n");
+            }
+        }
         else {
             char *endptr;
             errno = 0;
@@ -101,9 +175,10 @@ int main(void)
             }
         }
 
-        prompt(&calc);
+        prompt(&calc, &out);
     }
 
     free(line);
+    ca_writer_cleanup(&out);
     ca_cleanup(&calc);
 }
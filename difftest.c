@@ -0,0 +1,118 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "libcalc.h"
+#include "libcalc_program.h"
+#include "testsuite.h"
+
+/**
+ * The functions generated by mkfunc from difftest.functions.
+ */
+extern const ca_generated_t difftest_functions[];
+extern const size_t difftest_functions_count;
+
+#define DIFFTEST_ROUNDS 10000
+
+/**
+ * Values likely to hit the overflow and division checks.
+ */
+static const ca_value_t edges[] = {
+    0, 1, -1, 2, -2, 7, -7, 3037000499, -3037000499, 3037000500, -3037000500,
+    CA_VALUE_MAX, CA_VALUE_MAX - 1, CA_VALUE_MIN, CA_VALUE_MIN + 1,
+};
+
+#define EDGE_COUNT (sizeof(edges) / sizeof(edges[0]))
+
+static uint64_t next_random(uint64_t *state)
+{
+    /* xorshift64 */
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Draw a variable value.
+ */
+static ca_value_t draw(uint64_t *state)
+{
+    uint64_t r = next_random(state);
+
+    switch (r % 4) {
+    case 0:
+        return edges[(r >> 8) % EDGE_COUNT];
+    case 1:
+        return (ca_value_t) (r >> 8) % 100 - 50;
+    case 2:
+        return (ca_value_t) (r >> 8) % 6000000000 - 3000000000;
+    default:
+        return (ca_value_t) next_random(state);
+    }
+}
+
+static void test_function(const ca_generated_t *f, uint64_t *state)
+{
+    ca_program_t prog;
+    const size_t rounds = EDGE_COUNT * EDGE_COUNT + DIFFTEST_ROUNDS;
+    size_t count = f->variable_count;
+    unsigned mismatches = 0, block_mismatches = 0, failures = 0;
+
+    check_success(ca_compile(&prog, f->source, f->syntax));
+    check(prog.variable_count == count, "%s should have the variables of its program", f->name);
+
+    ca_value_t *rows = calloc(rounds * (count ? count : 1), sizeof(ca_value_t));
+    ca_value_t *expected = calloc(rounds, sizeof(ca_value_t));
+    ca_value_t *results = calloc(rounds, sizeof(ca_value_t));
+    int *expected_status = calloc(rounds, sizeof(int));
+    int *status = calloc(rounds, sizeof(int));
+    check(rows && expected && results && expected_status && status, "%s should allocate its inputs", f->name);
+
+    /* every pair of edges in the first two variables, then random values */
+    for (size_t round = 0; round < rounds; round++) {
+        ca_value_t *vars = rows + round * count;
+        ca_value_t result = 0;
+        int result_status;
+
+        for (size_t i = 0; i < count; i++)
+            vars[i] = draw(state);
+        if (round < EDGE_COUNT * EDGE_COUNT) {
+            if (count > 0)
+                vars[0] = edges[round % EDGE_COUNT];
+            if (count > 1)
+                vars[1] = edges[round / EDGE_COUNT];
+        }
+        expected_status[round] = ca_eval(&prog, vars, count, expected + round);
+        result_status = f->run(vars, &result);
+        if (result_status != expected_status[round] || (result_status == 0 && result != expected[round]))
+            mismatches += 1;
+        failures += result_status != 0;
+    }
+
+    /* the block evaluator of ca_eval_many should agree row by row */
+    ca_eval_many(&prog, rows, rounds, results, status);
+    for (size_t round = 0; round < rounds; round++)
+        if (status[round] != expected_status[round] || (status[round] == 0 && results[round] != expected[round]))
+            block_mismatches += 1;
+
+    check(mismatches == 0, "%s should match the interpreter, %u mismatches", f->name, mismatches);
+    check(block_mismatches == 0, "%s should evaluate the same by blocks, %u mismatches", f->name, block_mismatches);
+    fprintf(stderr, "%s: %u of %zu inputs failed in both\n", f->name, failures, rounds);
+    free(status);
+    free(expected_status);
+    free(results);
+    free(expected);
+    free(rows);
+    ca_program_cleanup(&prog);
+}
+
+int main(void)
+{
+    uint64_t state = 0x9e3779b97f4a7c15;
+
+    check(difftest_functions_count > 0, "functions should be generated");
+    for (size_t i = 0; i < difftest_functions_count; i++)
+        test_function(difftest_functions + i, &state);
+    return 0;
+}
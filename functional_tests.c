@@ -1,6 +1,27 @@
 #include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include "libcalc.h"
+#include "libcalc_program.h"
+#include "libcalc_divide.h"
+#include "libcalc_shared.h"
+#include "libcalc_profile.h"
+#include "libcalc_memory.h"
+#include "libcalc_format.h"
+#include "libcalc_cells.h"
+#include "libcalc_journal.h"
+#include "libcalc_segment.h"
+#include "libcalc_batch.h"
+#include "libcalc_kernels.h"
+#include "libcalc_columns.h"
 #include "testsuite.h"
 
 static void test_initialize_cleanup(void)
@@ -177,6 +198,1262 @@ static void test_right_shift(void)
     ca_cleanup(&calc);
  }
 
+static void test_compile_eval(void)
+{
+    ca_program_t prog;
+    ca_value_t result;
+
+    check_failure(ca_compile(&prog, "a b", CA_SYNTAX_RPN));
+    check_failure(ca_compile(&prog, "a +", CA_SYNTAX_RPN));
+    check_failure(ca_compile(&prog, "(a + b", CA_SYNTAX_INFIX));
+    check_failure(ca_compile(&prog, "a + * b", CA_SYNTAX_INFIX));
+
+    check_success(ca_compile(&prog, "(a + b) * c - -4 / sqrt(d) % 3 << 1", CA_SYNTAX_INFIX));
+    check(prog.variable_count == 4, "compiling should create a slot per variable");
+    check(ca_program_variable(&prog, "a") == 0, "slots should be numbered in order of appearance");
+    check(ca_program_variable(&prog, "d") == 3, "slots should be numbered in order of appearance");
+    check(ca_program_variable(&prog, "e") == -1, "unknown variables should not have a slot");
+
+    ca_value_t vars[] = { 2, 3, 4, 16 };
+    check_success(ca_eval(&prog, vars, 4, &result));
+    check(result == (((2 + 3) * 4 - -4 / 4 % 3) << 1), "eval should follow infix precedence, got %ld", result);
+    check_failure(ca_eval(&prog, vars, 3, &result));
+    vars[3] = -1;
+    check_failure(ca_eval(&prog, vars, 4, &result));
+    ca_program_cleanup(&prog);
+
+    check_success(ca_compile(&prog, "x y - 3 *", CA_SYNTAX_RPN));
+    ca_value_t rows[] = { 5, 2, 1, 4, CA_VALUE_MIN, 1 };
+    ca_value_t results[3];
+    int status[3];
+    check_failure(ca_eval_many(&prog, rows, 3, results, status));
+    check(status[0] == 0 && results[0] == 9, "eval_many should evaluate each binding");
+    check(status[1] == 0 && results[1] == -9, "eval_many should evaluate each binding");
+    check(status[2] == -1, "eval_many should report failed bindings");
+    check_success(ca_eval_many(&prog, rows, 2, results, NULL));
+
+    ca_calc_t calc;
+    check_success(ca_initialize(&calc, 3));
+    ca_push(&calc, 7);
+    check_success(ca_run(&calc, &prog, rows));
+    check(ca_count(&calc) == 2 && ca_top(&calc) == 9, "run should push the result on the context");
+    check_failure(ca_run(&calc, &prog, rows));
+    ca_cleanup(&calc);
+    ca_program_cleanup(&prog);
+}
+
+static void test_divider(void)
+{
+    static const ca_value_t divisors[] = {
+        1, -1, 2, -2, 3, -3, 5, -7, 10, 641, -1000, 1L << 20, 6700417,
+        CA_VALUE_MAX, CA_VALUE_MAX - 1, CA_VALUE_MIN, CA_VALUE_MIN + 1
+    };
+    ca_value_t values[64] = {
+        0, 1, -1, 2, -2, 7, -7, 641, -641, CA_VALUE_MAX, CA_VALUE_MIN + 1, CA_VALUE_MAX - 1,
+    };
+    ca_value_t quotients[64], remainders[64];
+    ca_divider_t divider;
+    unsigned long seed = 1;
+
+    for (size_t i = 12; i < 64; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        values[i] = (ca_value_t) seed >> (i % 60);
+    }
+
+    check_failure(ca_divider_init(&divider, 0));
+
+    for (size_t d = 0; d < sizeof(divisors) / sizeof(divisors[0]); d++) {
+        check_success(ca_divider_init(&divider, divisors[d]));
+        check_success(ca_divide_array(&divider, values, quotients, 64));
+        ca_modulo_array(&divider, values, remainders, 64);
+        for (size_t i = 0; i < 64; i++) {
+            if (quotients[i] != values[i] / divisors[d] || remainders[i] != values[i] % divisors[d])
+                check(0, "%ld / %ld should give %ld, %ld", values[i], divisors[d],
+                      values[i] / divisors[d], values[i] % divisors[d]);
+        }
+    }
+
+    check_success(ca_divider_init(&divider, CA_VALUE_MIN));
+    check(ca_divider_divide(&divider, CA_VALUE_MIN) == 1, "dividing by itself should give 1");
+    check_success(ca_divider_init(&divider, -1));
+    values[0] = CA_VALUE_MIN;
+    check_failure(ca_divide_array(&divider, values, quotients, 1));
+    check(ca_divider_modulo(&divider, CA_VALUE_MIN) == 0, "modulo by -1 should give 0");
+
+    ca_program_t prog;
+    ca_value_t result;
+    check_success(ca_compile(&prog, "x / -7 + x % 10", CA_SYNTAX_INFIX));
+    check(prog.code[1].code == CA_INS_DIVIDE_CONST, "compiling should detect constant divisors");
+    check(prog.divider_count == 2, "compiling should precompute constant divisors");
+    values[0] = -1234;
+    check_success(ca_eval(&prog, values, 1, &result));
+    check(result == -1234 / -7 + -1234 % 10, "constant division should follow C semantics");
+    ca_program_cleanup(&prog);
+
+    check_success(ca_compile(&prog, "x -1 /", CA_SYNTAX_RPN));
+    values[0] = CA_VALUE_MIN;
+    check_failure(ca_eval(&prog, values, 1, &result));
+    ca_program_cleanup(&prog);
+}
+
+static void test_run_budget(void)
+{
+    ca_program_t prog;
+    ca_calc_t calc, other;
+    ca_cursor_t cursor, other_cursor;
+    ca_value_t vars[] = { 3, 0 };
+    unsigned slices = 0;
+    int retval, other_retval;
+
+    check_success(ca_compile(&prog, "(x + 1) * (x + 2) * (x + 3) - x / 2 + x % 7", CA_SYNTAX_INFIX));
+    check_success(ca_initialize(&calc, prog.depth));
+    check_success(ca_initialize(&other, prog.depth));
+
+    ca_cursor_init(&cursor, vars);
+    ca_cursor_init(&other_cursor, vars + 1);
+    do {
+        retval = ca_run_budget(&calc, &prog, &cursor, 2);
+        other_retval = ca_run_budget(&other, &prog, &other_cursor, 3);
+        check(retval >= 0 && other_retval >= 0, "budgeted runs should succeed");
+        slices += 1;
+    } while (retval == 1);
+
+    check(slices == (prog.length + 1) / 2, "each slice should run at most the budget");
+    check(other_retval == 0, "interleaved runs should complete");
+    check(cursor.pc == prog.length, "the cursor should be at the end of the program");
+    check(ca_top(&calc) == 4 * 5 * 6 - 3 / 2 + 3 % 7, "a sliced run should give the same result");
+    check(ca_top(&other) == 6, "interleaved runs should not interfere");
+    check(ca_run_budget(&calc, &prog, &cursor, 5) == 0, "running a done program should do nothing");
+    ca_program_cleanup(&prog);
+
+    check_success(ca_compile(&prog, "x 0 - 2 * 1 /", CA_SYNTAX_RPN));
+    ca_remove(&calc, 0);
+    vars[0] = CA_VALUE_MAX;
+    ca_cursor_init(&cursor, vars);
+    check(ca_run_budget(&calc, &prog, &cursor, 2) == 1, "the budget should suspend the run");
+    check_failure(ca_run_budget(&calc, &prog, &cursor, 10));
+    check(cursor.pc == 4, "the cursor should be on the failing instruction");
+
+    ca_cleanup(&other);
+    ca_cleanup(&calc);
+    ca_program_cleanup(&prog);
+}
+
+static void test_control_flow(void)
+{
+    ca_program_t prog;
+    ca_value_t result;
+    ca_value_t vars[2];
+
+    check_failure(ca_compile(&prog, "x jz end 1 end:", CA_SYNTAX_RPN));
+    check_failure(ca_compile(&prog, "x jmp nowhere", CA_SYNTAX_RPN));
+    check_failure(ca_compile(&prog, "loop: x jmp loop", CA_SYNTAX_RPN));
+    check_failure(ca_compile(&prog, "x dup", CA_SYNTAX_INFIX));
+
+    /* repeated squaring: x^(2^n) */
+    check_success(ca_compile(&prog, "x n loop: swap dup * swap 1 - dup jnz loop drop", CA_SYNTAX_RPN));
+    vars[0] = 3;
+    vars[1] = 3;
+    check_success(ca_eval(&prog, vars, 2, &result));
+    check(result == 6561, "loops should run inside the program, got %ld", result);
+    vars[1] = 7;
+    check_failure(ca_eval(&prog, vars, 2, &result));
+    ca_program_cleanup(&prog);
+
+    /* accumulate until the counter reaches 0, the divider stays on its label */
+    check_success(ca_compile(&prog, "0 n loop: swap over + swap 1 - dup 0 > jnz loop drop 2 /", CA_SYNTAX_RPN));
+    vars[0] = 100;
+    check_success(ca_eval(&prog, vars, 1, &result));
+    check(result == 2525, "accumulation should stop on the condition, got %ld", result);
+    ca_program_cleanup(&prog);
+
+    /* maximum of two values */
+    check_success(ca_compile(&prog, "a b over over < jz first swap first: drop", CA_SYNTAX_RPN));
+    vars[0] = 5;
+    vars[1] = 2;
+    check_success(ca_eval(&prog, vars, 2, &result));
+    check(result == 5, "conditional jumps should select a branch, got %ld", result);
+    vars[0] = 1;
+    check_success(ca_eval(&prog, vars, 2, &result));
+    check(result == 2, "conditional jumps should select a branch, got %ld", result);
+    ca_program_cleanup(&prog);
+
+    check_success(ca_compile(&prog, "a b c rot + * jmp end 0 end:", CA_SYNTAX_RPN));
+    ca_value_t three[] = { 2, 3, 4 };
+    check_success(ca_eval(&prog, three, 3, &result));
+    check(result == 3 * (4 + 2), "rot should move the third value to the top, got %ld", result);
+    ca_program_cleanup(&prog);
+
+    check_success(ca_compile(&prog, "a + 1 >= b == (a != b)", CA_SYNTAX_INFIX));
+    check_success(ca_eval(&prog, vars, 2, &result));
+    check(result == 1, "comparisons should follow C precedence");
+    ca_program_cleanup(&prog);
+}
+
+static void test_profile_superinstructions(void)
+{
+    ca_program_t prog;
+    ca_profile_t profile;
+    ca_calc_t calc;
+    ca_value_t vars[] = { CA_VALUE_MAX, 1, 1, 2 };
+    char path[] = "/tmp/libcalc_profile_XXXXXX";
+    char *line = NULL;
+    size_t length;
+    int found = 0;
+
+    check_success(ca_compile(&prog, "a b c * + d * a b - *", CA_SYNTAX_RPN));
+    check_success(ca_initialize(&calc, prog.depth));
+
+    /* fused or not, the operations should fail the same way */
+    check_failure(ca_run(&calc, &prog, vars));
+    check(ca_count(&calc) == 2, "a failing run should stop on the failing operation");
+    check(ca_top(&calc) == 1, "the operations before the failing one should be applied");
+    ca_remove(&calc, 0);
+
+    vars[0] = 3;
+    check_success(ca_run(&calc, &prog, vars));
+    check(ca_pop(&calc) == (3 + 1 * 1) * 2 * (3 - 1), "fused operations should give the same result");
+
+    check_success(ca_profile_initialize(&profile));
+    check_success(ca_profile_run(&profile, &calc, &prog, vars));
+    check(ca_pop(&calc) == 16, "profiled runs should give the same result");
+
+    int fd = mkstemp(path);
+    check(fd >= 0, "temporary file should be created");
+    close(fd);
+    check_success(ca_profile_save(&profile, path));
+    ca_profile_cleanup(&profile);
+
+    FILE *in = fopen(path, "r");
+    while (getline(&line, &length, in) >= 0)
+        found += strcmp(line, "1 substract multiply\n") == 0 || strcmp(line, "1 multiply add\n") == 0;
+    check(found == 2, "the profile should count consecutive operations");
+    free(line);
+    fclose(in);
+    unlink(path);
+
+    ca_cleanup(&calc);
+    ca_program_cleanup(&prog);
+}
+
+static void test_mapped_memory(void)
+{
+    ca_calc_t calc;
+    ca_pool_t pool;
+
+    check_success(ca_initialize_mapped(&calc, 1 << 20, CA_MEMORY_HUGE_PAGES | CA_MEMORY_NUMA_LOCAL));
+    check(ca_space_left(&calc) == 1 << 20, "a mapped stack should have the requested size");
+    for (unsigned i = 0; i < 1 << 20; i++)
+        ca_push(&calc, 1);
+    while (ca_count(&calc) > 1)
+        check_success(ca_operate(&calc, CA_OP_ADD));
+    check(ca_top(&calc) == 1 << 20, "a mapped stack should hold every value");
+    ca_cleanup(&calc);
+
+    check_success(ca_pool_initialize(&pool, 100, 1000, CA_MEMORY_NUMA_LOCAL));
+    for (unsigned i = 0; i < 100; i++) {
+        ca_calc_t *c = ca_pool_get(&pool, i);
+        check(ca_space_left(c) == 1000, "pool contexts should have the requested size");
+        ca_push(c, i);
+    }
+    for (unsigned i = 0; i < 100; i++)
+        check(ca_top(ca_pool_get(&pool, i)) == i, "pool stacks should not overlap");
+    ca_pool_cleanup(&pool);
+
+    check_success(ca_pool_initialize(&pool, 10, 4, 0));
+    check(ca_pool_get(&pool, 3)->stack == ca_pool_get(&pool, 3)->inline_stack, "small pool contexts should use their inline stack");
+    ca_pool_cleanup(&pool);
+}
+
+static void test_file_stack(void)
+{
+    ca_calc_t calc;
+
+    /* small segments, so that the top moves across many of them */
+    check_success(ca_initialize_file(&calc, 1 << 20, NULL, 1024));
+    check(ca_space_left(&calc) == 1 << 20, "a file stack should have the requested size");
+    for (unsigned i = 0; i < 1 << 20; i++)
+        ca_push(&calc, i);
+    check(ca_top(&calc) == (1 << 20) - 1, "a file stack should hold every value");
+
+    for (unsigned i = 0; i < 300000; i++)
+        check(ca_pop(&calc) == (1 << 20) - 1 - i, "values read back from the file should not change");
+    ca_remove(&calc, 500000);
+    check(ca_top(&calc) == (1 << 20) - 800001, "values read back from the file should not change");
+
+    while (ca_count(&calc) > 1)
+        check_success(ca_operate(&calc, CA_OP_ADD));
+    check(ca_top(&calc) == 248575L * 248576 / 2, "operations should reach the bottom of a file stack");
+
+    /* the top moving up and down over segment boundaries */
+    for (unsigned i = 0; i < 5000; i++) {
+        ca_push(&calc, i);
+        check_success(ca_operate(&calc, i % 2 ? CA_OP_DUPLICATE : CA_OP_DROP));
+    }
+    ca_cleanup(&calc);
+
+    check_failure(ca_initialize_file(&calc, 100, "/nonexistent", 0));
+}
+
+/**
+ * An arena counting the bytes in use, which checks that the library
+ * frees what it allocates with the right sizes.
+ */
+typedef struct test_arena {
+    char memory[1 << 20];
+    size_t used;
+    size_t live;
+    unsigned fail;
+} test_arena_t;
+
+static void *test_arena_alloc(void *data, size_t size)
+{
+    test_arena_t *arena = data;
+    size = (size + 15) & ~(size_t) 15;
+    if (arena->fail || arena->used + size > sizeof(arena->memory))
+        return NULL;
+    arena->used += size;
+    arena->live += size;
+    return arena->memory + arena->used - size;
+}
+
+static void test_arena_free(void *data, void *ptr, size_t size)
+{
+    test_arena_t *arena = data;
+    check((char *) ptr >= arena->memory && (char *) ptr < arena->memory + sizeof(arena->memory),
+          "the library should only free memory of its allocator");
+    arena->live -= (size + 15) & ~(size_t) 15;
+}
+
+static void *test_arena_realloc(void *data, void *ptr, size_t old_size, size_t size)
+{
+    void *grown = test_arena_alloc(data, size);
+    if (grown && ptr) {
+        memcpy(grown, ptr, old_size < size ? old_size : size);
+        test_arena_free(data, ptr, old_size);
+    }
+    return grown;
+}
+
+static void test_allocator(void)
+{
+    static test_arena_t arena;
+    const ca_allocator_t allocator = {
+        .alloc = test_arena_alloc,
+        .realloc = test_arena_realloc,
+        .free = test_arena_free,
+        .data = &arena
+    };
+    ca_calc_t calc;
+    ca_program_t prog;
+    ca_profile_t profile;
+    ca_shared_calc_t shared;
+    ca_value_t result, vars[] = { 7, 3 };
+
+    check_success(ca_initialize_allocator(&calc, 100, &allocator));
+    check(arena.live == 800, "a context should allocate its stack with its allocator");
+    ca_cleanup(&calc);
+    check(arena.live == 0, "a context should free its stack with its allocator");
+
+    check_success(ca_compile_allocator(&prog, "a 0 jz skip 100 / skip: b + sqrt", CA_SYNTAX_RPN,
+                                       &allocator));
+    check(arena.live > 0, "a program should be allocated with its allocator");
+    ca_program_cleanup(&prog);
+    check(arena.live == 0, "a program should be freed with its allocator");
+
+    arena.fail = 1;
+    check_failure(ca_initialize_allocator(&calc, 100, &allocator));
+    check_failure(ca_compile_allocator(&prog, "a b +", CA_SYNTAX_INFIX, &allocator));
+    arena.fail = 0;
+
+    ca_set_allocator(&allocator);
+    check(ca_get_allocator() == &allocator, "ca_set_allocator should set the default allocator");
+    check_success(ca_compile(&prog, "a * 8 + b % 3", CA_SYNTAX_INFIX));
+    check_success(ca_eval(&prog, vars, 2, &result));
+    check(result == 56, "a program using the default allocator should run");
+    check_success(ca_profile_initialize(&profile));
+    check_success(ca_shared_initialize(&shared, 100, 4));
+    check(((uintptr_t) shared.slots & 63) == 0, "the slots should be aligned on a cache line");
+    ca_set_allocator(NULL);
+
+    check_success(ca_initialize(&calc, 100));
+    check(calc.allocator != &allocator, "ca_set_allocator(NULL) should restore the default allocator");
+    ca_cleanup(&calc);
+
+    ca_shared_cleanup(&shared);
+    ca_profile_cleanup(&profile);
+    ca_program_cleanup(&prog);
+    check(arena.live == 0, "objects should be freed with the allocator they were initialized with");
+}
+
+static void test_format(void)
+{
+    static const ca_value_t values[] = { 0, 7, -7, 10, 99, -100, 1234567, CA_VALUE_MAX, CA_VALUE_MIN };
+    char buffer[64], expected[64];
+
+    for (unsigned i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        size_t length = ca_format_value(values[i], buffer);
+        buffer[length] = '\0';
+        snprintf(expected, sizeof(expected), "%ld", values[i]);
+        check(strcmp(buffer, expected) == 0, "ca_format_value should format like printf");
+    }
+
+    ca_calc_t calc;
+    ca_writer_t writer;
+    int fds[2];
+
+    check_success(ca_initialize(&calc, 10));
+    ca_push(&calc, 12);
+    ca_push(&calc, -3);
+    ca_push(&calc, CA_VALUE_MIN);
+
+    check_success(ca_writer_initialize(&writer, -1, buffer, sizeof(buffer)));
+    check_success(ca_dump(&writer, &calc, CA_DUMP_TEXT));
+    check(writer.used == 26 && memcmp(buffer, "12 -3 -9223372036854775808", 26) == 0,
+          "a text dump should separate the values by spaces");
+    check_success(ca_dump(&writer, &calc, CA_DUMP_TEXT));
+    check_failure(ca_dump(&writer, &calc, CA_DUMP_TEXT));
+    ca_writer_cleanup(&writer);
+
+    /* a small buffer is flushed while dumping */
+    check_success(pipe(fds));
+    check_success(ca_writer_initialize(&writer, fds[1], NULL, CA_VALUE_DIGITS + 1));
+    check_success(ca_dump(&writer, &calc, CA_DUMP_TEXT));
+    check_success(ca_dump(&writer, &calc, CA_DUMP_BINARY));
+    check_success(ca_writer_flush(&writer));
+    ca_writer_cleanup(&writer);
+    close(fds[1]);
+
+    ca_value_t dumped[3];
+    check(read(fds[0], buffer, 26) == 26 && memcmp(buffer, "12 -3 -9223372036854775808", 26) == 0,
+          "a flushed text dump should hold every value");
+    check(read(fds[0], dumped, sizeof(dumped)) == sizeof(dumped) && memcmp(dumped, calc.stack, sizeof(dumped)) == 0,
+          "a binary dump should hold the stack");
+    close(fds[0]);
+    ca_cleanup(&calc);
+}
+
+static void test_lazy(void)
+{
+    ca_calc_t calc;
+    ca_program_t prog;
+    ca_value_t *v, vars[] = { 3 };
+
+    check_success(ca_initialize(&calc, 100));
+    check_success(ca_set_lazy(&calc, 8));
+
+    ca_push(&calc, 5);
+    ca_push(&calc, 3);
+    check_success(ca_operate(&calc, CA_OP_ADD));
+    ca_push(&calc, 4);
+    check_success(ca_operate(&calc, CA_OP_MULTIPLY));
+    check(calc.top == 0, "lazy operations should be deferred");
+    check(ca_top(&calc) == 32, "observing the stack should apply the deferred operations");
+    check(ca_count(&calc) == 1, "the pushed operands should be consumed");
+
+    /* a full queue is applied */
+    for (unsigned i = 0; i < 4; i++) {
+        ca_push(&calc, 2);
+        check_success(ca_operate(&calc, CA_OP_ADD));
+    }
+    check(calc.top == 1 && calc.stack[0] == 40, "a full queue should be applied");
+
+    /* failures are reported by ca_flush */
+    ca_push(&calc, 0);
+    check_success(ca_operate(&calc, CA_OP_DIVIDE));
+    ca_push(&calc, 1);
+    check_success(ca_operate(&calc, CA_OP_ADD));
+    check_failure(ca_flush(&calc));
+    check(ca_count(&calc) == 2 && ca_top(&calc) == 0, "a failed run should leave the stack as the failing operation");
+    check_success(ca_flush(&calc));
+
+    /* failures of implicit flushes are kept */
+    ca_push(&calc, -1);
+    check_success(ca_operate(&calc, CA_OP_SQUARE_ROOT));
+    check(ca_count(&calc) == 2, "a failed square root should remove its operand");
+    check_failure(ca_flush(&calc));
+
+    ca_remove(&calc, 0);
+    ca_push(&calc, 7);
+    ca_push(&calc, 1);
+    check_success(ca_compile(&prog, "x 2 *", CA_SYNTAX_RPN));
+    check_success(ca_run(&calc, &prog, vars));
+    check(calc.top == 3 && calc.stack[1] == 1 && calc.stack[2] == 6, "a program should run after the deferred operations");
+    ca_program_cleanup(&prog);
+
+    ca_value_t sum = 0;
+    ca_push(&calc, 3);
+    ca_stack_for_each(&calc, v) {
+        sum += *v;
+    }
+    check(sum == 17, "iterating over the stack should apply the deferred operations");
+
+    ca_push(&calc, 1);
+    check_success(ca_operate(&calc, CA_OP_SUBSTRACT));
+    check_success(ca_set_lazy(&calc, 0));
+    check(calc.lazy == NULL && calc.top == 4 && calc.stack[3] == 2, "leaving the lazy mode should apply the deferred operations");
+    ca_cleanup(&calc);
+}
+
+static void test_cells(void)
+{
+    ca_sheet_t sheet;
+    ca_value_t value;
+    char name[32], source[64];
+
+    check_success(ca_sheet_initialize(&sheet));
+    long a = ca_sheet_input(&sheet, "a", 6);
+    long b = ca_sheet_input(&sheet, "b", 2);
+    long c = ca_sheet_input(&sheet, "c", 1);
+    check(a == 0 && b == 1 && c == 2, "cells should be numbered in order of creation");
+    long quotient = ca_sheet_formula(&sheet, "quotient", "a / b", CA_SYNTAX_INFIX);
+    long sign = ca_sheet_formula(&sheet, "sign", "c 0 >", CA_SYNTAX_RPN);
+    long total = ca_sheet_formula(&sheet, "total", "quotient * 10 + sign", CA_SYNTAX_INFIX);
+    check(quotient >= 0 && sign >= 0 && total >= 0, "formulas should be added");
+    check(ca_sheet_formula(&sheet, "d", "a + unknown", CA_SYNTAX_INFIX) == -1, "formulas should use existing cells");
+    check(ca_sheet_input(&sheet, "a", 1) == -1, "cell names should be unique");
+    check(ca_sheet_cell(&sheet, "total") == total, "ca_sheet_cell should find cells by name");
+
+    check(ca_sheet_update(&sheet, 1) == 3, "every new formula should be computed");
+    check(ca_sheet_value(&sheet, total, &value) == 0 && value == 31, "formulas should be computed from their cells");
+    check(ca_sheet_update(&sheet, 1) == 0, "nothing should be recomputed without changes");
+
+    ca_sheet_set(&sheet, c, 5);
+    check(ca_sheet_update(&sheet, 1) == 1, "a formula giving the same value should not propagate");
+
+    ca_sheet_set(&sheet, b, 3);
+    check(ca_sheet_update(&sheet, 1) == 2, "only the dependents of a changed input should be recomputed");
+    check(ca_sheet_value(&sheet, total, &value) == 0 && value == 21, "dependents should be recomputed");
+
+    ca_sheet_set(&sheet, b, 0);
+    ca_sheet_update(&sheet, 1);
+    check_failure(ca_sheet_value(&sheet, quotient, &value));
+    check_failure(ca_sheet_value(&sheet, total, &value));
+    ca_sheet_set(&sheet, b, 2);
+    ca_sheet_update(&sheet, 1);
+    check(ca_sheet_value(&sheet, total, &value) == 0 && value == 31, "failures should be recovered");
+
+    /* many independent chains, recomputed by several threads */
+    for (unsigned i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "in%u", i);
+        check(ca_sheet_input(&sheet, name, i) >= 0, "inputs should be added");
+        for (unsigned level = 0; level < 5; level++) {
+            snprintf(source, sizeof(source), level ? "x%u_%u 1 +" : "in%u 1 +", i, level - 1);
+            snprintf(name, sizeof(name), "x%u_%u", i, level);
+            check(ca_sheet_formula(&sheet, name, source, CA_SYNTAX_RPN) >= 0, "formulas should be added");
+        }
+    }
+    check(ca_sheet_update(&sheet, 4) == 5000, "every new formula should be computed");
+    for (unsigned i = 0; i < 1000; i += 2) {
+        snprintf(name, sizeof(name), "in%u", i);
+        ca_sheet_set(&sheet, ca_sheet_cell(&sheet, name), 2 * i);
+    }
+    check(ca_sheet_update(&sheet, 4) == 2495, "the dependents of the changed inputs should be recomputed");
+    check(ca_sheet_value(&sheet, ca_sheet_cell(&sheet, "x998_4"), &value) == 0 && value == 2001,
+          "chains should be recomputed in order");
+    check(ca_sheet_value(&sheet, ca_sheet_cell(&sheet, "x999_4"), &value) == 0 && value == 1004,
+          "unchanged chains should keep their values");
+
+    /* the threads are kept between updates */
+    struct ca_sheet_pool *pool = sheet.pool;
+    check(pool != NULL, "the update threads should be kept");
+    size_t recomputed = 0;
+    for (unsigned i = 0; i < 100; i++) {
+        ca_sheet_set(&sheet, ca_sheet_cell(&sheet, "in1"), 100 + i);
+        recomputed += ca_sheet_update(&sheet, 4);
+    }
+    check(recomputed == 500 && sheet.pool == pool, "small updates should reuse the threads");
+    ca_sheet_set(&sheet, ca_sheet_cell(&sheet, "in1"), 7);
+    check(ca_sheet_update(&sheet, 2) == 5, "the threads should be restarted for another count");
+    check(ca_sheet_value(&sheet, ca_sheet_cell(&sheet, "x1_4"), &value) == 0 && value == 12,
+          "chains should be recomputed by the new threads");
+
+    ca_sheet_cleanup(&sheet);
+}
+
+static void test_journal(void)
+{
+    char directory[] = "/tmp/libcalc_journal.XXXXXX", path[64], snapshot[80];
+    ca_journal_t journal;
+    ca_calc_t calc;
+
+    check(mkdtemp(directory) != NULL, "a temporary directory should be created");
+    snprintf(path, sizeof(path), "%s/log", directory);
+    snprintf(snapshot, sizeof(snapshot), "%s.snapshot", path);
+    check_success(ca_initialize(&calc, 100));
+
+    check_success(ca_journal_open(&journal, path, &calc, 4));
+    check(ca_count(&calc) == 0, "a new journal should give an empty stack");
+    check_success(ca_journal_push(&journal, &calc, 10));
+    check_success(ca_journal_push(&journal, &calc, -3));
+    check_success(ca_journal_operate(&journal, &calc, CA_OP_MULTIPLY));
+    check_success(ca_journal_push(&journal, &calc, CA_VALUE_MIN));
+    check_success(ca_journal_push(&journal, &calc, 7));
+    check(ca_journal_remove(&journal, &calc, 1) == 1, "ca_journal_remove should remove values");
+    check_failure(ca_journal_operate(&journal, &calc, CA_OP_MULTIPLY));
+    check_success(ca_journal_commit(&journal));
+    check_success(ca_journal_push(&journal, &calc, 5));
+    /* lose the pending records as a crash would */
+    journal.records = 0;
+    check_success(ca_journal_close(&journal));
+
+    ca_push(&calc, 1);
+    check_success(ca_journal_open(&journal, path, &calc, 4));
+    check(ca_count(&calc) == 2 && calc.stack[0] == -30 && calc.stack[1] == CA_VALUE_MIN,
+          "the committed records should be replayed");
+    check_success(ca_journal_snapshot(&journal, &calc));
+    check_success(ca_journal_operate(&journal, &calc, CA_OP_DROP));
+    check_success(ca_journal_push(&journal, &calc, 2));
+    check_success(ca_journal_operate(&journal, &calc, CA_OP_ADD));
+    check_success(ca_journal_close(&journal));
+
+    /* a group torn by a crash */
+    FILE *log = fopen(path, "a");
+    check(log != NULL, "the log should be opened");
+    fwrite("\x20\0\0\0garbage", 1, 11, log);
+    fclose(log);
+
+    check_success(ca_journal_open(&journal, path, &calc, 1));
+    check(ca_count(&calc) == 1 && ca_top(&calc) == -28, "the snapshot and the log should be replayed");
+    check_success(ca_journal_push(&journal, &calc, 1));
+    check_success(ca_journal_close(&journal));
+    check_success(ca_journal_open(&journal, path, &calc, 1));
+    check(ca_count(&calc) == 2 && ca_top(&calc) == 1, "records after a torn group should be replayed");
+    check_success(ca_journal_close(&journal));
+
+    /* replay into a lazy context, the deferred operations being dropped */
+    check_success(ca_set_lazy(&calc, 8));
+    ca_push(&calc, 4);
+    check_success(ca_operate(&calc, CA_OP_ADD));
+    check_success(ca_journal_open(&journal, path, &calc, 4));
+    check(calc.lazy != NULL, "the context should stay lazy");
+    check(ca_count(&calc) == 2 && calc.stack[0] == -28 && calc.stack[1] == 1,
+          "the records should be replayed in order into a lazy context");
+    check_success(ca_journal_push(&journal, &calc, 3));
+    check_success(ca_journal_operate(&journal, &calc, CA_OP_SUBSTRACT));
+    check_success(ca_journal_close(&journal));
+    check_success(ca_set_lazy(&calc, 0));
+    check_success(ca_set_lazy(&calc, 8));
+    check_success(ca_journal_open(&journal, path, &calc, 4));
+    check(ca_count(&calc) == 2 && calc.stack[0] == -28 && calc.stack[1] == -2,
+          "the records of a lazy context should be replayed in order");
+
+    /* a failing operation of a lazy context does not drop the next ones */
+    check(ca_journal_remove(&journal, &calc, 0) == 2, "ca_journal_remove should empty the stack");
+    check_success(ca_journal_push(&journal, &calc, 10));
+    check_success(ca_journal_push(&journal, &calc, 0));
+    check_failure(ca_journal_operate(&journal, &calc, CA_OP_DIVIDE));
+    check_success(ca_journal_operate(&journal, &calc, CA_OP_ADD));
+    check(ca_count(&calc) == 1 && ca_top(&calc) == 10, "operations should be applied when they are logged");
+    check_success(ca_journal_close(&journal));
+    ca_push(&calc, 5);
+    check_success(ca_journal_open(&journal, path, &calc, 4));
+    check(ca_count(&calc) == 1 && ca_top(&calc) == 10, "the replay should rebuild the stack of a lazy context");
+    check_success(ca_journal_close(&journal));
+    check_success(ca_set_lazy(&calc, 0));
+
+    unlink(path);
+    unlink(snapshot);
+    rmdir(directory);
+    ca_cleanup(&calc);
+}
+
+#define SHARED_THREADS 4
+#define SHARED_ITERATIONS 10000
+
+static void *shared_producer(void *arg)
+{
+    ca_shared_calc_t *shared = arg;
+    ca_shared_slot_t *slot = ca_shared_attach(shared);
+
+    check(slot, "each thread should get a slot");
+    for (unsigned i = 0; i < SHARED_ITERATIONS; i++) {
+        check_success(ca_shared_accumulate(shared, slot, CA_OP_ADD, 3));
+        check_success(ca_shared_push(shared, slot, 2));
+        check_success(ca_shared_operate(shared, slot, CA_OP_ADD));
+    }
+    return NULL;
+}
+
+static void test_shared(void)
+{
+    ca_shared_calc_t shared;
+    pthread_t threads[SHARED_THREADS];
+    ca_shared_slot_t *slot;
+    ca_value_t value;
+
+    check_success(ca_shared_initialize(&shared, SHARED_THREADS + 1, SHARED_THREADS + 1));
+    slot = ca_shared_attach(&shared);
+    check_failure(ca_shared_pop(&shared, slot, &value));
+    check_success(ca_shared_push(&shared, slot, 0));
+
+    for (unsigned i = 0; i < SHARED_THREADS; i++)
+        check(pthread_create(threads + i, NULL, shared_producer, &shared) == 0, "thread should start");
+    for (unsigned i = 0; i < SHARED_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    check(ca_shared_attach(&shared) == NULL, "attaching more threads than slots should fail");
+    check_success(ca_shared_pop(&shared, slot, &value));
+    check(value == 5 * SHARED_THREADS * SHARED_ITERATIONS, "every request should be applied once, got %ld", value);
+
+    /* failing accumulations leave the values of the other threads */
+    check_success(ca_shared_push(&shared, slot, 7));
+    check_success(ca_shared_push(&shared, slot, 9));
+    check_failure(ca_shared_accumulate(&shared, slot, CA_OP_SQUARE_ROOT, -4));
+    check_failure(ca_shared_accumulate(&shared, slot, CA_OP_DIVIDE, 0));
+    check_success(ca_shared_pop(&shared, slot, &value));
+    check(value == 9, "a failing accumulation should leave the stack as it was, got %ld", value);
+    check_success(ca_shared_pop(&shared, slot, &value));
+    check(value == 7, "a failing accumulation should leave the stack as it was, got %ld", value);
+    check_failure(ca_shared_operate(&shared, slot, CA_OP_ADD));
+    ca_shared_cleanup(&shared);
+}
+
+static void test_modulus(void)
+{
+    /* 2^61 - 1, a prime whose products overflow 64 bits */
+    const ca_value_t p = (1L << 61) - 1;
+    ca_calc_t calc;
+    ca_program_t prog;
+    ca_value_t vars[] = { p - 1, 3 }, result;
+
+    check_success(ca_initialize(&calc, 10));
+    check_failure(ca_set_modulus(&calc, 10));
+    check_failure(ca_set_modulus(&calc, 1));
+    check_success(ca_set_modulus(&calc, 7));
+
+    ca_push(&calc, 5);
+    ca_push(&calc, 4);
+    check_success(ca_operate(&calc, CA_OP_ADD));
+    check(ca_top(&calc) == 2, "additions should be reduced, got %ld", ca_top(&calc));
+    ca_push(&calc, 3);
+    check_success(ca_operate(&calc, CA_OP_SUBSTRACT));
+    check(ca_top(&calc) == 6, "substractions should be reduced, got %ld", ca_top(&calc));
+    ca_push(&calc, -9);
+    check_success(ca_operate(&calc, CA_OP_MULTIPLY));
+    check(ca_top(&calc) == 2, "negative operands should be reduced, got %ld", ca_top(&calc));
+    ca_push(&calc, 3);
+    check_success(ca_operate(&calc, CA_OP_DIVIDE));
+    check(ca_top(&calc) == 0, "divisions should not be changed");
+    ca_remove(&calc, 0);
+
+    check_success(ca_set_modulus(&calc, p));
+    ca_push(&calc, p - 1);
+    ca_push(&calc, p - 1);
+    check_success(ca_operate(&calc, CA_OP_MULTIPLY));
+    check(ca_top(&calc) == 1, "products should not overflow, got %ld", ca_top(&calc));
+    ca_push(&calc, 3);
+    ca_push(&calc, p - 1);
+    check_success(ca_operate(&calc, CA_OP_POWER));
+    check(ca_top(&calc) == 1, "powers should follow Fermat's little theorem, got %ld", ca_top(&calc));
+    ca_push(&calc, 1L << 40);
+    ca_push(&calc, 3);
+    check_success(ca_operate(&calc, CA_OP_POWER));
+    check(ca_top(&calc) == 1L << 59, "2^120 should be 2^59 modulo 2^61 - 1, got %ld", ca_top(&calc));
+    ca_push(&calc, -1);
+    check_failure(ca_operate(&calc, CA_OP_POWER));
+    ca_remove(&calc, 0);
+
+    /* programs and deferred operations compute in the mode too */
+    check_success(ca_compile(&prog, "a * a + b ** 2 / 1", CA_SYNTAX_INFIX));
+    check_success(ca_run(&calc, &prog, vars));
+    check(ca_pop(&calc) == 10, "programs should compute modulo the modulus");
+    check_success(ca_set_lazy(&calc, 4));
+    ca_push(&calc, p - 1);
+    ca_push(&calc, 2);
+    check_success(ca_operate(&calc, CA_OP_ADD));
+    check(ca_top(&calc) == 1, "deferred operations should compute modulo the modulus");
+    check_success(ca_set_lazy(&calc, 0));
+
+    /* back to plain integers */
+    check_success(ca_set_modulus(&calc, 0));
+    ca_push(&calc, p - 1);
+    ca_push(&calc, p - 1);
+    check_failure(ca_operate(&calc, CA_OP_MULTIPLY));
+    vars[0] = 2;
+    check_success(ca_eval(&prog, vars, 2, &result));
+    check(result == 13, "ca_eval should compute with plain integers, got %ld", result);
+
+    ca_program_cleanup(&prog);
+    ca_cleanup(&calc);
+}
+
+/**
+ * Check that a string holds the text of a decimal.
+ */
+static int has_decimal(const char *text, ca_value_t value, unsigned digits)
+{
+    char buffer[CA_DECIMAL_DIGITS];
+    size_t length = ca_format_decimal(value, digits, buffer);
+    return length == strlen(text) && memcmp(buffer, text, length) == 0;
+}
+
+static void test_decimal(void)
+{
+    ca_calc_t calc;
+    ca_writer_t writer;
+    char buffer[64];
+    const char *end;
+    ca_value_t value;
+
+    check(has_decimal("1.50", 150, 2), "decimals should be formatted with their point");
+    check(has_decimal("-0.05", -5, 2), "decimals should have a digit before their point");
+    check(has_decimal("0.000", 0, 3), "decimals should keep their trailing zeros");
+    check(has_decimal("-9.223372036854775808", CA_VALUE_MIN, 18), "the lowest decimal should fit");
+    check(has_decimal("42", 42, 0), "decimals without digits should be integers");
+
+    check_success(ca_parse_decimal("-1.005", 2, &value, NULL));
+    check(value == -101, "parsing should round half away from zero, got %ld", value);
+    check_success(ca_parse_decimal("12", 2, &value, NULL));
+    check(value == 1200, "integers should be scaled");
+    check_success(ca_parse_decimal(".5x", 2, &value, &end));
+    check(value == 50 && *end == 'x', "parsing should stop after the decimal");
+    check_failure(ca_parse_decimal("1.5x", 2, &value, NULL));
+    check_failure(ca_parse_decimal("-.", 2, &value, NULL));
+    check_failure(ca_parse_decimal("92233720368547758.08", 2, &value, NULL));
+    check_success(ca_parse_decimal("-92233720368547758.08", 2, &value, NULL));
+    check(value == CA_VALUE_MIN, "the lowest decimal should be parsed");
+
+    check_success(ca_initialize(&calc, 10));
+    check_failure(ca_set_decimal(&calc, CA_DECIMAL_MAX_DIGITS + 1));
+    check_success(ca_set_decimal(&calc, 2));
+
+    ca_push(&calc, 105);
+    ca_push(&calc, 105);
+    check_success(ca_operate(&calc, CA_OP_MULTIPLY));
+    check(ca_top(&calc) == 110, "1.05 * 1.05 should round to 1.10, got %ld", ca_top(&calc));
+    ca_push(&calc, -50);
+    check_success(ca_operate(&calc, CA_OP_MULTIPLY));
+    check(ca_top(&calc) == -55, "1.10 * -0.50 should be -0.55, got %ld", ca_top(&calc));
+    ca_push(&calc, 300);
+    check_success(ca_operate(&calc, CA_OP_DIVIDE));
+    check(ca_top(&calc) == -18, "-0.55 / 3 should round to -0.18, got %ld", ca_top(&calc));
+    ca_push(&calc, 0);
+    check_failure(ca_operate(&calc, CA_OP_DIVIDE));
+    ca_remove(&calc, 0);
+
+    /* the intermediates do not overflow, only the results */
+    ca_push(&calc, CA_VALUE_MAX);
+    ca_push(&calc, 50);
+    check_success(ca_operate(&calc, CA_OP_MULTIPLY));
+    check(ca_top(&calc) == CA_VALUE_MAX / 2 + 1, "large products should be rescaled exactly");
+    ca_push(&calc, 50);
+    check_failure(ca_operate(&calc, CA_OP_DIVIDE));
+    ca_remove(&calc, 0);
+
+    ca_push(&calc, 110);
+    ca_push(&calc, 200);
+    check_success(ca_operate(&calc, CA_OP_POWER));
+    check(ca_top(&calc) == 121, "1.10 ** 2 should be 1.21, got %ld", ca_top(&calc));
+    ca_push(&calc, 150);
+    check_failure(ca_operate(&calc, CA_OP_POWER));
+    ca_remove(&calc, 0);
+    ca_push(&calc, 200);
+    check_success(ca_operate(&calc, CA_OP_SQUARE_ROOT));
+    check(ca_top(&calc) == 141, "the root of 2 should be 1.41, got %ld", ca_top(&calc));
+    ca_push(&calc, -5);
+    check_success(ca_operate(&calc, CA_OP_ADD));
+
+    check_success(ca_writer_initialize(&writer, -1, buffer, sizeof(buffer)));
+    check_success(ca_dump(&writer, &calc, CA_DUMP_TEXT));
+    check(writer.used == 4 && memcmp(buffer, "1.36", 4) == 0, "dumps should have decimal points");
+    ca_writer_cleanup(&writer);
+
+    check_success(ca_set_decimal(&calc, 0));
+    ca_push(&calc, 2);
+    check_success(ca_operate(&calc, CA_OP_MULTIPLY));
+    check(ca_top(&calc) == 272, "contexts should compute with integers again");
+    ca_cleanup(&calc);
+}
+
+#define SEGMENT_VALUES 1000
+
+/**
+ * Read a segment until the writer pushed every value, checking that each
+ * consistent read sees the values in order.
+ */
+static int segment_reader(const char *name)
+{
+    ca_segment_t segment;
+    size_t count = 0;
+
+    if (ca_segment_open(&segment, name))
+        return 1;
+    while (count < SEGMENT_VALUES) {
+        uint64_t sequence = ca_segment_read_begin(&segment);
+        int ordered = 1;
+
+        count = ca_segment_count(&segment);
+        for (size_t i = 0; i < count; i++)
+            ordered &= ca_segment_value(&segment, i) == (ca_value_t) i;
+        if (ca_segment_read_end(&segment, sequence) && !ordered)
+            return 1;
+    }
+    ca_segment_close(&segment);
+    return 0;
+}
+
+static void test_segment(void)
+{
+    ca_segment_t writer, reader;
+    ca_value_t value;
+    char name[64];
+    int status;
+
+    snprintf(name, sizeof(name), "/libcalc-test-%d", (int) getpid());
+    check_success(ca_segment_create(&writer, name, SEGMENT_VALUES));
+    check_failure(ca_segment_create(&reader, name, 1));
+    check_success(ca_segment_open(&reader, name));
+    check_failure(ca_segment_top(&reader, &value));
+    check_failure(ca_segment_pop(&writer, &value));
+
+    check_success(ca_segment_push(&writer, 6));
+    check_success(ca_segment_push(&writer, 7));
+    check_success(ca_segment_operate(&writer, CA_OP_MULTIPLY));
+    check_success(ca_segment_top(&reader, &value));
+    check(value == 42, "a reader should see the changes of the writer, got %ld", value);
+    check_failure(ca_segment_operate(&writer, CA_OP_ADD));
+    check_success(ca_segment_pop(&writer, &value));
+    check(value == 42 && ca_segment_count(&reader) == 0, "popping should empty the stack");
+
+    pid_t pid = fork();
+    check(pid >= 0, "fork should succeed");
+    if (pid == 0)
+        _exit(segment_reader(name));
+    for (ca_value_t i = 0; i < SEGMENT_VALUES; i++)
+        check_success(ca_segment_push(&writer, i));
+    check_failure(ca_segment_push(&writer, 0));
+    check(waitpid(pid, &status, 0) == pid, "the reader process should exit");
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "the reader process should only see consistent stacks");
+
+    ca_segment_close(&reader);
+    ca_segment_close(&writer);
+    check_success(ca_segment_unlink(name));
+    check_failure(ca_segment_open(&reader, name));
+}
+
+static void test_batch(void)
+{
+    static const struct {
+        const char *source;
+        ca_syntax_t syntax;
+    } sources[] = {
+        { "(a + b) * 2 / 7", CA_SYNTAX_INFIX },
+        { "(a + b) * 2 % 7", CA_SYNTAX_INFIX },
+        { "a b + dup *", CA_SYNTAX_RPN },
+        { "a b over over < jz first swap first: drop", CA_SYNTAX_RPN },
+        { "a / b", CA_SYNTAX_INFIX },
+    };
+    ca_value_t bindings[][2] = { { 3, 4 }, { 5, 0 }, { 3, 4 } };
+    ca_program_t programs[5];
+    const ca_program_t *progs[15];
+    const ca_value_t *vars[15];
+    ca_value_t results[15], expected;
+    int status[15];
+    ca_batch_t batch;
+
+    for (unsigned p = 0; p < 5; p++)
+        check_success(ca_compile(programs + p, sources[p].source, sources[p].syntax));
+    for (unsigned j = 0; j < 15; j++) {
+        progs[j] = programs + j % 5;
+        vars[j] = bindings[j / 5];
+    }
+
+    check_success(ca_batch_initialize(&batch));
+    check_failure(ca_batch_eval(&batch, progs, vars, 15, results, status));
+    for (unsigned j = 0; j < 15; j++) {
+        int s = ca_eval(programs + j % 5, vars[j], 2, &expected);
+        check(status[j] == s, "batch job %u should fail like ca_eval", j);
+        check(s || results[j] == expected, "batch job %u should compute %ld, got %ld", j, expected, results[j]);
+    }
+
+    /* the bindings { 3, 4 } share every operation, and the first three
+     * programs share a + b */
+    check(batch.stats.jobs == 15, "every job should be counted");
+    check(batch.stats.unshared == 3, "programs with jumps should run on their own");
+    check(batch.stats.operations == 27, "applied operations should be counted, got %zu", batch.stats.operations);
+    check(batch.stats.computed == 12, "shared operations should be computed once, got %zu", batch.stats.computed);
+
+    ca_batch_reset(&batch);
+    check_success(ca_batch_eval(&batch, progs, vars, 4, results, NULL));
+    check(results[0] == 2 && results[2] == 49, "a reset batch should compute again");
+    check(batch.stats.computed == 5, "a reset batch should forget its operations, got %zu", batch.stats.computed);
+    check_success(ca_batch_eval(&batch, progs, vars, 0, results, NULL));
+
+    /* a constant prefix is shared by jobs with different bindings */
+    ca_program_t prefixed[2];
+    ca_value_t values[4] = { 1, 2, 3, 4 };
+    check_success(ca_compile(prefixed, "2 3 ** 5 * a +", CA_SYNTAX_RPN));
+    check_success(ca_compile(prefixed + 1, "2 3 ** 5 * a *", CA_SYNTAX_RPN));
+    for (unsigned j = 0; j < 8; j++) {
+        progs[j] = prefixed + j % 2;
+        vars[j] = values + j / 2;
+    }
+    ca_batch_reset(&batch);
+    check_success(ca_batch_eval(&batch, progs, vars, 8, results, NULL));
+    check(results[6] == 44 && results[7] == 160, "jobs sharing a constant prefix should compute their own result");
+    check(batch.stats.computed == 10, "a constant prefix should be computed once, got %zu", batch.stats.computed);
+    check_success(ca_batch_eval(&batch, progs, vars, 2, results, NULL));
+    check(batch.stats.computed == 14, "a constant prefix should be computed once per evaluation, got %zu",
+          batch.stats.computed);
+    ca_program_cleanup(prefixed);
+    ca_program_cleanup(prefixed + 1);
+
+    ca_batch_cleanup(&batch);
+    for (unsigned p = 0; p < 5; p++)
+        ca_program_cleanup(programs + p);
+}
+
+static void test_sum(void)
+{
+    ca_calc_t calc;
+    __int128 expected = 0;
+    unsigned long seed = 7;
+
+    check(ca_kernels_isa() != NULL, "kernels should be selected when the library is loaded");
+
+    /* values of every magnitude, the exact sum of a suffix fitting */
+    check_success(ca_initialize(&calc, 100003));
+    for (unsigned i = 0; i < 100003; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        ca_value_t value = (ca_value_t) seed >> (seed % 64);
+        if (expected + value > CA_VALUE_MAX || expected + value < CA_VALUE_MIN)
+            value = -value;
+        expected += value;
+        ca_push(&calc, value);
+    }
+    check_success(ca_sum(&calc, 100000));
+    check(ca_count(&calc) == 4, "the summed values should be replaced by their sum");
+    check_success(ca_sum(&calc, 4));
+    check(ca_top(&calc) == (ca_value_t) expected, "the kernel should compute the exact sum");
+
+    /* only the sum has to fit */
+    ca_remove(&calc, 0);
+    ca_push(&calc, 5);
+    ca_push(&calc, -1);
+    ca_push(&calc, CA_VALUE_MAX);
+    ca_push(&calc, 1);
+    check_success(ca_sum(&calc, 3));
+    check(ca_top(&calc) == CA_VALUE_MAX, "partial sums should not overflow");
+
+    ca_push(&calc, 1);
+    check_failure(ca_sum(&calc, 2));
+    check(ca_count(&calc) == 3 && ca_top(&calc) == 1, "an overflowing sum should leave the stack untouched");
+    check_failure(ca_sum(&calc, 4));
+    check_failure(ca_sum(&calc, 0));
+    check_success(ca_sum(&calc, 1));
+    check(ca_count(&calc) == 3, "the sum of a value should be the value");
+
+    ca_remove(&calc, 0);
+    check_success(ca_set_modulus(&calc, 7));
+    ca_push(&calc, 5);
+    ca_push(&calc, 6);
+    ca_push(&calc, 4);
+    check_success(ca_sum(&calc, 3));
+    check(ca_top(&calc) == 1, "sums should follow the mode, got %ld", ca_top(&calc));
+    ca_cleanup(&calc);
+}
+
+/**
+ * Create a temporary column file holding values.
+ */
+static int test_column(const ca_value_t *values, size_t count)
+{
+    FILE *file = tmpfile();
+    check(file != NULL, "column file should be created");
+    int fd = dup(fileno(file));
+    fclose(file);
+    check(write(fd, values, count * sizeof(ca_value_t)) == (ssize_t) (count * sizeof(ca_value_t)),
+          "column should be written");
+    return fd;
+}
+
+static void test_columns(void)
+{
+    static const char *const sources[] = {
+        "a b + a b * - b 3 / + a 7 % - a a * sqrt + b 2 ** 1000 % + a b < + a 3 << + b 2 >> +",
+        "a b over over / rot swap - dup * + b sqrt + a -1 / - 5 drop",
+        "a 0 < jz pos a -1 * jmp end pos: a end: b +",
+    };
+    size_t rows = 2 * CA_COLUMNS_STRIPE + 123;
+    ca_value_t *a = malloc(rows * sizeof(ca_value_t)), *b = malloc(rows * sizeof(ca_value_t));
+    ca_value_t *results = malloc(rows * sizeof(ca_value_t));
+    unsigned long seed = 11;
+
+    /* the kernels flag the failing elements */
+    ca_value_t x[4] = { 7, CA_VALUE_MIN, 5, -9 }, y[4] = { 2, -1, 0, 4 };
+    unsigned char failed[4] = { 0 };
+    ca_operate_array(CA_OP_DIVIDE, x, y, 4, failed);
+    check(x[0] == 3 && x[3] == -2, "kernels should divide like the operations");
+    check(!failed[0] && failed[1] && failed[2] && !failed[3], "kernels should flag the failed divisions");
+    ca_operate_array(CA_OP_SQUARE_ROOT, x, NULL, 4, failed);
+    check(x[0] == 1 && failed[3], "kernels should flag the failed square roots");
+
+    /* small values, values of every magnitude and the extreme ones */
+    for (size_t i = 0; i < rows; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        a[i] = i % 5 == 0 ? (ca_value_t) (seed % 200) - 100 : (ca_value_t) seed >> (seed % 64);
+        b[i] = i % 3 == 0 ? (ca_value_t) (seed >> 40) % 7 - 3 : (ca_value_t) (seed * 31) >> (seed % 61);
+    }
+    a[10] = CA_VALUE_MIN;
+    a[11] = CA_VALUE_MAX;
+    b[12] = 0;
+    int inputs[2] = { test_column(a, rows), test_column(b, rows) };
+
+    for (size_t s = 0; s < sizeof(sources) / sizeof(sources[0]); s++) {
+        ca_program_t prog;
+        ca_columns_stats_t stats;
+        FILE *file = tmpfile();
+        int output = fileno(file);
+        size_t failed = 0;
+
+        check_success(ca_compile(&prog, sources[s], CA_SYNTAX_RPN));
+        check_success(ca_columns_eval(&prog, inputs, output, -42, 3, &stats));
+        check(stats.rows == rows && stats.threads == 3, "every row should be evaluated by the threads");
+        check(pread(output, results, rows * sizeof(ca_value_t), 0) == (ssize_t) (rows * sizeof(ca_value_t)),
+              "result column should hold a value per row");
+
+        for (size_t i = 0; i < rows; i++) {
+            ca_value_t vars[2] = { a[i], b[i] }, expected;
+            int status = ca_eval(&prog, vars, 2, &expected);
+            failed += status != 0;
+            check(results[i] == (status ? -42 : expected), "row %zu of %s should be %ld, got %ld",
+                  i, sources[s], status ? -42 : expected, results[i]);
+        }
+        check(stats.failed == failed && failed > 0, "failed rows should be counted, %zu of %zu", stats.failed, failed);
+        ca_program_cleanup(&prog);
+        fclose(file);
+    }
+
+    /* the columns must have the same number of rows */
+    ca_program_t prog;
+    int output = test_column(a, 0);
+    close(inputs[1]);
+    inputs[1] = test_column(b, rows - 1);
+    check_success(ca_compile(&prog, "a b +", CA_SYNTAX_RPN));
+    check_failure(ca_columns_eval(&prog, inputs, output, 0, 1, NULL));
+    ca_program_cleanup(&prog);
+    check_success(ca_compile(&prog, "1 2 +", CA_SYNTAX_RPN));
+    check_failure(ca_columns_eval(&prog, inputs, output, 0, 1, NULL));
+    ca_program_cleanup(&prog);
+
+    close(output);
+    close(inputs[0]);
+    close(inputs[1]);
+    free(a);
+    free(b);
+    free(results);
+}
+
+/**
+ * Connect to calcd, waiting for it to listen.
+ */
+static int calcd_connect(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct timeval timeout = { .tv_sec = 10 };
+
+    strcpy(address.sun_path, path);
+    for (unsigned tries = 0; tries < 500; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        check(fd >= 0, "a socket should be created");
+        if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    check(0, "calcd should listen on %s", path);
+    return -1;
+}
+
+static void calcd_send(int fd, const char *data, size_t length)
+{
+    while (length) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        check(sent > 0, "requests should be sent");
+        data += sent;
+        length -= sent;
+    }
+}
+
+/**
+ * Read the responses until calcd closes the connection.
+ *
+ * @return the length of the responses.
+ */
+static size_t calcd_receive(int fd, char *responses, size_t size)
+{
+    size_t used = 0;
+    ssize_t received;
+
+    while (used < size && (received = recv(fd, responses + used, size - used, 0)) > 0)
+        used += received;
+    check(used < size, "the responses should fit");
+    responses[used] = '\0';
+    return used;
+}
+
+static void test_calcd(void)
+{
+    char directory[] = "/tmp/libcalc_calcd.XXXXXX", path[64];
+    static char requests[32768], responses[131072];
+    size_t length;
+
+    check(mkdtemp(directory) != NULL, "a temporary directory should be created");
+    snprintf(path, sizeof(path), "%s/socket", directory);
+
+    pid_t pid = fork();
+    check(pid >= 0, "fork should succeed");
+    if (pid == 0) {
+        execl("./calcd", "calcd", "-t", "2", path, (char *) NULL);
+        _exit(127);
+    }
+
+    /* a pipelined batch with errors, \r\n and requests after quit */
+    int fd = calcd_connect(path);
+    calcd_send(fd, "4", 1);
+    const char *batch = "1\n2\r\n+\nfoo\npop\npop\npop\n4 5\n99999999999999999999\nquit\n7\n";
+    calcd_send(fd, batch, strlen(batch));
+    calcd_receive(fd, responses, sizeof(responses));
+    check(strcmp(responses, "ok 41\nok 2\nok 43\nerror\nok\nerror\nerror\nerror\nerror\nok\n") == 0,
+          "calcd should answer each request of a batch, got %s", responses);
+    close(fd);
+
+    /* more requests than the input buffer and more responses than the
+     * output buffer, sent before reading any response */
+    fd = calcd_connect(path);
+    length = snprintf(requests, sizeof(requests), "1234567890123456789\n");
+    for (unsigned i = 0; i < 2000; i++)
+        length += snprintf(requests + length, sizeof(requests) - length, "dup\ndrop\n");
+    length += snprintf(requests + length, sizeof(requests) - length, "quit\n1\n");
+    calcd_send(fd, requests, length);
+    length = calcd_receive(fd, responses, sizeof(responses));
+    const char *response = "ok 1234567890123456789\n";
+    check(length == 4002 * strlen(response), "calcd should answer every request before quitting, got %zu bytes", length);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < length; i += strlen(response))
+        mismatches += memcmp(responses + i, response, strlen(response)) != 0;
+    check(mismatches == 0, "the responses should be in order, %zu mismatches", mismatches);
+    close(fd);
+
+    /* a request not fitting in the input buffer */
+    fd = calcd_connect(path);
+    memset(requests, '1', 5000);
+    calcd_send(fd, requests, 5000);
+    length = calcd_receive(fd, responses, sizeof(responses));
+    check(length == 0, "calcd should close connections sending overlong requests");
+    close(fd);
+
+    int status;
+    kill(pid, SIGTERM);
+    check(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+          "calcd should exit on SIGTERM");
+    unlink(path);
+    rmdir(directory);
+}
+
 int main(void)
 {
     test_initialize_cleanup();
@@ -189,5 +1466,25 @@ int main(void)
     test_modulo();
     test_left_shift();
     test_right_shift();
+    test_compile_eval();
+    test_divider();
+    test_shared();
+    test_run_budget();
+    test_control_flow();
+    test_profile_superinstructions();
+    test_mapped_memory();
+    test_file_stack();
+    test_allocator();
+    test_format();
+    test_lazy();
+    test_cells();
+    test_journal();
+    test_segment();
+    test_modulus();
+    test_decimal();
+    test_batch();
+    test_sum();
+    test_columns();
+    test_calcd();
     return 0;
 }
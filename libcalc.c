@@ -1,38 +1,206 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/mman.h>
 
 #include "libcalc_priv.h"
 
+/**
+ * Advice reclaiming the pages of a file stack, the older kernels only
+ * unmapping them from the page cache.
+ */
+#if defined(MADV_PAGEOUT)
+#define CA_MADV_COLD MADV_PAGEOUT
+#elif defined(MADV_COLD)
+#define CA_MADV_COLD MADV_COLD
+#else
+#define CA_MADV_COLD MADV_DONTNEED
+#endif
+
+/**
+ * The kind of a deferred entry which is a push, the others being
+ * operations.
+ */
+#define CA_LAZY_PUSH CA_OPERATION_COUNT
+
+/**
+ * A deferred push or operation.
+ */
+typedef struct ca_lazy_entry {
+    /** The ca_operation_t, or CA_LAZY_PUSH */
+    unsigned kind;
+    /** The pushed value */
+    ca_value_t value;
+} ca_lazy_entry_t;
+
+struct ca_lazy {
+    /** Number of recorded entries */
+    size_t count;
+    /** Number of entries recorded before applying them */
+    size_t capacity;
+    /** Set when applying the entries failed and the failure was not reported */
+    int failed;
+    /** The entries */
+    ca_lazy_entry_t entries[];
+};
+
+/**
+ * Size of a queue of deferred entries.
+ */
+static inline size_t ca_lazy_size(size_t capacity)
+{
+    return sizeof(struct ca_lazy) + capacity * sizeof(ca_lazy_entry_t);
+}
+
+static int ca_lazy_sync(ca_calc_t *calc);
+
+/**
+ * Record an entry, applying the queue once it is full.
+ */
+static int ca_lazy_record(ca_calc_t *calc, unsigned kind, ca_value_t value)
+{
+    struct ca_lazy *lazy = calc->lazy;
+    lazy->entries[lazy->count].kind = kind;
+    lazy->entries[lazy->count].value = value;
+    if (++lazy->count == lazy->capacity)
+        return ca_lazy_sync(calc);
+    return 0;
+}
+
+static void *ca_system_alloc(void *data, size_t size)
+{
+    return calloc(1, size);
+}
+
+static void *ca_system_realloc(void *data, void *ptr, size_t old_size, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void ca_system_free(void *data, void *ptr, size_t size)
+{
+    free(ptr);
+}
+
+/**
+ * The allocator of the C library.
+ */
+static const ca_allocator_t ca_system_allocator = {
+    .alloc = ca_system_alloc,
+    .realloc = ca_system_realloc,
+    .free = ca_system_free
+};
+
+static const ca_allocator_t *ca_default_allocator = &ca_system_allocator;
+
+void ca_set_allocator(const ca_allocator_t *allocator)
+{
+    ca_default_allocator = allocator ? allocator : &ca_system_allocator;
+}
+
+const ca_allocator_t *ca_get_allocator(void)
+{
+    return ca_default_allocator;
+}
+
+/**
+ * Give the kernel hints about the segments of a file stack once its
+ * top left the current segment.
+ */
+static void ca_spill_move(ca_calc_t *calc)
+{
+    struct ca_spill *spill = calc->spill;
+    size_t segment = calc->top / spill->segment, bytes = spill->segment * sizeof(ca_value_t);
+    char *base = (char *) calc->stack;
+
+    if (calc->top >= spill->high) {
+        /* the segment two below is cold, write it out in a batch */
+        if (segment >= 2)
+            madvise(base + (segment - 2) * bytes, bytes, CA_MADV_COLD);
+    } else if (segment >= 1) {
+        /* the segment below will be needed soon */
+        madvise(base + (segment - 1) * bytes, bytes, MADV_WILLNEED);
+    }
+
+    /* the current segment with half a segment on each side, so that
+     * operations around a boundary do not move back and forth */
+    size_t start = segment * spill->segment;
+    spill->low = start > spill->segment / 2 ? start - spill->segment / 2 : 0;
+    spill->high = start + spill->segment + spill->segment / 2;
+}
+
+/**
+ * Follow the moves of the top of a file stack.
+ */
+static inline void ca_spill_check(ca_calc_t *calc)
+{
+    if (calc->spill && (calc->top >= calc->spill->high || calc->top < calc->spill->low))
+        ca_spill_move(calc);
+}
+
 int ca_initialize(ca_calc_t *calc, size_t size)
+{
+    return ca_initialize_allocator(calc, size, NULL);
+}
+
+int ca_initialize_allocator(ca_calc_t *calc, size_t size, const ca_allocator_t *allocator)
 {
     assert(calc);
     assert(size);
-    calc->stack = calloc(size, sizeof(ca_value_t));
-    if (calc->stack == NULL) {
-        tr("unable to create stack: %m");
-        return -1;
+    calc->allocator = allocator ? allocator : ca_default_allocator;
+    if (size <= CA_INLINE_STACK_SIZE) {
+        calc->stack = calc->inline_stack;
+    } else {
+        calc->stack = ca_alloc(calc->allocator, size * sizeof(ca_value_t));
+        if (calc->stack == NULL) {
+            tr("unable to create stack: %m");
+            return -1;
+        }
     }
     calc->size = size;
     calc->top = 0;
+    calc->mapped = 0;
+    calc->lazy = NULL;
+    calc->mode = NULL;
+    calc->spill = NULL;
     return 0;
 }
 
+void ca_cleanup_state(ca_calc_t *calc)
+{
+    assert(calc);
+    if (calc->lazy)
+        ca_free(calc->allocator, calc->lazy, ca_lazy_size(calc->lazy->capacity));
+    ca_free(calc->allocator, calc->mode, sizeof(struct ca_mode));
+    ca_free(calc->allocator, calc->spill, sizeof(struct ca_spill));
+    calc->lazy = NULL;
+    calc->mode = NULL;
+    calc->spill = NULL;
+}
+
 void ca_cleanup(ca_calc_t *calc)
 {
     assert(calc);
-    free(calc->stack);
+    ca_cleanup_state(calc);
+    if (calc->mapped)
+        munmap(calc->stack, calc->mapped);
+    else if (calc->stack != calc->inline_stack)
+        ca_free(calc->allocator, calc->stack, calc->size * sizeof(ca_value_t));
 }
 
 size_t ca_space_left(ca_calc_t *calc)
 {
     assert_calc(calc);
+    if (calc->lazy)
+        ca_lazy_sync(calc);
     return calc->size - calc->top;
 }
 
 ca_value_t ca_top(ca_calc_t *calc)
 {
     assert_calc(calc);
+    if (calc->lazy)
+        ca_lazy_sync(calc);
     assert(calc->top > 0);
     return calc->stack[calc->top - 1];
 }
@@ -40,28 +208,39 @@ ca_value_t ca_top(ca_calc_t *calc)
 void ca_push(ca_calc_t *calc, ca_value_t value)
 {
     assert_calc(calc);
+    if (calc->lazy) {
+        ca_lazy_record(calc, CA_LAZY_PUSH, value);
+        return;
+    }
     /* ensure there is space left */
     assert(calc->top < calc->size);
     calc->stack[calc->top] = value;
     calc->top += 1;
+    ca_spill_check(calc);
 }
 
 unsigned ca_remove(ca_calc_t *calc, unsigned count)
 {
     assert_calc(calc);
+    if (calc->lazy)
+        ca_lazy_sync(calc);
 
     if (count == 0 || count > calc->top)
         count = calc->top;
 
     calc->top -= count;
+    ca_spill_check(calc);
     return count;
 }
 
 ca_value_t ca_pop(ca_calc_t *calc)
 {
     assert_calc(calc);
+    if (calc->lazy)
+        ca_lazy_sync(calc);
     assert(calc->top);
     calc->top -= 1;
+    ca_spill_check(calc);
     return calc->stack[calc->top];
 }
 
@@ -78,6 +257,19 @@ static int ca_check_values(ca_calc_t *calc, unsigned count)
     return 0;
 }
 
+/**
+ * Ensure that count values can be pushed on the stack
+ */
+static int ca_check_space(ca_calc_t *calc, unsigned count)
+{
+    assert(calc);
+    if (calc->size - calc->top < count) {
+        tr("stack should have space for %u more value", count);
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Return the first operand
  */
@@ -95,15 +287,10 @@ static int ca_op_add(ca_calc_t *calc)
     if (ca_check_values(calc, 2))
         return -1;
 
-    ca_value_t x = ca_first(calc);
-    ca_value_t y = ca_second(calc);
-
-    if ((y > 0 && x > CA_VALUE_MAX - y) || (y < 0 && x < CA_VALUE_MIN - y)) {
-        tr("addition would overflow");
+    ca_value_t result;
+    if (ca_value_add(ca_first(calc), ca_second(calc), &result))
         return -1;
-    }
 
-    ca_value_t result = x + y;
     ca_remove(calc, 2);
     ca_push(calc, result);
     return 0;
@@ -117,15 +304,10 @@ static int ca_op_substract(ca_calc_t *calc)
     if (ca_check_values(calc, 2))
         return -1;
 
-    ca_value_t x = ca_first(calc);
-    ca_value_t y = ca_second(calc);
-
-    if ((y > 0 && x < CA_VALUE_MIN + y) || (y < 0 && x > CA_VALUE_MAX + y)) {
-        tr("substraction would overflow");
+    ca_value_t result;
+    if (ca_value_substract(ca_first(calc), ca_second(calc), &result))
         return -1;
-    }
 
-    ca_value_t result = x - y;
     ca_remove(calc, 2);
     ca_push(calc, result);
     return 0;
@@ -139,16 +321,10 @@ static int ca_op_multiply(ca_calc_t *calc)
     if (ca_check_values(calc, 2))
         return -1;
 
-    ca_value_t x = ca_first(calc);
-    ca_value_t y = ca_second(calc);
-
-    if (y != 0 && ((((x > 0 && y > 0) || (x < 0 || y < 0)) && (y > 0 ? x > CA_VALUE_MAX / y : x < CA_VALUE_MAX / y)) ||
-                   (((x > 0 && y < 0) || (x < 0 || y > 0)) && (y > 0 ? x < CA_VALUE_MIN / y : x > CA_VALUE_MIN / y)))) {
-        tr("multiplication would overflow");
+    ca_value_t result;
+    if (ca_value_multiply(ca_first(calc), ca_second(calc), &result))
         return -1;
-    }
 
-    ca_value_t result = x * y;
     ca_remove(calc, 2);
     ca_push(calc, result);
     return 0;
@@ -162,15 +338,10 @@ static int ca_op_divide(ca_calc_t *calc)
     if (ca_check_values(calc, 2))
         return -1;
 
-    ca_value_t x = ca_first(calc);
-    ca_value_t y = ca_second(calc);
-
-    if (y == 0) {
-        tr("cannot divide by 0");
+    ca_value_t result;
+    if (ca_value_divide(ca_first(calc), ca_second(calc), &result))
         return -1;
-    }
 
-    ca_value_t result = x / y;
     ca_remove(calc, 2);
     ca_push(calc, result);
     return 0;
@@ -184,29 +355,11 @@ static int ca_op_square_root(ca_calc_t *calc)
     if (ca_check_values(calc, 1))
         return -1;
 
-    ca_value_t x = ca_pop(calc);
-
-    if (x < 0) {
-        tr("complex numbers are not supported, cannot fetch square root of negative numbers");
+    ca_value_t result;
+    if (ca_value_square_root(ca_pop(calc), &result))
         return -1;
-    }
 
-    /* lets keep it simple, do a binary search */
-    ca_value_t min = 0, max = x;
-    ca_value_t middle = ((min + max) >> 1) + 1;
-
-    do {
-        ca_value_t d = x / middle;
-        if (middle == d)
-            break;
-        else if (middle > d)
-            max = middle;
-        else
-            min = middle;
-        middle = (min + max) >>  1;
-    } while (max - min > 1);
-
-    ca_push(calc, middle);
+    ca_push(calc, result);
     return 0;
 }
 
@@ -218,15 +371,10 @@ static int ca_op_modulo(ca_calc_t *calc)
     if (ca_check_values(calc, 2))
         return -1;
 
-    ca_value_t x = ca_first(calc);
-    ca_value_t y = ca_second(calc);
-
-    if (y == 0) {
-        tr("cannot calculate modulo by 0");
+    ca_value_t result;
+    if (ca_value_modulo(ca_first(calc), ca_second(calc), &result))
         return -1;
-    }
 
-    ca_value_t result = x % y;
     ca_remove(calc, 2);
     ca_push(calc, result);
     return 0;
@@ -240,10 +388,10 @@ static int ca_op_left_shift(ca_calc_t *calc)
     if (ca_check_values(calc, 2))
         return -1;
 
-    ca_value_t x = ca_first(calc);
-    ca_value_t y = ca_second(calc);
+    ca_value_t result;
+    if (ca_value_left_shift(ca_first(calc), ca_second(calc), &result))
+        return -1;
 
-    ca_value_t result = x << y;
     ca_remove(calc, 2);
     ca_push(calc, result);
     return 0;
@@ -253,6 +401,35 @@ static int ca_op_left_shift(ca_calc_t *calc)
  * Shift bits to the right
  */
 static int ca_op_right_shift(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2))
+        return -1;
+
+    ca_value_t result;
+    if (ca_value_right_shift(ca_first(calc), ca_second(calc), &result))
+        return -1;
+
+    ca_remove(calc, 2);
+    ca_push(calc, result);
+    return 0;
+}
+
+/**
+ * Push a copy of the top value.
+ */
+static int ca_op_duplicate(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 1) || ca_check_space(calc, 1))
+        return -1;
+
+    ca_push(calc, ca_top(calc));
+    return 0;
+}
+
+/**
+ * Exchange the two top values.
+ */
+static int ca_op_swap(ca_calc_t *calc)
 {
     if (ca_check_values(calc, 2))
         return -1;
@@ -260,13 +437,148 @@ static int ca_op_right_shift(ca_calc_t *calc)
     ca_value_t x = ca_first(calc);
     ca_value_t y = ca_second(calc);
 
-    ca_value_t result = x >> y;
+    ca_remove(calc, 2);
+    ca_push(calc, y);
+    ca_push(calc, x);
+    return 0;
+}
+
+/**
+ * Push a copy of the value below the top.
+ */
+static int ca_op_over(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2) || ca_check_space(calc, 1))
+        return -1;
+
+    ca_push(calc, ca_first(calc));
+    return 0;
+}
+
+/**
+ * Move the third value to the top.
+ */
+static int ca_op_rotate(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 3))
+        return -1;
+
+    ca_value_t x = calc->stack[calc->top - 3];
+    ca_value_t y = ca_first(calc);
+    ca_value_t z = ca_second(calc);
+
+    ca_remove(calc, 3);
+    ca_push(calc, y);
+    ca_push(calc, z);
+    ca_push(calc, x);
+    return 0;
+}
+
+/**
+ * Remove the top value.
+ */
+static int ca_op_drop(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 1))
+        return -1;
+
+    ca_remove(calc, 1);
+    return 0;
+}
+
+/**
+ * Replace the two top values by the result of their comparison.
+ */
+static int ca_op_equal(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2))
+        return -1;
+
+    ca_value_t result;
+    ca_value_equal(ca_first(calc), ca_second(calc), &result);
+    ca_remove(calc, 2);
+    ca_push(calc, result);
+    return 0;
+}
+
+static int ca_op_not_equal(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2))
+        return -1;
+
+    ca_value_t result;
+    ca_value_not_equal(ca_first(calc), ca_second(calc), &result);
+    ca_remove(calc, 2);
+    ca_push(calc, result);
+    return 0;
+}
+
+static int ca_op_less(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2))
+        return -1;
+
+    ca_value_t result;
+    ca_value_less(ca_first(calc), ca_second(calc), &result);
+    ca_remove(calc, 2);
+    ca_push(calc, result);
+    return 0;
+}
+
+static int ca_op_less_equal(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2))
+        return -1;
+
+    ca_value_t result;
+    ca_value_less_equal(ca_first(calc), ca_second(calc), &result);
+    ca_remove(calc, 2);
+    ca_push(calc, result);
+    return 0;
+}
+
+static int ca_op_greater(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2))
+        return -1;
+
+    ca_value_t result;
+    ca_value_greater(ca_first(calc), ca_second(calc), &result);
     ca_remove(calc, 2);
     ca_push(calc, result);
     return 0;
 }
 
-static int (*operations[])(ca_calc_t *calc) = {
+static int ca_op_greater_equal(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2))
+        return -1;
+
+    ca_value_t result;
+    ca_value_greater_equal(ca_first(calc), ca_second(calc), &result);
+    ca_remove(calc, 2);
+    ca_push(calc, result);
+    return 0;
+}
+
+/**
+ * Raise the value below the top to the power of the top value.
+ */
+static int ca_op_power(ca_calc_t *calc)
+{
+    if (ca_check_values(calc, 2))
+        return -1;
+
+    ca_value_t result;
+    if (ca_value_power(ca_first(calc), ca_second(calc), &result))
+        return -1;
+
+    ca_remove(calc, 2);
+    ca_push(calc, result);
+    return 0;
+}
+
+int (*const ca_operations[CA_OPERATION_COUNT])(ca_calc_t *calc) = {
     ca_op_add,
     ca_op_substract,
     ca_op_multiply,
@@ -274,13 +586,329 @@ static int (*operations[])(ca_calc_t *calc) = {
     ca_op_square_root,
     ca_op_modulo,
     ca_op_left_shift,
-    ca_op_right_shift
+    ca_op_right_shift,
+    ca_op_duplicate,
+    ca_op_swap,
+    ca_op_over,
+    ca_op_rotate,
+    ca_op_drop,
+    ca_op_equal,
+    ca_op_not_equal,
+    ca_op_less,
+    ca_op_less_equal,
+    ca_op_greater,
+    ca_op_greater_equal,
+    ca_op_power
+};
+
+const unsigned char ca_operation_operands[CA_OPERATION_COUNT] = {
+    [CA_OP_ADD] = 2,
+    [CA_OP_SUBSTRACT] = 2,
+    [CA_OP_MULTIPLY] = 2,
+    [CA_OP_DIVIDE] = 2,
+    [CA_OP_SQUARE_ROOT] = 1,
+    [CA_OP_MODULO] = 2,
+    [CA_OP_LEFT_SHIFT] = 2,
+    [CA_OP_RIGHT_SHIFT] = 2,
+    [CA_OP_DUPLICATE] = 1,
+    [CA_OP_SWAP] = 2,
+    [CA_OP_OVER] = 2,
+    [CA_OP_ROTATE] = 3,
+    [CA_OP_DROP] = 1,
+    [CA_OP_EQUAL] = 2,
+    [CA_OP_NOT_EQUAL] = 2,
+    [CA_OP_LESS] = 2,
+    [CA_OP_LESS_EQUAL] = 2,
+    [CA_OP_GREATER] = 2,
+    [CA_OP_GREATER_EQUAL] = 2,
+    [CA_OP_POWER] = 2
+};
+
+const unsigned char ca_operation_results[CA_OPERATION_COUNT] = {
+    [CA_OP_ADD] = 1,
+    [CA_OP_SUBSTRACT] = 1,
+    [CA_OP_MULTIPLY] = 1,
+    [CA_OP_DIVIDE] = 1,
+    [CA_OP_SQUARE_ROOT] = 1,
+    [CA_OP_MODULO] = 1,
+    [CA_OP_LEFT_SHIFT] = 1,
+    [CA_OP_RIGHT_SHIFT] = 1,
+    [CA_OP_DUPLICATE] = 2,
+    [CA_OP_SWAP] = 2,
+    [CA_OP_OVER] = 3,
+    [CA_OP_ROTATE] = 3,
+    [CA_OP_DROP] = 0,
+    [CA_OP_EQUAL] = 1,
+    [CA_OP_NOT_EQUAL] = 1,
+    [CA_OP_LESS] = 1,
+    [CA_OP_LESS_EQUAL] = 1,
+    [CA_OP_GREATER] = 1,
+    [CA_OP_GREATER_EQUAL] = 1,
+    [CA_OP_POWER] = 1
+};
+
+static const char *const ca_operation_names[CA_OPERATION_COUNT] = {
+    [CA_OP_ADD] = "add",
+    [CA_OP_SUBSTRACT] = "substract",
+    [CA_OP_MULTIPLY] = "multiply",
+    [CA_OP_DIVIDE] = "divide",
+    [CA_OP_SQUARE_ROOT] = "square_root",
+    [CA_OP_MODULO] = "modulo",
+    [CA_OP_LEFT_SHIFT] = "left_shift",
+    [CA_OP_RIGHT_SHIFT] = "right_shift",
+    [CA_OP_DUPLICATE] = "duplicate",
+    [CA_OP_SWAP] = "swap",
+    [CA_OP_OVER] = "over",
+    [CA_OP_ROTATE] = "rotate",
+    [CA_OP_DROP] = "drop",
+    [CA_OP_EQUAL] = "equal",
+    [CA_OP_NOT_EQUAL] = "not_equal",
+    [CA_OP_LESS] = "less",
+    [CA_OP_LESS_EQUAL] = "less_equal",
+    [CA_OP_GREATER] = "greater",
+    [CA_OP_GREATER_EQUAL] = "greater_equal",
+    [CA_OP_POWER] = "power"
 };
 
+const char *ca_operation_name(ca_operation_t op)
+{
+    assert_ca_operation(op);
+    return ca_operation_names[op];
+}
+
+/**
+ * Apply an operation in the arithmetic of the mode of an eager context.
+ */
+static int ca_operate_mode(ca_calc_t *calc, ca_operation_t op)
+{
+    ca_value_t result;
+    int retval;
+
+    if (op == CA_OP_SQUARE_ROOT) {
+        if (ca_check_values(calc, 1))
+            return -1;
+        retval = ca_mode_square_root(calc->mode, ca_second(calc), &result);
+    } else if (ca_operation_operands[op] == 2 && ca_operation_results[op] == 1) {
+        if (ca_check_values(calc, 2))
+            return -1;
+        retval = ca_mode_binary(calc->mode, op, ca_first(calc), ca_second(calc), &result);
+    } else {
+        retval = 1;
+    }
+
+    if (retval > 0)
+        return ca_operations[op](calc);
+    if (retval < 0)
+        return -1;
+
+    calc->top -= ca_operation_operands[op] - 1;
+    calc->stack[calc->top - 1] = result;
+    return 0;
+}
+
 int ca_operate(ca_calc_t *calc, ca_operation_t op)
 {
     assert_ca_operation(op);
     assert_calc(calc);
-    assert(operations[op]);
-    return operations[op](calc);
+    assert(ca_operations[op]);
+    if (calc->lazy)
+        return ca_lazy_record(calc, op, 0);
+
+    int retval = calc->mode ? ca_operate_mode(calc, op) : ca_operations[op](calc);
+    ca_spill_check(calc);
+    return retval;
+}
+
+/**
+ * The arithmetic of the operations taking two values and giving one,
+ * NULL for the other operations.
+ */
+static int (*const ca_value_binary[CA_OPERATION_COUNT])(ca_value_t x, ca_value_t y, ca_value_t *result) = {
+    [CA_OP_ADD] = ca_value_add,
+    [CA_OP_SUBSTRACT] = ca_value_substract,
+    [CA_OP_MULTIPLY] = ca_value_multiply,
+    [CA_OP_DIVIDE] = ca_value_divide,
+    [CA_OP_MODULO] = ca_value_modulo,
+    [CA_OP_LEFT_SHIFT] = ca_value_left_shift,
+    [CA_OP_RIGHT_SHIFT] = ca_value_right_shift,
+    [CA_OP_EQUAL] = ca_value_equal,
+    [CA_OP_NOT_EQUAL] = ca_value_not_equal,
+    [CA_OP_LESS] = ca_value_less,
+    [CA_OP_LESS_EQUAL] = ca_value_less_equal,
+    [CA_OP_GREATER] = ca_value_greater,
+    [CA_OP_GREATER_EQUAL] = ca_value_greater_equal,
+    [CA_OP_POWER] = ca_value_power
+};
+
+/**
+ * Apply deferred entries to an eager context.
+ */
+static int ca_lazy_apply(ca_calc_t *calc, const ca_lazy_entry_t *entries, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const ca_lazy_entry_t *entry = entries + i;
+
+        if (entry->kind != CA_LAZY_PUSH) {
+            if (calc->mode ? ca_operate_mode(calc, entry->kind) : ca_operations[entry->kind](calc))
+                return -1;
+            continue;
+        }
+
+        if (ca_check_space(calc, 1))
+            return -1;
+
+        /* apply the operation taking the pushed value in place, the
+         * operations of modes are not fused */
+        if (i + 1 < count && entry[1].kind != CA_LAZY_PUSH && ca_value_binary[entry[1].kind] && calc->top &&
+            calc->mode == NULL) {
+            ca_value_t *top = calc->stack + calc->top - 1;
+            if (ca_value_binary[entry[1].kind](*top, entry->value, top)) {
+                calc->stack[calc->top++] = entry->value;
+                return -1;
+            }
+            i += 1;
+            continue;
+        }
+
+        calc->stack[calc->top++] = entry->value;
+    }
+    return 0;
+}
+
+/**
+ * Apply the deferred entries, keeping their failure until it is
+ * reported by ca_flush.
+ */
+static int ca_lazy_sync(ca_calc_t *calc)
+{
+    struct ca_lazy *lazy = calc->lazy;
+    if (lazy->count == 0)
+        return 0;
+
+    /* the operations push and pop as in an eager context */
+    calc->lazy = NULL;
+    int retval = ca_lazy_apply(calc, lazy->entries, lazy->count);
+    calc->lazy = lazy;
+    ca_spill_check(calc);
+
+    lazy->count = 0;
+    if (retval)
+        lazy->failed = 1;
+    return retval;
+}
+
+int ca_flush(ca_calc_t *calc)
+{
+    assert_calc(calc);
+
+    struct ca_lazy *lazy = calc->lazy;
+    if (lazy == NULL)
+        return 0;
+
+    ca_lazy_sync(calc);
+    if (lazy->failed) {
+        lazy->failed = 0;
+        return -1;
+    }
+    return 0;
+}
+
+size_t ca_count(ca_calc_t *calc)
+{
+    assert(calc);
+    if (calc->lazy)
+        ca_lazy_sync(calc);
+    return calc->top;
+}
+
+int ca_set_lazy(ca_calc_t *calc, size_t capacity)
+{
+    assert_calc(calc);
+
+    int retval = ca_flush(calc);
+    if (calc->lazy) {
+        ca_free(calc->allocator, calc->lazy, ca_lazy_size(calc->lazy->capacity));
+        calc->lazy = NULL;
+    }
+    if (capacity == 0)
+        return retval;
+
+    calc->lazy = ca_alloc(calc->allocator, ca_lazy_size(capacity));
+    if (calc->lazy == NULL) {
+        tr("unable to create queue: %m");
+        return -1;
+    }
+    calc->lazy->count = 0;
+    calc->lazy->capacity = capacity;
+    calc->lazy->failed = 0;
+    return retval;
+}
+
+/**
+ * Set the mode of a context, NULL for plain integers.
+ */
+static int ca_set_mode(ca_calc_t *calc, const struct ca_mode *mode)
+{
+    /* the deferred operations are applied in the previous mode */
+    int retval = ca_flush(calc);
+
+    if (mode && calc->mode == NULL) {
+        calc->mode = ca_alloc(calc->allocator, sizeof(struct ca_mode));
+        if (calc->mode == NULL) {
+            tr("unable to create mode: %m");
+            return -1;
+        }
+    }
+    if (mode) {
+        *calc->mode = *mode;
+    } else {
+        ca_free(calc->allocator, calc->mode, sizeof(struct ca_mode));
+        calc->mode = NULL;
+    }
+    return retval;
+}
+
+int ca_set_modulus(ca_calc_t *calc, ca_value_t modulus)
+{
+    assert_calc(calc);
+
+    if (modulus == 0)
+        return ca_set_mode(calc, NULL);
+    if (modulus < 3 || modulus % 2 == 0) {
+        tr("modulus %ld should be odd and greater than 1", modulus);
+        return -1;
+    }
+
+    struct ca_mode mode = { .kind = CA_MODE_MODULAR };
+    uint64_t m = modulus, inverse = m;
+
+    /* Newton iterations, each doubling the correct low bits of the
+     * inverse, starting with 3 bits since m m = 1 mod 8 */
+    for (unsigned i = 0; i < 5; i++)
+        inverse *= 2 - m * inverse;
+
+    uint64_t r = ((unsigned __int128) 1 << 64) % m;
+    mode.modular.modulus = m;
+    mode.modular.inverse = -inverse;
+    mode.modular.r2 = (unsigned __int128) r * r % m;
+    return ca_set_mode(calc, &mode);
+}
+
+int ca_set_decimal(ca_calc_t *calc, unsigned digits)
+{
+    assert_calc(calc);
+
+    if (digits == 0)
+        return ca_set_mode(calc, NULL);
+    if (digits > CA_DECIMAL_MAX_DIGITS) {
+        tr("decimals have at most %u digits after the point", CA_DECIMAL_MAX_DIGITS);
+        return -1;
+    }
+
+    struct ca_mode mode = { .kind = CA_MODE_DECIMAL };
+    mode.decimal.digits = digits;
+    mode.decimal.scale = 1;
+    while (digits--)
+        mode.decimal.scale *= 10;
+    return ca_set_mode(calc, &mode);
 }
@@ -29,11 +29,79 @@ typedef enum ca_operation {
     CA_OP_SQUARE_ROOT,
     CA_OP_MODULO,
     CA_OP_LEFT_SHIFT,
-    CA_OP_RIGHT_SHIFT
+    CA_OP_RIGHT_SHIFT,
+    /** Push a copy of the top value */
+    CA_OP_DUPLICATE,
+    /** Exchange the two top values */
+    CA_OP_SWAP,
+    /** Push a copy of the value below the top */
+    CA_OP_OVER,
+    /** Move the third value to the top: a b c -> b c a */
+    CA_OP_ROTATE,
+    /** Remove the top value */
+    CA_OP_DROP,
+    /** Replace the two top values by 1 if they compare equal, 0 otherwise */
+    CA_OP_EQUAL,
+    CA_OP_NOT_EQUAL,
+    CA_OP_LESS,
+    CA_OP_LESS_EQUAL,
+    CA_OP_GREATER,
+    CA_OP_GREATER_EQUAL,
+    /** Raise the value below the top to the power of the top value */
+    CA_OP_POWER
 } ca_operation_t;
 
+/**
+ * How the library allocates memory.
+ *
+ * Allocations are not initialized. realloc is given a NULL pointer to
+ * allocate, and realloc and free are given the size of the allocation
+ * so that arena and slab allocators do not have to record it. The
+ * library never frees a NULL pointer.
+ */
+typedef struct ca_allocator {
+    /** Allocate size bytes, NULL on failure */
+    void *(*alloc)(void *data, size_t size);
+    /** Resize an allocation of old_size bytes, NULL on failure */
+    void *(*realloc)(void *data, void *ptr, size_t old_size, size_t size);
+    /** Release an allocation of size bytes */
+    void (*free)(void *data, void *ptr, size_t size);
+    /** Passed to each function */
+    void *data;
+} ca_allocator_t;
+
+/**
+ * Set the allocator used by the contexts and objects initialized from
+ * now on, which keep using the allocator they were initialized with.
+ *
+ * This is not thread safe, the default allocator should be set before
+ * the library is used.
+ *
+ * @param allocator the allocator, which must outlive its users, NULL
+ * to restore the allocator of the C library.
+ */
+void ca_set_allocator(const ca_allocator_t *allocator);
+
+/**
+ * Return the default allocator.
+ */
+const ca_allocator_t *ca_get_allocator(void);
+
+/**
+ * The operations deferred by a lazy context.
+ */
+struct ca_lazy;
+
+/**
+ * Size of the stack held by the context itself.
+ */
+#define CA_INLINE_STACK_SIZE 16
+
 /**
  * The library context.
+ *
+ * Stacks of up to CA_INLINE_STACK_SIZE values live in the context
+ * itself, so an initialized context should not be copied.
  */
 typedef struct ca_calc {
     /** The stack */
@@ -42,6 +110,18 @@ typedef struct ca_calc {
     size_t size;
     /** Index of the top of the stack */
     size_t top;
+    /** Size of the mapping holding the stack, 0 if it is not mapped */
+    size_t mapped;
+    /** Allocator of the stack */
+    const ca_allocator_t *allocator;
+    /** The deferred operations, NULL if they are applied immediately */
+    struct ca_lazy *lazy;
+    /** The arithmetic of the values, NULL for plain integers */
+    struct ca_mode *mode;
+    /** The segments of a stack in a file, NULL for other stacks */
+    struct ca_spill *spill;
+    /** The stack of small contexts */
+    ca_value_t inline_stack[CA_INLINE_STACK_SIZE];
 } ca_calc_t;
 
 /**
@@ -52,19 +132,94 @@ typedef struct ca_calc {
  */
 int ca_initialize(ca_calc_t *calc, size_t size) __attribute__ ((nonnull(1)));
 
+/**
+ * Initialize the library context with an allocator.
+ *
+ * @param size size of the stack, must be greater than 0.
+ * @param allocator the allocator of the stack, NULL for the default one.
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_initialize_allocator(ca_calc_t *calc, size_t size, const ca_allocator_t *allocator) __attribute__ ((nonnull(1)));
+
 /**
  * Cleanup the library context.
  */
 void ca_cleanup(ca_calc_t *calc) __attribute__ ((nonnull(1)));
 
+/**
+ * Defer the pushes and operations on the stack.
+ *
+ * ca_push and ca_operate then only record what to do, and the recorded
+ * run is applied in a single pass when the stack is observed or
+ * capacity entries are recorded. A push followed by an operation
+ * taking it is applied in place without storing the pushed value.
+ *
+ * A deferred operation does not report its failure when it is
+ * recorded but by the next ca_flush, ca_operate also failing when it
+ * fills the queue. The stack is left as it was when the failing
+ * operation was applied and the rest of the run is discarded.
+ *
+ * @param calc the library context
+ * @param capacity the number of entries to record before applying
+ * them, 0 to apply the operations immediately again
+ * @return 0 on success, -1 if the allocation or the deferred
+ * operations fail.
+ */
+int ca_set_lazy(ca_calc_t *calc, size_t capacity) __attribute__ ((nonnull(1)));
+
+/**
+ * Apply the deferred operations.
+ *
+ * @return 0 on success, -1 if an operation failed.
+ */
+int ca_flush(ca_calc_t *calc) __attribute__ ((nonnull(1)));
+
+/**
+ * Compute modulo a fixed modulus.
+ *
+ * Additions, substractions, multiplications and powers then reduce
+ * their operands and their result to [0, modulus), never failing on
+ * overflows. Products are reduced by Montgomery reduction, without
+ * divisions. The other operations are not changed.
+ *
+ * @param calc the library context
+ * @param modulus an odd modulus greater than 1, 0 to compute with
+ * plain integers again
+ * @return 0 on success, -1 if the modulus is invalid, the allocation
+ * or the deferred operations fail.
+ */
+int ca_set_modulus(ca_calc_t *calc, ca_value_t modulus) __attribute__ ((nonnull(1)));
+
+/**
+ * Maximum number of digits after the decimal point, see ca_set_decimal.
+ */
+#define CA_DECIMAL_MAX_DIGITS 18
+
+/**
+ * Compute with fixed point decimals.
+ *
+ * Values are then decimals multiplied by 10^digits: with 2 digits, 150
+ * stands for 1.50. Products, quotients, powers and square roots are
+ * rescaled, on 128 bit intermediates so that only results which do not
+ * fit overflow; products and quotients are rounded half away from
+ * zero, square roots down. Exponents should be integers. The other
+ * operations, like the constants of compiled programs, are not
+ * changed, and the values already on the stack are not rescaled. See
+ * ca_parse_decimal and ca_format_decimal to convert decimals from and
+ * to text.
+ *
+ * @param calc the library context
+ * @param digits the number of digits after the decimal point, at most
+ * CA_DECIMAL_MAX_DIGITS, 0 to compute with plain integers again
+ * @return 0 on success, -1 if digits is invalid, the allocation or the
+ * deferred operations fail.
+ */
+int ca_set_decimal(ca_calc_t *calc, unsigned digits) __attribute__ ((nonnull(1)));
+
 /**
  * Return the number of element on the stack
  */
- __attribute__ ((nonnull(1)))
-static inline size_t ca_count(ca_calc_t *calc)
-{
-    return calc->top;
-}
+size_t ca_count(ca_calc_t *calc) __attribute__ ((nonnull(1)));
 
 /**
  * Return the space left of the stack
@@ -113,12 +268,18 @@ ca_value_t ca_top(ca_calc_t *calc) __attribute__ ((nonnull(1)));
  */
 int ca_operate(ca_calc_t *calc, ca_operation_t op) __attribute__ ((nonnull(1)));
 
+/**
+ * Return the name of an operation, like "add" or "square_root".
+ */
+const char *ca_operation_name(ca_operation_t op);
+
 /**
  * Iterate over each value of the stack
  *
  * @param calc the library context
  * @param value a pointer to a ca_value_t
  */
-#define ca_stack_for_each(calc, value) for (value = (calc)->stack; value < (calc)->stack + (calc)->top; value++)
+#define ca_stack_for_each(calc, value) \
+    for ((void) ca_count(calc), value = (calc)->stack; value < (calc)->stack + (calc)->top; value++)
 
 #endif /* _LIBCALC_H_ */
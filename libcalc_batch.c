@@ -0,0 +1,573 @@
+#include <assert.h>
+#include <string.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_batch.h"
+
+/**
+ * Initial size of the hash tables.
+ */
+#define CA_BATCH_TABLE 64
+
+/**
+ * The operation of the nodes loading a variable slot.
+ */
+#define CA_BATCH_LOAD CA_OPERATION_COUNT
+
+/**
+ * The operation of the nodes pushing a constant.
+ */
+#define CA_BATCH_CONSTANT (CA_OPERATION_COUNT + 1)
+
+/**
+ * An operation of the programs of a batch.
+ */
+struct ca_batch_node {
+    /** The ca_operation_t, CA_BATCH_LOAD or CA_BATCH_CONSTANT */
+    unsigned op;
+    /** The first operand, the slot or the constant of the inputs */
+    size_t left;
+    /** The second operand of binary operations, 0 otherwise */
+    size_t right;
+    /** The value computed for the binding of the epoch */
+    ca_value_t value;
+    /** 0 if the value is valid, -1 if the operation failed */
+    int status;
+    /** Whether the inputs of the operation are constants only */
+    int constant;
+    /** The binding the value was computed for */
+    size_t epoch;
+};
+
+/**
+ * The operations of a program of a batch.
+ */
+struct ca_batch_program {
+    const ca_program_t *prog;
+    /** The nodes of the inputs and operations, in the order the program
+     * applies them, NULL for programs with jumps */
+    size_t *nodes;
+    /** Number of nodes */
+    size_t length;
+    /** Number of allocated nodes */
+    size_t capacity;
+    /** The node of the result */
+    size_t result;
+};
+
+/**
+ * Return the hash of an entry of a hash table of a batch.
+ */
+typedef size_t (*ca_batch_hash_t)(const ca_batch_t *batch, size_t index);
+
+static size_t ca_batch_hash(unsigned op, size_t left, size_t right)
+{
+    size_t hash = ((op * 0x9e3779b97f4a7c15UL) ^ left) * 0xff51afd7ed558ccdUL;
+    hash = (hash ^ right ^ (hash >> 32)) * 0xc4ceb9fe1a85ec53UL;
+    return hash ^ (hash >> 29);
+}
+
+static size_t ca_batch_node_hash(const ca_batch_t *batch, size_t index)
+{
+    const struct ca_batch_node *node = batch->nodes + index;
+    return ca_batch_hash(node->op, node->left, node->right);
+}
+
+static size_t ca_batch_program_hash(const ca_batch_t *batch, size_t index)
+{
+    return ca_batch_hash(0, (size_t) batch->programs[index].prog, 0);
+}
+
+/**
+ * Insert an entry missing from a hash table.
+ */
+static void ca_batch_insert(size_t *table, size_t capacity, size_t hash, size_t entry)
+{
+    size_t mask = capacity - 1, i;
+
+    for (i = hash & mask; table[i]; i = (i + 1) & mask)
+        ;
+    table[i] = entry;
+}
+
+/**
+ * Grow a hash table holding count entries to hold one more, keeping it
+ * at most half full.
+ */
+static int ca_batch_grow_table(ca_batch_t *batch, size_t **table, size_t *capacity, size_t count,
+                               ca_batch_hash_t hash)
+{
+    if (2 * (count + 1) <= *capacity)
+        return 0;
+
+    size_t *old = *table, old_capacity = *capacity;
+    size_t grown = 2 * old_capacity;
+
+    *table = ca_alloc(batch->allocator, grown * sizeof(size_t));
+    if (*table == NULL) {
+        tr("unable to grow batch: %m");
+        *table = old;
+        return -1;
+    }
+    memset(*table, 0, grown * sizeof(size_t));
+    *capacity = grown;
+
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old[i])
+            ca_batch_insert(*table, grown, hash(batch, old[i] - 1), old[i]);
+    ca_free(batch->allocator, old, old_capacity * sizeof(size_t));
+    return 0;
+}
+
+/**
+ * Grow an array to hold at least needed elements.
+ */
+static int ca_batch_reserve(const ca_allocator_t *allocator, void **array, size_t *capacity, size_t needed,
+                            size_t size)
+{
+    if (needed <= *capacity)
+        return 0;
+
+    size_t grown = *capacity ? 2 * *capacity : 16;
+    while (grown < needed)
+        grown *= 2;
+
+    void *resized = ca_realloc(allocator, *array, *capacity * size, grown * size);
+    if (resized == NULL) {
+        tr("unable to grow batch: %m");
+        return -1;
+    }
+    *array = resized;
+    *capacity = grown;
+    return 0;
+}
+
+/**
+ * Find an operation, adding it if it is not in the batch yet.
+ *
+ * @param index where to store the index of the node
+ * @return 0 on success, -1 otherwise.
+ */
+static int ca_batch_node(ca_batch_t *batch, unsigned op, size_t left, size_t right, size_t *index)
+{
+    size_t mask = batch->table_capacity - 1, hash = ca_batch_hash(op, left, right);
+
+    for (size_t i = hash & mask; batch->table[i]; i = (i + 1) & mask) {
+        const struct ca_batch_node *node = batch->nodes + batch->table[i] - 1;
+        if (node->op == op && node->left == left && node->right == right) {
+            *index = batch->table[i] - 1;
+            return 0;
+        }
+    }
+
+    if (ca_batch_grow_table(batch, &batch->table, &batch->table_capacity, batch->count, ca_batch_node_hash) ||
+        ca_batch_reserve(batch->allocator, (void **) &batch->nodes, &batch->capacity, batch->count + 1,
+                         sizeof(struct ca_batch_node)))
+        return -1;
+
+    struct ca_batch_node *node = batch->nodes + batch->count;
+    node->op = op;
+    node->left = left;
+    node->right = right;
+    node->epoch = 0;
+    /* operations on constants only give the same value for every
+     * binding */
+    node->constant = op == CA_BATCH_CONSTANT ||
+        (op < CA_OPERATION_COUNT && batch->nodes[left].constant &&
+         (ca_operation_operands[op] < 2 || batch->nodes[right].constant));
+
+    *index = batch->count++;
+    ca_batch_insert(batch->table, batch->table_capacity, hash, batch->count);
+    return 0;
+}
+
+/**
+ * Add an operation of a program being added.
+ */
+static int ca_batch_emit(ca_batch_t *batch, struct ca_batch_program *program, size_t *top, unsigned op,
+                         size_t left, size_t right)
+{
+    size_t index;
+
+    if (ca_batch_node(batch, op, left, right, &index))
+        return -1;
+    batch->stack[(*top)++] = index;
+    program->nodes[program->length++] = index;
+    return 0;
+}
+
+/**
+ * Add an operation on the stack of a program being added.
+ */
+static int ca_batch_operate(ca_batch_t *batch, struct ca_batch_program *program, size_t *top, ca_operation_t op)
+{
+    size_t *stack = batch->stack, t = *top, moved;
+
+    /* the stack operations only move the values */
+    switch (op) {
+    case CA_OP_DUPLICATE:
+        stack[t] = stack[t - 1];
+        *top += 1;
+        return 0;
+    case CA_OP_SWAP:
+        moved = stack[t - 1];
+        stack[t - 1] = stack[t - 2];
+        stack[t - 2] = moved;
+        return 0;
+    case CA_OP_OVER:
+        stack[t] = stack[t - 2];
+        *top += 1;
+        return 0;
+    case CA_OP_ROTATE:
+        moved = stack[t - 3];
+        stack[t - 3] = stack[t - 2];
+        stack[t - 2] = stack[t - 1];
+        stack[t - 1] = moved;
+        return 0;
+    case CA_OP_DROP:
+        *top -= 1;
+        return 0;
+    default:
+        break;
+    }
+
+    unsigned operands = ca_operation_operands[op];
+    size_t left = stack[t - operands], right = operands == 2 ? stack[t - 1] : 0;
+
+    *top -= operands;
+    return ca_batch_emit(batch, program, top, op, left, right);
+}
+
+/**
+ * Add the operations of a straight program to the graph.
+ */
+static int ca_batch_add_nodes(ca_batch_t *batch, struct ca_batch_program *program)
+{
+    const ca_program_t *prog = program->prog;
+    size_t top = 0;
+
+    /* each instruction adds at most a superinstruction, or a constant
+     * and its division */
+    program->capacity = prog->length * CA_SUPERINSTRUCTION_LENGTH;
+    program->nodes = ca_alloc(batch->allocator, program->capacity * sizeof(size_t));
+    if (program->nodes == NULL) {
+        tr("unable to add program to batch: %m");
+        return -1;
+    }
+    if (ca_batch_reserve(batch->allocator, (void **) &batch->stack, &batch->stack_capacity, prog->depth,
+                         sizeof(size_t)))
+        return -1;
+
+    for (const ca_instruction_t *ins = prog->code; ins < prog->code + prog->length; ins++) {
+        const ca_superinstruction_t *super;
+        const ca_divider_t *divider;
+        int retval = 0;
+
+        switch (ins->code) {
+        case CA_INS_PUSH:
+            retval = ca_batch_emit(batch, program, &top, CA_BATCH_CONSTANT, (size_t) ins->operand, 0);
+            break;
+        case CA_INS_LOAD:
+            retval = ca_batch_emit(batch, program, &top, CA_BATCH_LOAD, ins->operand, 0);
+            break;
+        case CA_INS_OPERATE:
+            retval = ca_batch_operate(batch, program, &top, ins->operand);
+            break;
+        case CA_INS_DIVIDE_CONST:
+        case CA_INS_MODULO_CONST:
+            /* shared with the same operation on a pushed constant */
+            divider = prog->dividers + ins->operand;
+            retval = ca_batch_emit(batch, program, &top, CA_BATCH_CONSTANT, (size_t) divider->divisor, 0) ||
+                ca_batch_operate(batch, program, &top,
+                                 ins->code == CA_INS_DIVIDE_CONST ? CA_OP_DIVIDE : CA_OP_MODULO);
+            break;
+        case CA_INS_SUPER:
+            super = ca_superinstructions + ins->operand;
+            for (unsigned i = 0; i < super->length && retval == 0; i++)
+                retval = ca_batch_operate(batch, program, &top, super->ops[i]);
+            break;
+        default:
+            /* the programs with jumps are not added */
+            assert(0);
+        }
+        if (retval)
+            return -1;
+    }
+
+    program->result = batch->stack[0];
+    return 0;
+}
+
+/**
+ * Find a program, adding it if it is not in the batch yet.
+ *
+ * @param index where to store the index of the program
+ * @return 0 on success, -1 otherwise.
+ */
+static int ca_batch_program(ca_batch_t *batch, const ca_program_t *prog, size_t *index)
+{
+    size_t mask = batch->program_table_capacity - 1, hash = ca_batch_hash(0, (size_t) prog, 0);
+
+    for (size_t i = hash & mask; batch->program_table[i]; i = (i + 1) & mask) {
+        if (batch->programs[batch->program_table[i] - 1].prog == prog) {
+            *index = batch->program_table[i] - 1;
+            return 0;
+        }
+    }
+
+    if (ca_batch_grow_table(batch, &batch->program_table, &batch->program_table_capacity, batch->program_count,
+                            ca_batch_program_hash) ||
+        ca_batch_reserve(batch->allocator, (void **) &batch->programs, &batch->program_capacity,
+                         batch->program_count + 1, sizeof(struct ca_batch_program)))
+        return -1;
+
+    struct ca_batch_program *program = batch->programs + batch->program_count;
+    int jumps = ca_program_has_jumps(prog);
+
+    program->prog = prog;
+    program->nodes = NULL;
+    program->length = 0;
+    program->capacity = 0;
+
+    if (jumps && prog->depth > batch->scratch.size) {
+        ca_cleanup(&batch->scratch);
+        if (ca_initialize_allocator(&batch->scratch, prog->depth, batch->allocator)) {
+            /* an inline stack is not allocated */
+            ca_initialize_allocator(&batch->scratch, CA_INLINE_STACK_SIZE, batch->allocator);
+            return -1;
+        }
+    }
+    if (!jumps && ca_batch_add_nodes(batch, program)) {
+        ca_free(batch->allocator, program->nodes, program->capacity * sizeof(size_t));
+        return -1;
+    }
+
+    *index = batch->program_count++;
+    ca_batch_insert(batch->program_table, batch->program_table_capacity, hash, batch->program_count);
+    return 0;
+}
+
+/**
+ * Compute an operation for the binding of the current epoch.
+ */
+static void ca_batch_compute(ca_batch_t *batch, struct ca_batch_node *node, const ca_value_t *vars)
+{
+    ca_calc_t *calc = &batch->scratch;
+
+    node->epoch = batch->epoch;
+    node->status = 0;
+
+    switch (node->op) {
+    case CA_BATCH_LOAD:
+        node->value = vars[node->left];
+        return;
+    case CA_BATCH_CONSTANT:
+        node->value = (ca_value_t) node->left;
+        return;
+    default:
+        break;
+    }
+
+    calc->top = 0;
+    calc->stack[calc->top++] = batch->nodes[node->left].value;
+    if (ca_operation_operands[node->op] == 2)
+        calc->stack[calc->top++] = batch->nodes[node->right].value;
+    node->status = ca_operations[node->op](calc);
+    node->value = calc->stack[0];
+    batch->stats.computed += 1;
+}
+
+/**
+ * Evaluate a job, reusing the operations computed for its binding and
+ * the operations on constants computed for the batch.
+ */
+static int ca_batch_run(ca_batch_t *batch, const struct ca_batch_program *program, const ca_value_t *vars,
+                        ca_value_t *result)
+{
+    batch->stats.jobs += 1;
+
+    if (program->nodes == NULL) {
+        batch->stats.unshared += 1;
+        batch->scratch.top = 0;
+        if (ca_run(&batch->scratch, program->prog, vars))
+            return -1;
+        *result = ca_pop(&batch->scratch);
+        return 0;
+    }
+
+    for (size_t i = 0; i < program->length; i++) {
+        struct ca_batch_node *node = batch->nodes + program->nodes[i];
+
+        if (node->op < CA_OPERATION_COUNT)
+            batch->stats.operations += 1;
+        if (node->epoch < (node->constant ? batch->eval_epoch : batch->epoch))
+            ca_batch_compute(batch, node, vars);
+        if (node->status)
+            return -1;
+    }
+
+    *result = batch->nodes[program->result].value;
+    return 0;
+}
+
+static size_t ca_batch_hash_binding(const ca_value_t *vars, size_t count)
+{
+    size_t hash = 14695981039346656037UL ^ count;
+    for (size_t i = 0; i < count; i++)
+        hash = (hash ^ (size_t) vars[i]) * 1099511628211UL;
+    return hash ^ (hash >> 29);
+}
+
+/**
+ * Number each distinct binding of the jobs, in order of first
+ * appearance.
+ *
+ * @param bindings where to store the number of the binding of each job
+ * @return the number of distinct bindings, 0 on failure.
+ */
+static size_t ca_batch_bindings(ca_batch_t *batch, const ca_program_t *const *progs, const ca_value_t *const *vars,
+                                size_t count, size_t *bindings)
+{
+    size_t capacity = CA_BATCH_TABLE, distinct = 0;
+    while (capacity < 2 * count)
+        capacity *= 2;
+
+    /* the first job of each binding plus one */
+    size_t *table = ca_alloc(batch->allocator, capacity * sizeof(size_t)), mask = capacity - 1;
+    if (table == NULL) {
+        tr("unable to group batch jobs: %m");
+        return 0;
+    }
+    memset(table, 0, capacity * sizeof(size_t));
+
+    for (size_t j = 0; j < count; j++) {
+        size_t n = progs[j]->variable_count, *slot;
+
+        for (size_t i = ca_batch_hash_binding(vars[j], n) & mask;; i = (i + 1) & mask) {
+            slot = table + i;
+            if (*slot == 0)
+                break;
+
+            size_t first = *slot - 1;
+            if (progs[first]->variable_count == n && (n == 0 || memcmp(vars[first], vars[j], n * sizeof(ca_value_t)) == 0))
+                break;
+        }
+
+        if (*slot) {
+            bindings[j] = bindings[*slot - 1];
+        } else {
+            *slot = j + 1;
+            bindings[j] = distinct++;
+        }
+    }
+
+    ca_free(batch->allocator, table, capacity * sizeof(size_t));
+    return distinct;
+}
+
+int ca_batch_initialize(ca_batch_t *batch)
+{
+    assert(batch);
+
+    memset(batch, 0, sizeof(*batch));
+    batch->allocator = ca_get_allocator();
+    ca_initialize_allocator(&batch->scratch, CA_INLINE_STACK_SIZE, batch->allocator);
+
+    batch->table = ca_alloc(batch->allocator, CA_BATCH_TABLE * sizeof(size_t));
+    batch->program_table = ca_alloc(batch->allocator, CA_BATCH_TABLE * sizeof(size_t));
+    if (batch->table == NULL || batch->program_table == NULL) {
+        tr("unable to create batch: %m");
+        ca_free(batch->allocator, batch->table, CA_BATCH_TABLE * sizeof(size_t));
+        ca_free(batch->allocator, batch->program_table, CA_BATCH_TABLE * sizeof(size_t));
+        return -1;
+    }
+    memset(batch->table, 0, CA_BATCH_TABLE * sizeof(size_t));
+    memset(batch->program_table, 0, CA_BATCH_TABLE * sizeof(size_t));
+    batch->table_capacity = CA_BATCH_TABLE;
+    batch->program_table_capacity = CA_BATCH_TABLE;
+    return 0;
+}
+
+void ca_batch_cleanup(ca_batch_t *batch)
+{
+    assert(batch);
+
+    ca_batch_reset(batch);
+    ca_free(batch->allocator, batch->nodes, batch->capacity * sizeof(struct ca_batch_node));
+    ca_free(batch->allocator, batch->table, batch->table_capacity * sizeof(size_t));
+    ca_free(batch->allocator, batch->programs, batch->program_capacity * sizeof(struct ca_batch_program));
+    ca_free(batch->allocator, batch->program_table, batch->program_table_capacity * sizeof(size_t));
+    ca_free(batch->allocator, batch->stack, batch->stack_capacity * sizeof(size_t));
+    ca_cleanup(&batch->scratch);
+    memset(batch, 0, sizeof(*batch));
+}
+
+void ca_batch_reset(ca_batch_t *batch)
+{
+    assert(batch);
+
+    for (size_t i = 0; i < batch->program_count; i++)
+        ca_free(batch->allocator, batch->programs[i].nodes, batch->programs[i].capacity * sizeof(size_t));
+    memset(batch->table, 0, batch->table_capacity * sizeof(size_t));
+    memset(batch->program_table, 0, batch->program_table_capacity * sizeof(size_t));
+    memset(&batch->stats, 0, sizeof(batch->stats));
+    batch->count = 0;
+    batch->program_count = 0;
+}
+
+int ca_batch_eval(ca_batch_t *batch, const ca_program_t *const *progs, const ca_value_t *const *vars,
+                  size_t count, ca_value_t *results, int *status)
+{
+    assert(batch);
+    assert(progs);
+    assert(vars);
+    assert(results);
+
+    if (count == 0)
+        return 0;
+
+    size_t length = (4 * count + 1) * sizeof(size_t);
+    size_t *work = ca_alloc(batch->allocator, length);
+    if (work == NULL) {
+        tr("unable to evaluate batch: %m");
+        return -1;
+    }
+    size_t *programs = work, *bindings = work + count, *order = work + 2 * count, *starts = work + 3 * count;
+    int retval = -1;
+
+    for (size_t j = 0; j < count; j++)
+        if (ca_batch_program(batch, progs[j], programs + j))
+            goto out;
+
+    size_t distinct = ca_batch_bindings(batch, progs, vars, count, bindings);
+    if (distinct == 0)
+        goto out;
+
+    /* counting sort of the jobs by binding */
+    memset(starts, 0, (distinct + 1) * sizeof(size_t));
+    for (size_t j = 0; j < count; j++)
+        starts[bindings[j] + 1] += 1;
+    for (size_t b = 0; b < distinct; b++)
+        starts[b + 1] += starts[b];
+    for (size_t j = 0; j < count; j++)
+        order[starts[bindings[j]]++] = j;
+
+    retval = 0;
+    batch->eval_epoch = batch->epoch + 1;
+    for (size_t k = 0; k < count; k++) {
+        size_t j = order[k];
+
+        if (k == 0 || bindings[j] != bindings[order[k - 1]])
+            batch->epoch += 1;
+
+        int s = ca_batch_run(batch, batch->programs + programs[j], vars[j], results + j);
+        if (status)
+            status[j] = s;
+        if (s)
+            retval = -1;
+    }
+
+out:
+    ca_free(batch->allocator, work, length);
+    return retval;
+}
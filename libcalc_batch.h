@@ -0,0 +1,130 @@
+#ifndef _LIBCALC_BATCH_H_
+#define _LIBCALC_BATCH_H_
+
+#include "libcalc.h"
+#include "libcalc_program.h"
+
+/**
+ * An operation of the programs of a batch.
+ */
+struct ca_batch_node;
+
+/**
+ * The operations of a program of a batch.
+ */
+struct ca_batch_program;
+
+/**
+ * How much work a batch shared between its jobs.
+ */
+typedef struct ca_batch_stats {
+    /** Number of jobs evaluated */
+    size_t jobs;
+    /** Number of operations the jobs applied */
+    size_t operations;
+    /** Number of distinct operations computed, the others reusing
+     * their results */
+    size_t computed;
+    /** Number of jobs of programs with jumps, which are run on their
+     * own */
+    size_t unshared;
+} ca_batch_stats_t;
+
+/**
+ * Programs evaluated together, sharing the operations they apply to
+ * the same values.
+ *
+ * The operations of the programs form a graph: the constants and the
+ * variable slots are its inputs, and each operation is a node
+ * hash-consed on its operation and operands, so programs computing
+ * the same subexpression, like a common prefix of their instructions,
+ * share its node. A batch of jobs is evaluated binding by binding,
+ * each node used by the jobs of a binding being computed once and its
+ * result reused by the other jobs. The nodes whose inputs are constants
+ * only are computed once for the whole batch, whatever the bindings.
+ *
+ * Programs with jumps, whose operations depend on the values, are run
+ * on their own.
+ */
+typedef struct ca_batch {
+    /** The operations, each after its operands */
+    struct ca_batch_node *nodes;
+    /** Number of operations */
+    size_t count;
+    /** Number of allocated operations */
+    size_t capacity;
+    /** Hash table of the indexes of the operations plus one, by
+     * operation and operands */
+    size_t *table;
+    /** Size of the hash table, a power of 2 */
+    size_t table_capacity;
+    /** The programs seen by the batch */
+    struct ca_batch_program *programs;
+    /** Number of programs */
+    size_t program_count;
+    /** Number of allocated programs */
+    size_t program_capacity;
+    /** Hash table of the indexes of the programs plus one, by address */
+    size_t *program_table;
+    /** Size of the hash table of the programs, a power of 2 */
+    size_t program_table_capacity;
+    /** The operations on the stack of the program being added */
+    size_t *stack;
+    /** Number of allocated stack entries */
+    size_t stack_capacity;
+    /** Incremented for each binding, the operations computed for the
+     * current one having the same epoch */
+    size_t epoch;
+    /** The epoch of the first binding of the current evaluation, from
+     * which the operations on constants only are reused */
+    size_t eval_epoch;
+    /** Context computing the operations and running the programs with
+     * jumps */
+    ca_calc_t scratch;
+    /** The work done since the batch was initialized or reset */
+    ca_batch_stats_t stats;
+    /** Allocator of the batch */
+    const ca_allocator_t *allocator;
+} ca_batch_t;
+
+/**
+ * Initialize an empty batch.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_batch_initialize(ca_batch_t *batch) __attribute__ ((nonnull(1)));
+
+/**
+ * Cleanup a batch.
+ */
+void ca_batch_cleanup(ca_batch_t *batch) __attribute__ ((nonnull(1)));
+
+/**
+ * Forget the programs of a batch and its statistics, keeping its
+ * memory for the next programs.
+ */
+void ca_batch_reset(ca_batch_t *batch) __attribute__ ((nonnull(1)));
+
+/**
+ * Evaluate jobs like ca_eval, sharing the operations they apply to
+ * the same values.
+ *
+ * The batch keeps the graph of the operations of each program the
+ * first time it evaluates it, so the programs must not be modified or
+ * cleaned up before the batch is reset or cleaned up. The jobs with
+ * the same values in their variable slots are evaluated together.
+ *
+ * @param batch the batch
+ * @param progs the program of each job
+ * @param vars the values of the variable slots of each job,
+ * progs[i]->variable_count values for job i
+ * @param count the number of jobs
+ * @param results where to store the count results
+ * @param status if not NULL, where to store 0 for each job which
+ * succeeded, -1 for the others
+ * @return 0 if every evaluation succeeded, -1 otherwise.
+ */
+int ca_batch_eval(ca_batch_t *batch, const ca_program_t *const *progs, const ca_value_t *const *vars,
+                  size_t count, ca_value_t *results, int *status) __attribute__ ((nonnull(1, 2, 3, 5)));
+
+#endif /* _LIBCALC_BATCH_H_ */
@@ -0,0 +1,580 @@
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_cells.h"
+
+/**
+ * Initial size of the hash table of the names.
+ */
+#define CA_SHEET_NAMES 64
+
+/**
+ * The state of an update shared by the threads.
+ */
+typedef struct ca_sheet_run {
+    ca_sheet_t *sheet;
+    /** The queued cells, grouped by level */
+    size_t *queue;
+    /** Index in queue of the cells of each level */
+    size_t *offsets;
+    /** Number of queued cells of each level */
+    size_t *fills;
+    /** Number of cells of each level taken by a thread */
+    size_t *taken;
+    /** Number of levels to recompute */
+    unsigned levels;
+    /** Number of recomputed formulas */
+    size_t recomputed;
+    /** Number of threads */
+    unsigned threads;
+    /** Waited on by the threads after each level */
+    pthread_barrier_t *barrier;
+} ca_sheet_run_t;
+
+/**
+ * Threads kept by a sheet, woken for each update.
+ */
+struct ca_sheet_pool {
+    pthread_mutex_t lock;
+    /** Signaled when an update starts or the threads should stop */
+    pthread_cond_t wake;
+    /** Incremented for each update */
+    unsigned long generation;
+    /** The update run by the threads */
+    ca_sheet_run_t *run;
+    /** Set to stop the threads */
+    int stopping;
+    /** Number of threads asked for, including the updating one */
+    unsigned threads;
+    /** Number of started threads */
+    unsigned started;
+    /** Waited on by the started threads and the updating one */
+    pthread_barrier_t barrier;
+    pthread_t workers[];
+};
+
+static void ca_sheet_pool_stop(ca_sheet_t *sheet);
+
+static size_t ca_hash(const char *name)
+{
+    size_t hash = 14695981039346656037UL;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char) *name) * 1099511628211UL;
+    return hash;
+}
+
+/**
+ * Return the slot of a name in the hash table, which holds 0 if the
+ * name is not there.
+ */
+static size_t *ca_sheet_slot(const ca_sheet_t *sheet, const char *name)
+{
+    size_t mask = sheet->name_capacity - 1;
+    for (size_t i = ca_hash(name) & mask;; i = (i + 1) & mask) {
+        size_t *slot = sheet->names + i;
+        if (*slot == 0 || strcmp(sheet->cells[*slot - 1].name, name) == 0)
+            return slot;
+    }
+}
+
+/**
+ * Grow the hash table when it is half full.
+ */
+static int ca_sheet_grow_names(ca_sheet_t *sheet)
+{
+    if (2 * (sheet->count + 1) <= sheet->name_capacity)
+        return 0;
+
+    size_t *old = sheet->names, old_capacity = sheet->name_capacity;
+    size_t capacity = 2 * old_capacity;
+
+    sheet->names = ca_alloc(sheet->allocator, capacity * sizeof(size_t));
+    if (sheet->names == NULL) {
+        tr("unable to grow names: %m");
+        sheet->names = old;
+        return -1;
+    }
+    memset(sheet->names, 0, capacity * sizeof(size_t));
+    sheet->name_capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old[i])
+            *ca_sheet_slot(sheet, sheet->cells[old[i] - 1].name) = old[i];
+    ca_free(sheet->allocator, old, old_capacity * sizeof(size_t));
+    return 0;
+}
+
+/**
+ * Grow an array of size_t holding count elements to hold one more.
+ */
+static int ca_sheet_grow(const ca_allocator_t *allocator, size_t **array, size_t count, size_t *capacity)
+{
+    if (count < *capacity)
+        return 0;
+
+    size_t grown = *capacity ? 2 * *capacity : 16;
+    size_t *resized = ca_realloc(allocator, *array, *capacity * sizeof(size_t), grown * sizeof(size_t));
+    if (resized == NULL) {
+        tr("unable to grow sheet: %m");
+        return -1;
+    }
+    *array = resized;
+    *capacity = grown;
+    return 0;
+}
+
+int ca_sheet_initialize(ca_sheet_t *sheet)
+{
+    assert(sheet);
+
+    memset(sheet, 0, sizeof(*sheet));
+    sheet->allocator = ca_get_allocator();
+    sheet->names = ca_alloc(sheet->allocator, CA_SHEET_NAMES * sizeof(size_t));
+    if (sheet->names == NULL) {
+        tr("unable to create sheet: %m");
+        return -1;
+    }
+    memset(sheet->names, 0, CA_SHEET_NAMES * sizeof(size_t));
+    sheet->name_capacity = CA_SHEET_NAMES;
+    return 0;
+}
+
+void ca_sheet_cleanup(ca_sheet_t *sheet)
+{
+    assert(sheet);
+
+    ca_sheet_pool_stop(sheet);
+
+    for (size_t i = 0; i < sheet->count; i++) {
+        ca_cell_t *cell = sheet->cells + i;
+        if (cell->prog) {
+            size_t count = cell->prog->variable_count;
+            ca_free(sheet->allocator, cell->refs, (count ? count : 1) * sizeof(size_t));
+            ca_program_cleanup(cell->prog);
+            ca_free(sheet->allocator, cell->prog, sizeof(ca_program_t));
+        }
+        ca_free(sheet->allocator, cell->dependents, cell->dependent_capacity * sizeof(size_t));
+        ca_free(sheet->allocator, cell->name, strlen(cell->name) + 1);
+    }
+    ca_free(sheet->allocator, sheet->cells, sheet->capacity * sizeof(ca_cell_t));
+    ca_free(sheet->allocator, sheet->names, sheet->name_capacity * sizeof(size_t));
+    ca_free(sheet->allocator, sheet->level_sizes, sheet->level_count * sizeof(size_t));
+    ca_free(sheet->allocator, sheet->pending, sheet->pending_capacity * sizeof(size_t));
+    memset(sheet, 0, sizeof(*sheet));
+}
+
+/**
+ * Reserve room for a new cell and its name.
+ *
+ * @return the new cell, not counted yet, NULL on failure.
+ */
+static ca_cell_t *ca_sheet_reserve(ca_sheet_t *sheet, const char *name)
+{
+    if (*ca_sheet_slot(sheet, name)) {
+        tr("cell %s already exists", name);
+        return NULL;
+    }
+
+    /* every cell may be pending */
+    if (ca_sheet_grow_names(sheet) ||
+        ca_sheet_grow(sheet->allocator, &sheet->pending, sheet->count, &sheet->pending_capacity))
+        return NULL;
+
+    if (sheet->count == sheet->capacity) {
+        size_t capacity = sheet->capacity ? 2 * sheet->capacity : 16;
+        ca_cell_t *cells = ca_realloc(sheet->allocator, sheet->cells, sheet->capacity * sizeof(ca_cell_t),
+                                      capacity * sizeof(ca_cell_t));
+        if (cells == NULL) {
+            tr("unable to grow cells: %m");
+            return NULL;
+        }
+        sheet->cells = cells;
+        sheet->capacity = capacity;
+    }
+
+    ca_cell_t *cell = sheet->cells + sheet->count;
+    memset(cell, 0, sizeof(*cell));
+    cell->name = ca_alloc(sheet->allocator, strlen(name) + 1);
+    if (cell->name == NULL) {
+        tr("unable to copy cell name: %m");
+        return NULL;
+    }
+    strcpy(cell->name, name);
+    return cell;
+}
+
+/**
+ * Count a reserved cell in the sheet and its level.
+ */
+static long ca_sheet_add(ca_sheet_t *sheet, ca_cell_t *cell)
+{
+    if (cell->level >= sheet->level_count) {
+        size_t *sizes = ca_realloc(sheet->allocator, sheet->level_sizes, sheet->level_count * sizeof(size_t),
+                                   (cell->level + 1) * sizeof(size_t));
+        if (sizes == NULL) {
+            tr("unable to grow levels: %m");
+            return -1;
+        }
+        memset(sizes + sheet->level_count, 0, (cell->level + 1 - sheet->level_count) * sizeof(size_t));
+        sheet->level_sizes = sizes;
+        sheet->level_count = cell->level + 1;
+    }
+    sheet->level_sizes[cell->level] += 1;
+
+    size_t index = sheet->count++;
+    *ca_sheet_slot(sheet, cell->name) = index + 1;
+    return index;
+}
+
+long ca_sheet_input(ca_sheet_t *sheet, const char *name, ca_value_t value)
+{
+    assert(sheet);
+    assert(name);
+
+    ca_cell_t *cell = ca_sheet_reserve(sheet, name);
+    if (cell == NULL)
+        return -1;
+
+    cell->value = value;
+    long index = ca_sheet_add(sheet, cell);
+    if (index < 0)
+        ca_free(sheet->allocator, cell->name, strlen(name) + 1);
+    return index;
+}
+
+long ca_sheet_formula(ca_sheet_t *sheet, const char *name, const char *source, ca_syntax_t syntax)
+{
+    assert(sheet);
+    assert(name);
+    assert(source);
+
+    ca_cell_t *cell = ca_sheet_reserve(sheet, name);
+    if (cell == NULL)
+        return -1;
+
+    cell->prog = ca_alloc(sheet->allocator, sizeof(ca_program_t));
+    if (cell->prog == NULL) {
+        tr("unable to create formula: %m");
+        goto error_name;
+    }
+    if (ca_compile_allocator(cell->prog, source, syntax, sheet->allocator))
+        goto error_alloc;
+
+    size_t count = cell->prog->variable_count;
+    cell->refs = ca_alloc(sheet->allocator, (count ? count : 1) * sizeof(size_t));
+    if (cell->refs == NULL) {
+        tr("unable to create cell references: %m");
+        goto error_prog;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        long ref = ca_sheet_cell(sheet, cell->prog->variables[i]);
+        if (ref < 0) {
+            tr("unknown cell %s", cell->prog->variables[i]);
+            goto error_refs;
+        }
+        ca_cell_t *used = sheet->cells + ref;
+        if (ca_sheet_grow(sheet->allocator, &used->dependents, used->dependent_count, &used->dependent_capacity))
+            goto error_refs;
+        cell->refs[i] = ref;
+        if (used->level >= cell->level)
+            cell->level = used->level + 1;
+    }
+    if (cell->level == 0)
+        cell->level = 1;
+
+    long index = ca_sheet_add(sheet, cell);
+    if (index < 0)
+        goto error_refs;
+
+    /* room was reserved by ca_sheet_grow */
+    for (size_t i = 0; i < count; i++) {
+        ca_cell_t *used = sheet->cells + cell->refs[i];
+        used->dependents[used->dependent_count++] = index;
+    }
+    sheet->pending[sheet->pending_count++] = index;
+    return index;
+
+error_refs:
+    ca_free(sheet->allocator, cell->refs, (count ? count : 1) * sizeof(size_t));
+error_prog:
+    ca_program_cleanup(cell->prog);
+error_alloc:
+    ca_free(sheet->allocator, cell->prog, sizeof(ca_program_t));
+error_name:
+    ca_free(sheet->allocator, cell->name, strlen(name) + 1);
+    return -1;
+}
+
+long ca_sheet_cell(const ca_sheet_t *sheet, const char *name)
+{
+    assert(sheet);
+    assert(name);
+    return (long) *ca_sheet_slot(sheet, name) - 1;
+}
+
+void ca_sheet_set(ca_sheet_t *sheet, size_t cell, ca_value_t value)
+{
+    assert(sheet);
+    assert(cell < sheet->count);
+    assert(sheet->cells[cell].prog == NULL);
+
+    ca_cell_t *input = sheet->cells + cell;
+    if (input->value == value)
+        return;
+    input->value = value;
+
+    /* room for every cell is reserved */
+    if (!input->queued) {
+        input->queued = 1;
+        sheet->pending[sheet->pending_count++] = cell;
+    }
+}
+
+int ca_sheet_value(const ca_sheet_t *sheet, size_t cell, ca_value_t *value)
+{
+    assert(sheet);
+    assert(cell < sheet->count);
+    assert(value);
+
+    *value = sheet->cells[cell].value;
+    return sheet->cells[cell].status;
+}
+
+/**
+ * Queue a formula to be recomputed, unless it already is.
+ */
+static void ca_sheet_queue(ca_sheet_run_t *run, size_t index)
+{
+    ca_cell_t *cell = run->sheet->cells + index;
+    if (__atomic_exchange_n(&cell->queued, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    size_t slot = __atomic_fetch_add(run->fills + cell->level, 1, __ATOMIC_RELAXED);
+    run->queue[run->offsets[cell->level] + slot] = index;
+}
+
+static void ca_sheet_queue_dependents(ca_sheet_run_t *run, const ca_cell_t *cell)
+{
+    for (size_t i = 0; i < cell->dependent_count; i++)
+        ca_sheet_queue(run, cell->dependents[i]);
+}
+
+/**
+ * Recompute a formula.
+ *
+ * @return whether its value or status changed.
+ */
+static int ca_sheet_evaluate(ca_sheet_t *sheet, ca_cell_t *cell)
+{
+    size_t count = cell->prog->variable_count;
+    ca_value_t vars[count ? count : 1], value = 0;
+    int status = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const ca_cell_t *used = sheet->cells + cell->refs[i];
+        if (used->status)
+            status = -1;
+        vars[i] = used->value;
+    }
+    if (status == 0)
+        status = ca_eval(cell->prog, vars, count, &value);
+
+    int changed = status != cell->status || (status == 0 && value != cell->value);
+    cell->status = status;
+    if (status == 0)
+        cell->value = value;
+    return changed;
+}
+
+/**
+ * Recompute the queued formulas level by level, on each thread.
+ */
+static void ca_sheet_work(ca_sheet_run_t *run)
+{
+    ca_sheet_t *sheet = run->sheet;
+
+    for (unsigned level = 1; level < run->levels; level++) {
+        size_t i, recomputed = 0;
+
+        /* the formulas of the previous levels are done, no more formula
+         * of this level gets queued */
+        while ((i = __atomic_fetch_add(run->taken + level, 1, __ATOMIC_RELAXED)) < run->fills[level]) {
+            size_t index = run->queue[run->offsets[level] + i];
+            ca_cell_t *cell = sheet->cells + index;
+
+            cell->queued = 0;
+            recomputed += 1;
+            if (ca_sheet_evaluate(sheet, cell))
+                ca_sheet_queue_dependents(run, cell);
+        }
+        __atomic_fetch_add(&run->recomputed, recomputed, __ATOMIC_RELAXED);
+
+        if (run->threads > 1)
+            pthread_barrier_wait(run->barrier);
+    }
+}
+
+/**
+ * Run the updates of a sheet until the pool is stopped.
+ */
+static void *ca_sheet_pool_work(void *arg)
+{
+    struct ca_sheet_pool *pool = arg;
+    unsigned long generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == generation && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        generation = pool->generation;
+        ca_sheet_run_t *run = pool->run;
+        pthread_mutex_unlock(&pool->lock);
+
+        ca_sheet_work(run);
+        /* the update returns once no thread uses the run anymore */
+        pthread_barrier_wait(&pool->barrier);
+    }
+}
+
+static size_t ca_sheet_pool_size(unsigned threads)
+{
+    return sizeof(struct ca_sheet_pool) + (threads - 1) * sizeof(pthread_t);
+}
+
+static void ca_sheet_pool_stop(ca_sheet_t *sheet)
+{
+    struct ca_sheet_pool *pool = sheet->pool;
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < pool->started; i++)
+        pthread_join(pool->workers[i], NULL);
+
+    pthread_barrier_destroy(&pool->barrier);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    ca_free(sheet->allocator, pool, ca_sheet_pool_size(pool->threads));
+    sheet->pool = NULL;
+}
+
+/**
+ * Start threads - 1 threads for the updates of a sheet.
+ *
+ * @return 0 on success, -1 if no thread could be started.
+ */
+static int ca_sheet_pool_start(ca_sheet_t *sheet, unsigned threads)
+{
+    struct ca_sheet_pool *pool = ca_alloc(sheet->allocator, ca_sheet_pool_size(threads));
+    if (pool == NULL) {
+        tr("unable to create update threads: %m");
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pool->generation = 0;
+    pool->run = NULL;
+    pool->stopping = 0;
+    pool->threads = threads;
+    pool->started = 0;
+    while (pool->started + 1 < threads) {
+        int error = pthread_create(pool->workers + pool->started, NULL, ca_sheet_pool_work, pool);
+        if (error) {
+            tr("unable to start update thread: %s", strerror(error));
+            break;
+        }
+        pool->started += 1;
+    }
+
+    /* the started threads wait for an update before using the barrier */
+    pthread_barrier_init(&pool->barrier, NULL, pool->started + 1);
+    sheet->pool = pool;
+    if (pool->started == 0) {
+        ca_sheet_pool_stop(sheet);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Recompute the queued formulas with the calling thread and up to
+ * threads - 1 threads of the pool of the sheet.
+ */
+static void ca_sheet_start(ca_sheet_t *sheet, ca_sheet_run_t *run, unsigned threads)
+{
+    if (threads > 1 && sheet->pool && sheet->pool->threads != threads)
+        ca_sheet_pool_stop(sheet);
+    if (threads == 1 || (sheet->pool == NULL && ca_sheet_pool_start(sheet, threads))) {
+        run->threads = 1;
+        ca_sheet_work(run);
+        return;
+    }
+
+    struct ca_sheet_pool *pool = sheet->pool;
+    run->threads = pool->started + 1;
+    run->barrier = &pool->barrier;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->run = run;
+    pool->generation += 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    ca_sheet_work(run);
+    pthread_barrier_wait(&pool->barrier);
+}
+
+long ca_sheet_update(ca_sheet_t *sheet, unsigned threads)
+{
+    assert(sheet);
+    assert(threads);
+
+    if (sheet->pending_count == 0)
+        return 0;
+
+    ca_sheet_run_t run = { .sheet = sheet, .levels = sheet->level_count };
+    size_t levels = sheet->level_count;
+    long retval = -1;
+
+    run.queue = ca_alloc(sheet->allocator, sheet->count * sizeof(size_t));
+    run.offsets = ca_alloc(sheet->allocator, 3 * levels * sizeof(size_t));
+    if (run.queue == NULL || run.offsets == NULL) {
+        tr("unable to update sheet: %m");
+        goto out;
+    }
+    run.fills = run.offsets + levels;
+    run.taken = run.fills + levels;
+    memset(run.fills, 0, 2 * levels * sizeof(size_t));
+    for (size_t l = 0, offset = 0; l < levels; offset += sheet->level_sizes[l++])
+        run.offsets[l] = offset;
+
+    for (size_t i = 0; i < sheet->pending_count; i++) {
+        ca_cell_t *cell = sheet->cells + sheet->pending[i];
+        if (cell->prog) {
+            ca_sheet_queue(&run, sheet->pending[i]);
+        } else {
+            cell->queued = 0;
+            ca_sheet_queue_dependents(&run, cell);
+        }
+    }
+    sheet->pending_count = 0;
+
+    ca_sheet_start(sheet, &run, threads);
+    retval = run.recomputed;
+
+out:
+    ca_free(sheet->allocator, run.offsets, 3 * levels * sizeof(size_t));
+    ca_free(sheet->allocator, run.queue, sheet->count * sizeof(size_t));
+    return retval;
+}
@@ -0,0 +1,143 @@
+#ifndef _LIBCALC_CELLS_H_
+#define _LIBCALC_CELLS_H_
+
+#include "libcalc.h"
+#include "libcalc_program.h"
+
+/**
+ * A value of a sheet, either an input or computed by a formula over
+ * other cells.
+ */
+typedef struct ca_cell {
+    /** The name of the cell */
+    char *name;
+    /** The value */
+    ca_value_t value;
+    /** 0 if the value is valid, -1 if the formula or a cell it uses failed */
+    int status;
+    /** The formula, NULL for inputs, not held in the cell since the
+     * cells move as they are added */
+    ca_program_t *prog;
+    /** The cells bound to the variable slots of the formula */
+    size_t *refs;
+    /** The formulas using the cell */
+    size_t *dependents;
+    /** Number of formulas using the cell */
+    size_t dependent_count;
+    /** Number of allocated dependents */
+    size_t dependent_capacity;
+    /** 0 for inputs, then one more than the highest level of the refs */
+    unsigned level;
+    /** Set while the cell waits to be recomputed */
+    int queued;
+} ca_cell_t;
+
+/**
+ * The threads recomputing the formulas of a sheet.
+ */
+struct ca_sheet_pool;
+
+/**
+ * A graph of cells.
+ *
+ * A formula may only use cells created before it, so the graph has no
+ * cycle. Changing inputs only marks them, ca_sheet_update then
+ * recomputes the formulas depending on them level by level, the
+ * formulas of a level being independent of each other.
+ */
+typedef struct ca_sheet {
+    /** The cells, in order of creation */
+    ca_cell_t *cells;
+    /** Number of cells */
+    size_t count;
+    /** Number of allocated cells */
+    size_t capacity;
+    /** Hash table of the indexes of the cells plus one, by name */
+    size_t *names;
+    /** Size of the hash table, a power of 2 */
+    size_t name_capacity;
+    /** Number of cells of each level */
+    size_t *level_sizes;
+    /** Number of levels */
+    unsigned level_count;
+    /** Changed inputs and new formulas */
+    size_t *pending;
+    /** Number of pending cells */
+    size_t pending_count;
+    /** Number of allocated pending cells */
+    size_t pending_capacity;
+    /** Allocator of the sheet */
+    const ca_allocator_t *allocator;
+    /** Threads kept between updates, NULL until an update uses several */
+    struct ca_sheet_pool *pool;
+} ca_sheet_t;
+
+/**
+ * Initialize an empty sheet.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_sheet_initialize(ca_sheet_t *sheet) __attribute__ ((nonnull(1)));
+
+/**
+ * Cleanup a sheet.
+ */
+void ca_sheet_cleanup(ca_sheet_t *sheet) __attribute__ ((nonnull(1)));
+
+/**
+ * Add an input cell.
+ *
+ * @return the index of the cell, -1 on failure.
+ */
+long ca_sheet_input(ca_sheet_t *sheet, const char *name, ca_value_t value) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Add a formula cell.
+ *
+ * The variables of the formula are the names of existing cells. The
+ * value is computed by the next ca_sheet_update.
+ *
+ * @return the index of the cell, -1 on failure.
+ */
+long ca_sheet_formula(ca_sheet_t *sheet, const char *name, const char *source,
+                      ca_syntax_t syntax) __attribute__ ((nonnull(1, 2, 3)));
+
+/**
+ * Return the index of a cell.
+ *
+ * @return the index of the cell, -1 if there is none with this name.
+ */
+long ca_sheet_cell(const ca_sheet_t *sheet, const char *name) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Change the value of an input cell.
+ *
+ * The formulas using it are recomputed by the next ca_sheet_update.
+ */
+void ca_sheet_set(ca_sheet_t *sheet, size_t cell, ca_value_t value) __attribute__ ((nonnull(1)));
+
+/**
+ * Recompute the formulas depending on the changed inputs.
+ *
+ * Each formula is recomputed at most once, after the cells it uses,
+ * and only if one of them changed. The formulas of a level are split
+ * between threads. The threads are started by the first update using
+ * them and kept by the sheet, waiting for the next update, until it is
+ * cleaned up or updated with another number of threads.
+ *
+ * @param threads the number of threads recomputing the formulas,
+ * including the calling one
+ * @return the number of recomputed formulas, -1 on failure.
+ */
+long ca_sheet_update(ca_sheet_t *sheet, unsigned threads) __attribute__ ((nonnull(1)));
+
+/**
+ * Return the value of a cell.
+ *
+ * @param value where to store the value
+ * @return 0 on success, -1 if the formula of the cell or of a cell it
+ * uses failed.
+ */
+int ca_sheet_value(const ca_sheet_t *sheet, size_t cell, ca_value_t *value) __attribute__ ((nonnull(1, 3)));
+
+#endif /* _LIBCALC_CELLS_H_ */
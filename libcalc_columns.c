@@ -0,0 +1,248 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_program.h"
+#include "libcalc_columns.h"
+
+/**
+ * An evaluation of columns, shared by its threads.
+ */
+typedef struct ca_columns_run {
+    const ca_program_t *prog;
+    const int *inputs;
+    int output;
+    ca_value_t fill;
+    /** Whether the program has jumps, and is run row by row */
+    bool jumps;
+    /** Number of rows */
+    size_t rows;
+    /** Number of stripes of rows */
+    size_t stripes;
+    /** The next stripe to evaluate */
+    size_t next;
+    /** Number of rows whose evaluation failed */
+    size_t failed;
+    /** -1 once a thread failed, the others stopping */
+    int status;
+} ca_columns_run_t;
+
+/**
+ * The buffers of a thread evaluating columns.
+ */
+typedef struct ca_columns_worker {
+    /** The stripes of the input columns, one after the other */
+    ca_value_t *columns;
+    /** The stripe of the results */
+    ca_value_t *results;
+    /** The values on the stack for a block, see ca_eval_block */
+    ca_value_t *stack;
+    /** The failure flag of each row of a block */
+    unsigned char failed[CA_EVAL_BLOCK];
+    /** Context running the programs with jumps */
+    ca_calc_t calc;
+} ca_columns_worker_t;
+
+/**
+ * Read or write a whole range of a file.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+static int ca_columns_transfer(int fd, void *buffer, size_t length, off_t offset, bool write)
+{
+    while (length) {
+        ssize_t done = write ? pwrite(fd, buffer, length, offset) : pread(fd, buffer, length, offset);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0) {
+            tr("unable to %s column: %s", write ? "write" : "read", done ? strerror(errno) : "file is truncated");
+            return -1;
+        }
+        buffer = (char *) buffer + done;
+        length -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+/**
+ * Run a program with jumps on each row of a stripe.
+ *
+ * @return the number of rows whose evaluation failed.
+ */
+static size_t ca_columns_rows(const ca_columns_run_t *run, ca_columns_worker_t *worker, size_t count)
+{
+    const ca_program_t *prog = run->prog;
+    ca_value_t vars[prog->variable_count];
+    size_t failed = 0;
+
+    for (size_t row = 0; row < count; row++) {
+        for (size_t v = 0; v < prog->variable_count; v++)
+            vars[v] = worker->columns[v * CA_COLUMNS_STRIPE + row];
+
+        worker->calc.top = 0;
+        if (ca_run(&worker->calc, prog, vars)) {
+            worker->results[row] = run->fill;
+            failed += 1;
+        } else {
+            worker->results[row] = ca_pop(&worker->calc);
+        }
+    }
+    return failed;
+}
+
+/**
+ * Evaluate the next stripes of rows until there are none left.
+ */
+static void *ca_columns_work(void *arg)
+{
+    ca_columns_run_t *run = arg;
+    const ca_program_t *prog = run->prog;
+    size_t columns = prog->variable_count + 1, depth = run->jumps ? 0 : prog->depth;
+    size_t length = (columns * CA_COLUMNS_STRIPE + depth * CA_EVAL_BLOCK) * sizeof(ca_value_t);
+    size_t stripe, failed = 0;
+    ca_columns_worker_t worker;
+
+    /* each thread touches its own buffers first, on its numa node */
+    worker.columns = ca_alloc(prog->allocator, length);
+    if (worker.columns == NULL || (run->jumps && ca_initialize(&worker.calc, prog->depth))) {
+        tr("unable to allocate column buffers");
+        ca_free(prog->allocator, worker.columns, length);
+        __atomic_store_n(&run->status, -1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    worker.results = worker.columns + prog->variable_count * CA_COLUMNS_STRIPE;
+    worker.stack = worker.results + CA_COLUMNS_STRIPE;
+
+    while ((stripe = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->stripes &&
+           __atomic_load_n(&run->status, __ATOMIC_RELAXED) == 0) {
+        size_t first = stripe * CA_COLUMNS_STRIPE;
+        size_t count = run->rows - first < CA_COLUMNS_STRIPE ? run->rows - first : CA_COLUMNS_STRIPE;
+        off_t offset = first * sizeof(ca_value_t);
+        int status = 0;
+
+        for (size_t v = 0; v < prog->variable_count && status == 0; v++)
+            status = ca_columns_transfer(run->inputs[v], worker.columns + v * CA_COLUMNS_STRIPE,
+                                         count * sizeof(ca_value_t), offset, false);
+        if (status) {
+            __atomic_store_n(&run->status, -1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        if (run->jumps) {
+            failed += ca_columns_rows(run, &worker, count);
+        } else {
+            for (size_t block = 0; block < count; block += CA_EVAL_BLOCK) {
+                size_t n = count - block < CA_EVAL_BLOCK ? count - block : CA_EVAL_BLOCK;
+                if (ca_eval_block(prog, worker.columns + block, CA_COLUMNS_STRIPE, 1, n, worker.stack,
+                                  worker.failed, worker.results + block) == 0)
+                    continue;
+                for (size_t i = 0; i < n; i++) {
+                    if (worker.failed[i])
+                        worker.results[block + i] = run->fill;
+                    failed += worker.failed[i];
+                }
+            }
+        }
+
+        if (ca_columns_transfer(run->output, worker.results, count * sizeof(ca_value_t), offset, true)) {
+            __atomic_store_n(&run->status, -1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    __atomic_fetch_add(&run->failed, failed, __ATOMIC_RELAXED);
+    if (run->jumps)
+        ca_cleanup(&worker.calc);
+    ca_free(prog->allocator, worker.columns, length);
+    return NULL;
+}
+
+/**
+ * Return the number of rows of the input columns, -1 if they cannot be
+ * evaluated together.
+ */
+static ssize_t ca_columns_rows_count(const ca_program_t *prog, const int *inputs)
+{
+    off_t size = -1;
+
+    if (prog->variable_count == 0) {
+        tr("program should have variables to take from columns");
+        return -1;
+    }
+
+    for (size_t v = 0; v < prog->variable_count; v++) {
+        struct stat st;
+        if (fstat(inputs[v], &st) < 0) {
+            tr("unable to stat column: %m");
+            return -1;
+        }
+        if (st.st_size % sizeof(ca_value_t) || (size >= 0 && st.st_size != size)) {
+            tr("columns should hold the same number of values");
+            return -1;
+        }
+        size = st.st_size;
+
+        /* the stripes are read in order */
+        posix_fadvise(inputs[v], 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return size / sizeof(ca_value_t);
+}
+
+int ca_columns_eval(const ca_program_t *prog, const int *inputs, int output, ca_value_t fill, unsigned threads,
+                    ca_columns_stats_t *stats)
+{
+    assert(prog);
+    assert(inputs);
+    assert(threads);
+
+    ssize_t rows = ca_columns_rows_count(prog, inputs);
+    if (rows < 0)
+        return -1;
+    if (ftruncate(output, rows * sizeof(ca_value_t)) < 0) {
+        tr("unable to size result column: %m");
+        return -1;
+    }
+
+    ca_columns_run_t run = {
+        .prog = prog,
+        .inputs = inputs,
+        .output = output,
+        .fill = fill,
+        .rows = rows,
+        .stripes = (rows + CA_COLUMNS_STRIPE - 1) / CA_COLUMNS_STRIPE,
+    };
+    run.jumps = ca_program_has_jumps(prog);
+
+    /* no more threads than stripes */
+    if (threads > run.stripes)
+        threads = run.stripes ? run.stripes : 1;
+
+    pthread_t workers[threads];
+    unsigned started = 0;
+    while (started + 1 < threads) {
+        int error = pthread_create(workers + started, NULL, ca_columns_work, &run);
+        if (error) {
+            tr("unable to start column thread: %s", strerror(error));
+            break;
+        }
+        started += 1;
+    }
+
+    ca_columns_work(&run);
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    if (stats) {
+        stats->rows = rows;
+        stats->failed = run.failed;
+        stats->threads = started + 1;
+    }
+    return run.status;
+}
@@ -0,0 +1,51 @@
+#ifndef _LIBCALC_COLUMNS_H_
+#define _LIBCALC_COLUMNS_H_
+
+#include "libcalc.h"
+#include "libcalc_program.h"
+
+/**
+ * Number of rows read, evaluated and written at once by a thread.
+ */
+#define CA_COLUMNS_STRIPE (1UL << 16)
+
+/**
+ * What an evaluation of columns did.
+ */
+typedef struct ca_columns_stats {
+    /** Number of rows evaluated */
+    size_t rows;
+    /** Number of rows whose evaluation failed */
+    size_t failed;
+    /** Number of threads which evaluated the rows */
+    unsigned threads;
+} ca_columns_stats_t;
+
+/**
+ * Evaluate a program on each row of column files, writing the column
+ * of the results.
+ *
+ * A column file is an array of ca_value_t in the byte order of the
+ * machine, row i of the evaluation taking value i of each input
+ * column. The files are read and written with large sequential reads
+ * and writes of CA_COLUMNS_STRIPE rows, each thread taking the next
+ * stripe in turn, so the memory used is bounded whatever the size of
+ * the files. A stripe is evaluated by blocks of CA_EVAL_BLOCK rows with
+ * ca_eval_block. Programs with jumps, whose instructions depend on the
+ * values, are run row by row.
+ *
+ * @param prog the program, which is only read
+ * @param inputs the file descriptors of the columns of the variable
+ * slots, prog->variable_count of them, all of the same size
+ * @param output the file descriptor of the result column, truncated to
+ * the number of rows
+ * @param fill the result stored for the rows whose evaluation fails
+ * @param threads the number of threads evaluating the rows, at least 1
+ * @param stats if not NULL, where to store what the evaluation did
+ * @return 0 on success, even if some rows failed, -1 if the columns
+ * could not be read or written.
+ */
+int ca_columns_eval(const ca_program_t *prog, const int *inputs, int output, ca_value_t fill, unsigned threads,
+                    ca_columns_stats_t *stats) __attribute__ ((nonnull(1, 2)));
+
+#endif /* _LIBCALC_COLUMNS_H_ */
@@ -0,0 +1,86 @@
+#include <assert.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_divide.h"
+
+int ca_divider_init(ca_divider_t *divider, ca_value_t divisor)
+{
+    assert(divider);
+
+    if (divisor == 0) {
+        tr("cannot divide by 0");
+        return -1;
+    }
+
+    divider->divisor = divisor;
+    divider->magic = 0;
+    divider->shift = 0;
+    if (divisor == 1 || divisor == -1)
+        return 0;
+
+    /* compute the magic number as described in Hacker's Delight,
+     * chapter 10 "Integer division by constants" */
+    const unsigned long two63 = 1UL << 63;
+    unsigned long ad = divisor < 0 ? 0UL - (unsigned long) divisor : (unsigned long) divisor;
+    unsigned long t = two63 + ((unsigned long) divisor >> 63);
+    unsigned long anc = t - 1 - t % ad;
+    unsigned long q1 = two63 / anc, r1 = two63 - q1 * anc;
+    unsigned long q2 = two63 / ad, r2 = two63 - q2 * ad;
+    unsigned long delta;
+    unsigned p = 63;
+
+    do {
+        p += 1;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1 += 1;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2 += 1;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    divider->magic = (ca_value_t) (q2 + 1);
+    if (divisor < 0)
+        divider->magic = (ca_value_t) (0UL - (q2 + 1));
+    divider->shift = p - 64;
+    return 0;
+}
+
+int ca_divide_array(const ca_divider_t *divider, const ca_value_t *in, ca_value_t *out, size_t count)
+{
+    assert(divider);
+    assert(in || count == 0);
+    assert(out || count == 0);
+
+    if (divider->divisor == -1) {
+        for (size_t i = 0; i < count; i++) {
+            if (in[i] == CA_VALUE_MIN) {
+                tr("division would overflow");
+                return -1;
+            }
+            out[i] = -in[i];
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        out[i] = ca_divider_divide(divider, in[i]);
+    return 0;
+}
+
+void ca_modulo_array(const ca_divider_t *divider, const ca_value_t *in, ca_value_t *out, size_t count)
+{
+    assert(divider);
+    assert(in || count == 0);
+    assert(out || count == 0);
+
+    for (size_t i = 0; i < count; i++)
+        out[i] = ca_divider_modulo(divider, in[i]);
+}
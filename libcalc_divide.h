@@ -0,0 +1,83 @@
+#ifndef _LIBCALC_DIVIDE_H_
+#define _LIBCALC_DIVIDE_H_
+
+#include "libcalc.h"
+
+/**
+ * Precomputed division by a constant divisor.
+ *
+ * The division is done by a multiplication by a magic number followed
+ * by a shift, giving the same results as the C / and % operators.
+ */
+typedef struct ca_divider {
+    /** The divisor */
+    ca_value_t divisor;
+    /** The magic multiplier, 0 when dividing by 1 or -1 */
+    ca_value_t magic;
+    /** The shift to apply to the high part of the product */
+    unsigned shift;
+} ca_divider_t;
+
+/**
+ * Precompute the division by a divisor.
+ *
+ * @param divider the divider to initialize
+ * @param divisor the divisor
+ * @return 0 on success, -1 if the divisor is 0.
+ */
+int ca_divider_init(ca_divider_t *divider, ca_value_t divisor) __attribute__ ((nonnull(1)));
+
+/**
+ * Divide a value.
+ *
+ * The user should make sure not to divide CA_VALUE_MIN by -1.
+ */
+__attribute__ ((nonnull(1)))
+static inline ca_value_t ca_divider_divide(const ca_divider_t *divider, ca_value_t x)
+{
+    if (divider->magic == 0)
+        return divider->divisor > 0 ? x : (ca_value_t) (0UL - (unsigned long) x);
+
+    ca_value_t q = (ca_value_t) (((__int128) divider->magic * x) >> 64);
+    if (divider->divisor > 0 && divider->magic < 0)
+        q += x;
+    else if (divider->divisor < 0 && divider->magic > 0)
+        q -= x;
+    q >>= divider->shift;
+    /* round towards 0 */
+    return q + (ca_value_t) ((unsigned long) q >> 63);
+}
+
+/**
+ * Calculate the modulo of a value.
+ */
+__attribute__ ((nonnull(1)))
+static inline ca_value_t ca_divider_modulo(const ca_divider_t *divider, ca_value_t x)
+{
+    if (divider->magic == 0)
+        return 0;
+    return x - ca_divider_divide(divider, x) * divider->divisor;
+}
+
+/**
+ * Divide an array of values.
+ *
+ * @param divider the divider
+ * @param in the values to divide
+ * @param out where to store the count quotients, may be in
+ * @param count the number of values
+ * @return 0 on success, -1 if a division would overflow.
+ */
+int ca_divide_array(const ca_divider_t *divider, const ca_value_t *in, ca_value_t *out, size_t count) __attribute__ ((nonnull(1)));
+
+/**
+ * Calculate the modulo of an array of values.
+ *
+ * @param divider the divider
+ * @param in the values
+ * @param out where to store the count remainders, may be in
+ * @param count the number of values
+ */
+void ca_modulo_array(const ca_divider_t *divider, const ca_value_t *in, ca_value_t *out, size_t count) __attribute__ ((nonnull(1)));
+
+#endif /* _LIBCALC_DIVIDE_H_ */
@@ -0,0 +1,260 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_format.h"
+
+/**
+ * The numbers from 00 to 99.
+ */
+static const char ca_digit_pairs[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+size_t ca_format_value(ca_value_t value, char *buffer)
+{
+    char digits[CA_VALUE_DIGITS];
+    char *end = digits + sizeof(digits), *p = end;
+    /* the magnitude of CA_VALUE_MIN only fits unsigned */
+    unsigned long n = value < 0 ? -(unsigned long) value : (unsigned long) value;
+
+    while (n >= 100) {
+        unsigned pair = n % 100;
+        n /= 100;
+        p -= 2;
+        memcpy(p, ca_digit_pairs + 2 * pair, 2);
+    }
+    if (n >= 10) {
+        p -= 2;
+        memcpy(p, ca_digit_pairs + 2 * n, 2);
+    } else {
+        *--p = '0' + n;
+    }
+    if (value < 0)
+        *--p = '-';
+
+    memcpy(buffer, p, end - p);
+    return end - p;
+}
+
+size_t ca_format_decimal(ca_value_t value, unsigned digits, char *buffer)
+{
+    char integer[CA_VALUE_DIGITS];
+    size_t length = ca_format_value(value, integer);
+    char *p = integer, *out = buffer;
+
+    assert(digits <= CA_DECIMAL_MAX_DIGITS);
+    if (digits == 0) {
+        memcpy(buffer, integer, length);
+        return length;
+    }
+
+    if (*p == '-') {
+        *out++ = '-';
+        p++;
+        length--;
+    }
+    /* at least a digit before the point */
+    if (length <= digits) {
+        *out++ = '0';
+        *out++ = '.';
+        memset(out, '0', digits - length);
+        out += digits - length;
+        memcpy(out, p, length);
+        return out + length - buffer;
+    }
+    memcpy(out, p, length - digits);
+    out += length - digits;
+    *out++ = '.';
+    memcpy(out, p + length - digits, digits);
+    return out + digits - buffer;
+}
+
+int ca_parse_decimal(const char *text, unsigned digits, ca_value_t *value, const char **end)
+{
+    const char *p = text;
+    int negative = 0, seen = 0;
+    unsigned fraction = 0;
+    __int128 n = 0;
+
+    assert(digits <= CA_DECIMAL_MAX_DIGITS);
+    if (*p == '-' || *p == '+')
+        negative = *p++ == '-';
+
+    for (; *p >= '0' && *p <= '9'; p++, seen = 1) {
+        n = n * 10 + (*p - '0');
+        if (n > (__int128) CA_VALUE_MAX + 1)
+            goto overflow;
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++, seen = 1) {
+            if (fraction < digits) {
+                n = n * 10 + (*p - '0');
+                fraction++;
+            } else if (fraction == digits) {
+                /* round on the first dropped digit */
+                n += *p >= '5';
+                fraction++;
+            }
+        }
+    }
+    if (!seen) {
+        tr("expected a decimal at '%s'", text);
+        return -1;
+    }
+    if (end)
+        *end = p;
+    else if (*p) {
+        tr("unexpected characters after decimal '%s'", text);
+        return -1;
+    }
+
+    for (; fraction < digits; fraction++) {
+        n *= 10;
+        if (n > (__int128) CA_VALUE_MAX + 1)
+            goto overflow;
+    }
+    if (negative)
+        n = -n;
+    if (n > CA_VALUE_MAX || n < CA_VALUE_MIN)
+        goto overflow;
+    *value = n;
+    return 0;
+
+overflow:
+    tr("decimal '%s' would overflow", text);
+    return -1;
+}
+
+int ca_writer_initialize(ca_writer_t *writer, int fd, char *buffer, size_t size)
+{
+    assert(writer);
+    assert(size > CA_VALUE_DIGITS);
+
+    writer->allocator = NULL;
+    if (buffer == NULL) {
+        writer->allocator = ca_get_allocator();
+        buffer = ca_alloc(writer->allocator, size);
+        if (buffer == NULL) {
+            tr("unable to create buffer: %m");
+            return -1;
+        }
+    }
+    writer->fd = fd;
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->used = 0;
+    return 0;
+}
+
+void ca_writer_cleanup(ca_writer_t *writer)
+{
+    assert(writer);
+    if (writer->allocator)
+        ca_free(writer->allocator, writer->buffer, writer->size);
+}
+
+/**
+ * Write all the bytes to the file descriptor.
+ */
+static int ca_write_all(int fd, const char *data, size_t length)
+{
+    if (fd < 0) {
+        tr("writer buffer is full");
+        return -1;
+    }
+
+    while (length) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            tr("unable to write: %m");
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+int ca_writer_flush(ca_writer_t *writer)
+{
+    assert(writer);
+    if (writer->used == 0)
+        return 0;
+    if (ca_write_all(writer->fd, writer->buffer, writer->used))
+        return -1;
+    writer->used = 0;
+    return 0;
+}
+
+int ca_writer_write(ca_writer_t *writer, const void *data, size_t length)
+{
+    assert(writer);
+
+    if (length > writer->size - writer->used) {
+        if (ca_writer_flush(writer))
+            return -1;
+        /* too large to be worth a copy */
+        if (length > writer->size)
+            return ca_write_all(writer->fd, data, length);
+    }
+    memcpy(writer->buffer + writer->used, data, length);
+    writer->used += length;
+    return 0;
+}
+
+int ca_writer_value(ca_writer_t *writer, ca_value_t value)
+{
+    assert(writer);
+    if (writer->size - writer->used < CA_VALUE_DIGITS && ca_writer_flush(writer))
+        return -1;
+    writer->used += ca_format_value(value, writer->buffer + writer->used);
+    return 0;
+}
+
+int ca_dump(ca_writer_t *writer, ca_calc_t *calc, ca_dump_format_t format)
+{
+    assert(writer);
+    assert_calc(calc);
+
+    /* apply the deferred operations */
+    ca_count(calc);
+
+    if (format == CA_DUMP_BINARY)
+        return ca_writer_write(writer, calc->stack, calc->top * sizeof(ca_value_t));
+
+    if (calc->mode && calc->mode->kind == CA_MODE_DECIMAL) {
+        char decimal[CA_DECIMAL_DIGITS + 1];
+        for (size_t i = 0; i < calc->top; i++) {
+            size_t length = 0;
+            if (i)
+                decimal[length++] = ' ';
+            length += ca_format_decimal(calc->stack[i], calc->mode->decimal.digits, decimal + length);
+            if (ca_writer_write(writer, decimal, length))
+                return -1;
+        }
+        return 0;
+    }
+
+    for (size_t i = 0; i < calc->top; i++) {
+        /* room for a separator and a value */
+        if (writer->size - writer->used <= CA_VALUE_DIGITS && ca_writer_flush(writer))
+            return -1;
+        if (i)
+            writer->buffer[writer->used++] = ' ';
+        writer->used += ca_format_value(calc->stack[i], writer->buffer + writer->used);
+    }
+    return 0;
+}
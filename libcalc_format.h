@@ -0,0 +1,135 @@
+#ifndef _LIBCALC_FORMAT_H_
+#define _LIBCALC_FORMAT_H_
+
+#include "libcalc.h"
+
+/**
+ * Maximum number of characters of a formatted value: a sign and 19
+ * digits.
+ */
+#define CA_VALUE_DIGITS 20
+
+/**
+ * Maximum number of characters of a formatted decimal: a sign, 19
+ * digits and the decimal point.
+ */
+#define CA_DECIMAL_DIGITS (CA_VALUE_DIGITS + 1)
+
+/**
+ * How to dump a stack.
+ */
+typedef enum ca_dump_format {
+    /** Decimal values separated by spaces */
+    CA_DUMP_TEXT,
+    /** The values in native byte order */
+    CA_DUMP_BINARY
+} ca_dump_format_t;
+
+/**
+ * A buffered writer to a file descriptor.
+ */
+typedef struct ca_writer {
+    /** Where to write, -1 to only fill the buffer */
+    int fd;
+    /** The buffer */
+    char *buffer;
+    /** Size of the buffer */
+    size_t size;
+    /** Number of bytes in the buffer */
+    size_t used;
+    /** Allocator of the buffer, NULL if it is given by the caller */
+    const ca_allocator_t *allocator;
+} ca_writer_t;
+
+/**
+ * Format a value in decimal.
+ *
+ * The digits are produced two at a time from a table, without the
+ * locale handling of printf.
+ *
+ * @param value the value to format
+ * @param buffer where to store at least CA_VALUE_DIGITS characters,
+ * which are not terminated by a nul character
+ * @return the number of characters.
+ */
+size_t ca_format_value(ca_value_t value, char *buffer) __attribute__ ((nonnull(2)));
+
+/**
+ * Format a fixed point decimal, see ca_set_decimal.
+ *
+ * @param value the value, the decimal multiplied by 10^digits
+ * @param digits the number of digits after the decimal point
+ * @param buffer where to store at least CA_DECIMAL_DIGITS characters,
+ * which are not terminated by a nul character
+ * @return the number of characters.
+ */
+size_t ca_format_decimal(ca_value_t value, unsigned digits, char *buffer) __attribute__ ((nonnull(3)));
+
+/**
+ * Parse a fixed point decimal, see ca_set_decimal.
+ *
+ * The decimal has an optional sign and decimal point, the digits
+ * beyond the given number being rounded half away from zero: with 2
+ * digits, "-1.005" gives -101.
+ *
+ * @param text the text to parse
+ * @param digits the number of digits after the decimal point
+ * @param value where to store the decimal multiplied by 10^digits
+ * @param end where to store the end of the decimal, NULL if the whole
+ * text should be the decimal
+ * @return 0 on success, -1 if there is no decimal or it overflows.
+ */
+int ca_parse_decimal(const char *text, unsigned digits, ca_value_t *value,
+                     const char **end) __attribute__ ((nonnull(1, 3)));
+
+/**
+ * Initialize a writer.
+ *
+ * @param fd the file descriptor to write to, -1 for a writer that
+ * fails once its buffer is full
+ * @param buffer the buffer, NULL to allocate it
+ * @param size size of the buffer, greater than CA_VALUE_DIGITS
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_writer_initialize(ca_writer_t *writer, int fd, char *buffer, size_t size) __attribute__ ((nonnull(1)));
+
+/**
+ * Cleanup a writer, without flushing it.
+ */
+void ca_writer_cleanup(ca_writer_t *writer) __attribute__ ((nonnull(1)));
+
+/**
+ * Write the buffered bytes to the file descriptor.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_writer_flush(ca_writer_t *writer) __attribute__ ((nonnull(1)));
+
+/**
+ * Write bytes.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_writer_write(ca_writer_t *writer, const void *data, size_t length) __attribute__ ((nonnull(1)));
+
+/**
+ * Write a value in decimal.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_writer_value(ca_writer_t *writer, ca_value_t value) __attribute__ ((nonnull(1)));
+
+/**
+ * Write the values of the stack, from the bottom to the top.
+ *
+ * The text of the values of a context computing with decimals has
+ * their decimal point, see ca_set_decimal.
+ *
+ * @param writer the writer
+ * @param calc the library context
+ * @param format how to write the values
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_dump(ca_writer_t *writer, ca_calc_t *calc, ca_dump_format_t format) __attribute__ ((nonnull(1, 2)));
+
+#endif /* _LIBCALC_FORMAT_H_ */
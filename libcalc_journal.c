@@ -0,0 +1,552 @@
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_journal.h"
+
+/**
+ * Size of the buffer of a group, its header included.
+ */
+#define CA_JOURNAL_BUFFER (64 * 1024)
+
+/**
+ * Maximum size of a record: a tag and a 64 bits varint.
+ */
+#define CA_RECORD_SIZE 11
+
+#define CA_LOG_MAGIC 0x4c4e524a434c4143UL       /* "CALCJRNL" */
+#define CA_SNAPSHOT_MAGIC 0x50414e53434c4143UL  /* "CALCSNAP" */
+
+/**
+ * The tags of the records which are not operations, an operation is
+ * recorded as its ca_operation_t.
+ */
+enum {
+    /** Followed by the zigzag varint of the pushed value */
+    CA_RECORD_PUSH = 0xfe,
+    /** Followed by the varint of the number of removed values */
+    CA_RECORD_REMOVE = 0xff
+};
+
+/**
+ * Header of the log.
+ */
+typedef struct ca_log_header {
+    uint64_t magic;
+    uint64_t generation;
+} ca_log_header_t;
+
+/**
+ * Header of a group of records.
+ */
+typedef struct ca_group_header {
+    /** Number of bytes of the records */
+    uint32_t length;
+    /** Checksum of the records */
+    uint32_t crc;
+} ca_group_header_t;
+
+/**
+ * Header of a snapshot, followed by the values and the checksum of
+ * both.
+ */
+typedef struct ca_snapshot_header {
+    uint64_t magic;
+    /** Generation of the log following the snapshot */
+    uint64_t generation;
+    /** Number of values */
+    uint64_t count;
+} ca_snapshot_header_t;
+
+static uint32_t ca_crc32(uint32_t crc, const void *data, size_t length)
+{
+    /* one nibble at a time, see the crc32 of zlib */
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    const unsigned char *p = data;
+
+    crc = ~crc;
+    while (length--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return ~crc;
+}
+
+static int ca_write_full(int fd, const void *data, size_t length)
+{
+    const char *p = data;
+    while (length) {
+        ssize_t written = write(fd, p, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            tr("unable to write journal: %m");
+            return -1;
+        }
+        p += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * Read up to length bytes, stopping early at the end of the file.
+ *
+ * @return the number of bytes read, -1 on failure.
+ */
+static ssize_t ca_read_full(int fd, void *data, size_t length)
+{
+    char *p = data;
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, p + done, length - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            tr("unable to read journal: %m");
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Make the renames in the directory of a path durable.
+ */
+static void ca_sync_directory(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char directory[slash ? slash - path + 2 : 2];
+
+    if (slash) {
+        memcpy(directory, path, slash - path + 1);
+        directory[slash - path + 1] = '\0';
+    } else {
+        strcpy(directory, ".");
+    }
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) < 0)
+        tr("unable to synchronize %s: %m", directory);
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * Write a file under a temporary name, then rename it to its path.
+ *
+ * @return the file descriptor of the file, -1 on failure.
+ */
+static int ca_replace_file(const char *path, const void *data, size_t length)
+{
+    char tmp[strlen(path) + sizeof(".tmp")];
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        tr("unable to create %s: %m", tmp);
+        return -1;
+    }
+    if (ca_write_full(fd, data, length) || fdatasync(fd) < 0 || rename(tmp, path) < 0) {
+        tr("unable to replace %s: %m", path);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    ca_sync_directory(path);
+    return fd;
+}
+
+/**
+ * Start an empty log.
+ */
+static int ca_journal_new_log(ca_journal_t *journal)
+{
+    ca_log_header_t header = { CA_LOG_MAGIC, journal->generation };
+
+    int fd = ca_replace_file(journal->path, &header, sizeof(header));
+    if (fd < 0)
+        return -1;
+    if (journal->fd >= 0)
+        close(journal->fd);
+    journal->fd = fd;
+    return 0;
+}
+
+/**
+ * Append a varint to the buffer.
+ */
+static void ca_journal_varint(ca_journal_t *journal, uint64_t n)
+{
+    while (n >= 0x80) {
+        journal->buffer[journal->used++] = n | 0x80;
+        n >>= 7;
+    }
+    journal->buffer[journal->used++] = n;
+}
+
+static int ca_decode_varint(const unsigned char **p, const unsigned char *end, uint64_t *n)
+{
+    *n = 0;
+    for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *n |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * Ensure there is room for a record in the buffer, which is still full
+ * when its commit failed.
+ */
+static int ca_journal_reserve(ca_journal_t *journal)
+{
+    if (CA_JOURNAL_BUFFER - journal->used < CA_RECORD_SIZE)
+        return ca_journal_commit(journal);
+    return 0;
+}
+
+/**
+ * Count a record appended to the buffer, committing the group when it
+ * is complete.
+ */
+static int ca_journal_record(ca_journal_t *journal)
+{
+    if (++journal->records >= journal->group || CA_JOURNAL_BUFFER - journal->used < CA_RECORD_SIZE)
+        return ca_journal_commit(journal);
+    return 0;
+}
+
+int ca_journal_commit(ca_journal_t *journal)
+{
+    assert(journal);
+
+    if (journal->records == 0)
+        return 0;
+
+    ca_group_header_t header = {
+        .length = journal->used - sizeof(header),
+        .crc = ca_crc32(0, journal->buffer + sizeof(header), journal->used - sizeof(header))
+    };
+    memcpy(journal->buffer, &header, sizeof(header));
+
+    off_t end = lseek(journal->fd, 0, SEEK_CUR);
+    if (ca_write_full(journal->fd, journal->buffer, journal->used) || fdatasync(journal->fd) < 0) {
+        tr("unable to commit journal: %m");
+        /* keep the log ending with a complete group, the records stay
+         * pending */
+        if (end >= 0 && ftruncate(journal->fd, end) == 0)
+            lseek(journal->fd, end, SEEK_SET);
+        return -1;
+    }
+
+    journal->used = sizeof(header);
+    journal->records = 0;
+    return 0;
+}
+
+int ca_journal_push(ca_journal_t *journal, ca_calc_t *calc, ca_value_t value)
+{
+    assert(journal);
+    assert(calc);
+
+    if (ca_space_left(calc) == 0) {
+        tr("stack is full");
+        return -1;
+    }
+    if (ca_journal_reserve(journal))
+        return -1;
+    ca_push(calc, value);
+
+    journal->buffer[journal->used++] = CA_RECORD_PUSH;
+    ca_journal_varint(journal, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+    return ca_journal_record(journal);
+}
+
+int ca_journal_operate(ca_journal_t *journal, ca_calc_t *calc, ca_operation_t op)
+{
+    assert(journal);
+    assert(calc);
+    assert_ca_operation(op);
+
+    if (ca_journal_reserve(journal))
+        return -1;
+
+    /* log the operation as applied: a deferred one failing later would
+     * drop the rest of its run, which the replay would still apply */
+    struct ca_lazy *lazy = calc->lazy;
+    if (ca_flush(calc))
+        return -1;
+    calc->lazy = NULL;
+    int retval = ca_operate(calc, op);
+    calc->lazy = lazy;
+
+    journal->buffer[journal->used++] = op;
+    if (ca_journal_record(journal))
+        return -1;
+    return retval;
+}
+
+unsigned ca_journal_remove(ca_journal_t *journal, ca_calc_t *calc, unsigned count)
+{
+    assert(journal);
+    assert(calc);
+
+    if (ca_journal_reserve(journal))
+        return 0;
+    unsigned removed = ca_remove(calc, count);
+    if (removed == 0)
+        return 0;
+
+    journal->buffer[journal->used++] = CA_RECORD_REMOVE;
+    ca_journal_varint(journal, removed);
+    if (ca_journal_record(journal))
+        return 0;
+    return removed;
+}
+
+/**
+ * Apply the records of a group.
+ */
+static int ca_journal_replay(ca_calc_t *calc, const unsigned char *p, size_t length)
+{
+    const unsigned char *end = p + length;
+
+    while (p < end) {
+        unsigned tag = *p++;
+        uint64_t n;
+
+        if (tag < CA_OPERATION_COUNT) {
+            /* the operation failed the same way when it was logged */
+            ca_operate(calc, tag);
+            continue;
+        }
+
+        if (ca_decode_varint(&p, end, &n)) {
+            tr("truncated record in journal");
+            return -1;
+        }
+        if (tag == CA_RECORD_PUSH) {
+            if (ca_space_left(calc) == 0) {
+                tr("stack is too small to replay journal");
+                return -1;
+            }
+            ca_push(calc, (ca_value_t) (n >> 1) ^ -(ca_value_t) (n & 1));
+        } else if (tag == CA_RECORD_REMOVE && n) {
+            ca_remove(calc, n);
+        } else {
+            tr("invalid record %u in journal", tag);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Restore the stack from the snapshot, if there is one.
+ */
+static int ca_journal_load_snapshot(ca_journal_t *journal, ca_calc_t *calc, const char *path)
+{
+    ca_snapshot_header_t header;
+    uint32_t crc;
+    int retval = -1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        tr("unable to open %s: %m", path);
+        return -1;
+    }
+
+    if (ca_read_full(fd, &header, sizeof(header)) != sizeof(header) || header.magic != CA_SNAPSHOT_MAGIC) {
+        tr("invalid snapshot %s", path);
+        goto out;
+    }
+    if (header.count > calc->size) {
+        tr("stack is too small for snapshot of %lu values", (unsigned long) header.count);
+        goto out;
+    }
+
+    size_t length = header.count * sizeof(ca_value_t);
+    if (ca_read_full(fd, calc->stack, length) != (ssize_t) length ||
+        ca_read_full(fd, &crc, sizeof(crc)) != sizeof(crc) ||
+        crc != ca_crc32(ca_crc32(0, &header, sizeof(header)), calc->stack, length)) {
+        tr("corrupted snapshot %s", path);
+        goto out;
+    }
+
+    calc->top = header.count;
+    journal->generation = header.generation;
+    retval = 0;
+
+out:
+    close(fd);
+    return retval;
+}
+
+/**
+ * Replay the complete groups of the log, truncating it after them.
+ */
+static int ca_journal_load_log(ca_journal_t *journal, ca_calc_t *calc)
+{
+    ca_log_header_t header;
+    ca_group_header_t group;
+
+    journal->fd = open(journal->path, O_RDWR);
+    if (journal->fd < 0) {
+        if (errno == ENOENT)
+            return ca_journal_new_log(journal);
+        tr("unable to open %s: %m", journal->path);
+        return -1;
+    }
+
+    ssize_t n = ca_read_full(journal->fd, &header, sizeof(header));
+    if (n < 0)
+        return -1;
+    /* a crash while starting the log */
+    if (n < (ssize_t) sizeof(header) || header.generation < journal->generation)
+        return ca_journal_new_log(journal);
+    if (header.magic != CA_LOG_MAGIC || header.generation > journal->generation) {
+        tr("log %s does not follow its snapshot", journal->path);
+        return -1;
+    }
+
+    off_t end = sizeof(header);
+    unsigned char *records = journal->buffer + sizeof(group);
+    for (;;) {
+        /* only a torn group ends the log, not a failed read */
+        n = ca_read_full(journal->fd, &group, sizeof(group));
+        if (n < 0)
+            return -1;
+        if (n != sizeof(group) || group.length > CA_JOURNAL_BUFFER - sizeof(group))
+            break;
+        n = ca_read_full(journal->fd, records, group.length);
+        if (n < 0)
+            return -1;
+        if (n != group.length || ca_crc32(0, records, group.length) != group.crc)
+            break;
+        if (ca_journal_replay(calc, records, group.length))
+            return -1;
+        end += sizeof(group) + group.length;
+    }
+
+    /* drop what a crash left of the last group */
+    if (ftruncate(journal->fd, end) < 0 || lseek(journal->fd, end, SEEK_SET) < 0) {
+        tr("unable to truncate %s: %m", journal->path);
+        return -1;
+    }
+    return 0;
+}
+
+int ca_journal_open(ca_journal_t *journal, const char *path, ca_calc_t *calc, size_t group)
+{
+    assert(journal);
+    assert(path);
+    assert_calc(calc);
+    assert(group);
+
+    char snapshot[strlen(path) + sizeof(".snapshot")];
+    strcpy(snapshot, path);
+    strcat(snapshot, ".snapshot");
+
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    journal->group = group;
+    journal->used = sizeof(ca_group_header_t);
+    journal->allocator = ca_get_allocator();
+    journal->path = ca_alloc(journal->allocator, strlen(path) + 1);
+    journal->buffer = ca_alloc(journal->allocator, CA_JOURNAL_BUFFER);
+    if (journal->path == NULL || journal->buffer == NULL) {
+        tr("unable to create journal: %m");
+        goto error;
+    }
+    strcpy(journal->path, path);
+
+    /* the records are applied immediately, in their order, on a stack
+     * replacing the current one whether its deferred operations fail
+     * or not */
+    struct ca_lazy *lazy = calc->lazy;
+    ca_flush(calc);
+    calc->lazy = NULL;
+    ca_remove(calc, 0);
+    int retval = ca_journal_load_snapshot(journal, calc, snapshot) || ca_journal_load_log(journal, calc);
+    calc->lazy = lazy;
+    if (retval == 0)
+        return 0;
+
+error:
+    if (journal->fd >= 0)
+        close(journal->fd);
+    ca_free(journal->allocator, journal->buffer, CA_JOURNAL_BUFFER);
+    ca_free(journal->allocator, journal->path, strlen(path) + 1);
+    return -1;
+}
+
+int ca_journal_close(ca_journal_t *journal)
+{
+    assert(journal);
+
+    int retval = ca_journal_commit(journal);
+    close(journal->fd);
+    ca_free(journal->allocator, journal->buffer, CA_JOURNAL_BUFFER);
+    ca_free(journal->allocator, journal->path, strlen(journal->path) + 1);
+    memset(journal, 0, sizeof(*journal));
+    return retval;
+}
+
+int ca_journal_snapshot(ca_journal_t *journal, ca_calc_t *calc)
+{
+    assert(journal);
+    assert_calc(calc);
+
+    char path[strlen(journal->path) + sizeof(".snapshot")];
+    strcpy(path, journal->path);
+    strcat(path, ".snapshot");
+
+    if (ca_journal_commit(journal))
+        return -1;
+
+    ca_snapshot_header_t header = { CA_SNAPSHOT_MAGIC, journal->generation + 1, ca_count(calc) };
+    size_t length = header.count * sizeof(ca_value_t);
+    uint32_t crc = ca_crc32(ca_crc32(0, &header, sizeof(header)), calc->stack, length);
+
+    char tmp[strlen(path) + sizeof(".tmp")];
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        tr("unable to create %s: %m", tmp);
+        return -1;
+    }
+    if (ca_write_full(fd, &header, sizeof(header)) || ca_write_full(fd, calc->stack, length) ||
+        ca_write_full(fd, &crc, sizeof(crc)) || fdatasync(fd) < 0 || rename(tmp, path) < 0) {
+        tr("unable to save snapshot %s: %m", path);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    ca_sync_directory(path);
+
+    /* a crash from now on recovers from the snapshot, ignoring the
+     * previous log */
+    journal->generation += 1;
+    return ca_journal_new_log(journal);
+}
@@ -0,0 +1,102 @@
+#ifndef _LIBCALC_JOURNAL_H_
+#define _LIBCALC_JOURNAL_H_
+
+#include "libcalc.h"
+
+/**
+ * A log of the changes of a context, to recover it after a crash.
+ *
+ * The pushes, removals and operations are appended to the log as
+ * records of a few bytes, gathered in groups. A group is written with
+ * its checksum and synchronized to the disk in a single commit, once
+ * it holds enough records or on ca_journal_commit: the changes since
+ * the last commit are lost on a crash. A snapshot of the stack starts
+ * a new log, so that recovering only replays the changes made since.
+ *
+ * The log is stored at the path of the journal, the snapshot at the
+ * same path followed by ".snapshot".
+ */
+typedef struct ca_journal {
+    /** The log */
+    int fd;
+    /** Path of the log */
+    char *path;
+    /** The records of the current group, after room for its header */
+    unsigned char *buffer;
+    /** Number of bytes in the buffer */
+    size_t used;
+    /** Number of records in the current group */
+    size_t records;
+    /** Number of records committed together */
+    size_t group;
+    /** Number of the log, incremented by each snapshot */
+    unsigned long generation;
+    /** Allocator of the journal */
+    const ca_allocator_t *allocator;
+} ca_journal_t;
+
+/**
+ * Open a journal, recovering a context from it.
+ *
+ * The stack of the context is replaced by the one of the last
+ * snapshot, and the committed changes logged since are applied to
+ * it. A log ending with an incomplete group, as left by a crash, is
+ * truncated to the last complete one.
+ *
+ * @param journal the journal to open
+ * @param path the path of the log
+ * @param calc the context to recover
+ * @param group the number of records committed together, at least 1
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_journal_open(ca_journal_t *journal, const char *path, ca_calc_t *calc,
+                    size_t group) __attribute__ ((nonnull(1, 2, 3)));
+
+/**
+ * Commit the pending records and close a journal.
+ *
+ * @return 0 on success, -1 if the commit failed.
+ */
+int ca_journal_close(ca_journal_t *journal) __attribute__ ((nonnull(1)));
+
+/**
+ * Push a value on the stack and log it.
+ *
+ * @return 0 on success, -1 if the stack is full or the log failed.
+ */
+int ca_journal_push(ca_journal_t *journal, ca_calc_t *calc, ca_value_t value) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Apply an operation and log it.
+ *
+ * Failing operations are logged as well, since some of them change
+ * the stack. The operation is applied immediately even on a lazy
+ * context, after its deferred operations.
+ *
+ * @return the result of ca_operate, -1 if the log or the deferred
+ * operations failed.
+ */
+int ca_journal_operate(ca_journal_t *journal, ca_calc_t *calc, ca_operation_t op) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Remove values like ca_remove and log it.
+ *
+ * @return the number of removed values, 0 if the log failed.
+ */
+unsigned ca_journal_remove(ca_journal_t *journal, ca_calc_t *calc, unsigned count) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Write and synchronize the pending records.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_journal_commit(ca_journal_t *journal) __attribute__ ((nonnull(1)));
+
+/**
+ * Save the stack and start a new log.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_journal_snapshot(ca_journal_t *journal, ca_calc_t *calc) __attribute__ ((nonnull(1, 2)));
+
+#endif /* _LIBCALC_JOURNAL_H_ */
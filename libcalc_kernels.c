@@ -0,0 +1,293 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_kernels.h"
+
+/**
+ * Number of values summed before the partial sums could overflow.
+ */
+#define CA_SUM_CHUNK (1UL << 31)
+
+/**
+ * The kernels built for an instruction set.
+ */
+typedef struct ca_kernels {
+    /** Name of the instruction set, as in LIBCALC_ISA */
+    const char *isa;
+    /** Add values, storing their sum and returning 0, or returning -1
+     * if it does not fit */
+    int (*sum)(const ca_value_t *values, size_t count, ca_value_t *sum);
+    /** Apply an operation to arrays, see ca_operate_array */
+    void (*operate)(ca_operation_t op, ca_value_t *x, const ca_value_t *y, size_t count, unsigned char *failed);
+} ca_kernels_t;
+
+/**
+ * Raise a value to a power, failing silently like the kernels.
+ */
+static inline int ca_power(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    ca_value_t power = 1;
+
+    if (y < 0)
+        return -1;
+    for (; y; y >>= 1) {
+        if ((y & 1) && __builtin_mul_overflow(power, x, &power))
+            return -1;
+        if (y > 1 && __builtin_mul_overflow(x, x, &x))
+            return -1;
+    }
+    *result = power;
+    return 0;
+}
+
+/**
+ * Apply an operation to arrays, inlined in the kernel of each
+ * instruction set so that each loop is vectorised for it.
+ *
+ * The failing elements get any value, but never trap: the divisions
+ * by 0 and of CA_VALUE_MIN by -1 divide by 1 instead. Shifts use the
+ * low 6 bits of their amount, as the shift instructions of the cpu.
+ */
+__attribute__ ((always_inline))
+static inline void ca_operate_elements(ca_operation_t op, ca_value_t *restrict x, const ca_value_t *restrict y,
+                                       size_t count, unsigned char *restrict failed)
+{
+    switch (op) {
+    case CA_OP_ADD:
+        for (size_t i = 0; i < count; i++) {
+            ca_value_t r = (ca_value_t) ((uint64_t) x[i] + (uint64_t) y[i]);
+            failed[i] |= ((x[i] ^ r) & (y[i] ^ r)) < 0;
+            x[i] = r;
+        }
+        break;
+    case CA_OP_SUBSTRACT:
+        for (size_t i = 0; i < count; i++) {
+            ca_value_t r = (ca_value_t) ((uint64_t) x[i] - (uint64_t) y[i]);
+            failed[i] |= ((x[i] ^ y[i]) & (x[i] ^ r)) < 0;
+            x[i] = r;
+        }
+        break;
+    case CA_OP_MULTIPLY:
+        for (size_t i = 0; i < count; i++)
+            failed[i] |= __builtin_mul_overflow(x[i], y[i], x + i);
+        break;
+    case CA_OP_DIVIDE:
+        for (size_t i = 0; i < count; i++) {
+            int invalid = y[i] == 0 || (y[i] == -1 && x[i] == CA_VALUE_MIN);
+            failed[i] |= invalid;
+            x[i] /= invalid ? 1 : y[i];
+        }
+        break;
+    case CA_OP_MODULO:
+        /* x % -1 overflows for CA_VALUE_MIN, x % 1 is 0 as well */
+        for (size_t i = 0; i < count; i++) {
+            failed[i] |= y[i] == 0;
+            x[i] %= y[i] == 0 || y[i] == -1 ? 1 : y[i];
+        }
+        break;
+    case CA_OP_SQUARE_ROOT:
+        for (size_t i = 0; i < count; i++) {
+            failed[i] |= x[i] < 0;
+            if (x[i] >= 0)
+                ca_value_square_root(x[i], x + i);
+        }
+        break;
+    case CA_OP_LEFT_SHIFT:
+        for (size_t i = 0; i < count; i++)
+            x[i] = (ca_value_t) ((uint64_t) x[i] << (y[i] & 63));
+        break;
+    case CA_OP_RIGHT_SHIFT:
+        for (size_t i = 0; i < count; i++)
+            x[i] >>= y[i] & 63;
+        break;
+    case CA_OP_EQUAL:
+        for (size_t i = 0; i < count; i++)
+            x[i] = x[i] == y[i];
+        break;
+    case CA_OP_NOT_EQUAL:
+        for (size_t i = 0; i < count; i++)
+            x[i] = x[i] != y[i];
+        break;
+    case CA_OP_LESS:
+        for (size_t i = 0; i < count; i++)
+            x[i] = x[i] < y[i];
+        break;
+    case CA_OP_LESS_EQUAL:
+        for (size_t i = 0; i < count; i++)
+            x[i] = x[i] <= y[i];
+        break;
+    case CA_OP_GREATER:
+        for (size_t i = 0; i < count; i++)
+            x[i] = x[i] > y[i];
+        break;
+    case CA_OP_GREATER_EQUAL:
+        for (size_t i = 0; i < count; i++)
+            x[i] = x[i] >= y[i];
+        break;
+    case CA_OP_POWER:
+        for (size_t i = 0; i < count; i++)
+            failed[i] |= ca_power(x[i], y[i], x + i) != 0;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * The kernels are written once in plain C and built for each
+ * instruction set by the compiler, which vectorises their loops.
+ *
+ * The sum adds the low and high 32 bits of the values as unsigned
+ * integers in separate 64 bit lanes, and counts the negative values:
+ * the lanes cannot overflow, and the exact sum is rebuilt from them on
+ * 128 bits.
+ */
+#define CA_KERNELS(SUFFIX, TARGET)                                      \
+    TARGET static int ca_sum_##SUFFIX(const ca_value_t *values, size_t count, ca_value_t *sum) \
+    {                                                                   \
+        __int128 total = 0;                                             \
+                                                                        \
+        for (size_t start = 0; start < count; start += CA_SUM_CHUNK) {  \
+            const uint64_t *v = (const uint64_t *) values + start;      \
+            size_t n = count - start < CA_SUM_CHUNK ? count - start : CA_SUM_CHUNK; \
+            uint64_t low = 0, high = 0, negative = 0;                   \
+                                                                        \
+            for (size_t i = 0; i < n; i++) {                            \
+                low += v[i] & 0xffffffffUL;                             \
+                high += v[i] >> 32;                                     \
+                negative += v[i] >> 63;                                 \
+            }                                                           \
+            total += ((__int128) high << 32) + low - ((__int128) negative << 64); \
+        }                                                               \
+                                                                        \
+        if (total > CA_VALUE_MAX || total < CA_VALUE_MIN)               \
+            return -1;                                                  \
+        *sum = (ca_value_t) total;                                      \
+        return 0;                                                       \
+    }                                                                   \
+                                                                        \
+    TARGET static void ca_operate_##SUFFIX(ca_operation_t op, ca_value_t *x, const ca_value_t *y, \
+                                           size_t count, unsigned char *failed) \
+    {                                                                   \
+        ca_operate_elements(op, x, y, count, failed);                   \
+    }
+
+CA_KERNELS(generic, )
+
+#ifdef __x86_64__
+CA_KERNELS(sse42, __attribute__ ((target("sse4.2"))))
+CA_KERNELS(avx2, __attribute__ ((target("avx2"))))
+CA_KERNELS(avx512f, __attribute__ ((target("avx512f"))))
+#endif
+
+/**
+ * The kernels of each instruction set, best first.
+ */
+static const ca_kernels_t ca_kernel_variants[] = {
+#ifdef __x86_64__
+    { "avx512f", ca_sum_avx512f, ca_operate_avx512f },
+    { "avx2", ca_sum_avx2, ca_operate_avx2 },
+    { "sse4.2", ca_sum_sse42, ca_operate_sse42 },
+#endif
+    { "generic", ca_sum_generic, ca_operate_generic },
+};
+
+#define CA_KERNEL_VARIANTS (sizeof(ca_kernel_variants) / sizeof(ca_kernel_variants[0]))
+
+/**
+ * The kernels used, selected when the library is loaded.
+ */
+static const ca_kernels_t *ca_kernels = ca_kernel_variants + CA_KERNEL_VARIANTS - 1;
+
+/**
+ * Return true if the cpu supports an instruction set.
+ */
+static int ca_cpu_supports(const char *isa)
+{
+#ifdef __x86_64__
+    if (strcmp(isa, "avx512f") == 0)
+        return __builtin_cpu_supports("avx512f");
+    if (strcmp(isa, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(isa, "sse4.2") == 0)
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    return strcmp(isa, "generic") == 0;
+}
+
+/**
+ * Select the kernels once, before the library is used.
+ *
+ * This is a constructor rather than an ifunc resolver, which runs
+ * during relocation when the environment should not be read yet.
+ */
+__attribute__ ((constructor))
+static void ca_kernels_select(void)
+{
+    const char *wanted = getenv("LIBCALC_ISA");
+    const ca_kernels_t *best = NULL;
+
+#ifdef __x86_64__
+    __builtin_cpu_init();
+#endif
+    for (size_t i = 0; i < CA_KERNEL_VARIANTS; i++) {
+        const ca_kernels_t *kernels = ca_kernel_variants + i;
+        if (!ca_cpu_supports(kernels->isa))
+            continue;
+        if (best == NULL)
+            best = kernels;
+        if (wanted && strcmp(wanted, kernels->isa) == 0) {
+            ca_kernels = kernels;
+            return;
+        }
+    }
+
+    if (wanted && *wanted)
+        tr("instruction set %s is not supported, using %s", wanted, best->isa);
+    ca_kernels = best;
+}
+
+int ca_sum(ca_calc_t *calc, size_t count)
+{
+    assert_calc(calc);
+
+    if (ca_count(calc) < count || count == 0) {
+        tr("stack should have %zu values", count ? count : 1);
+        return -1;
+    }
+
+    if (calc->mode) {
+        /* there are no kernels for the arithmetic of the modes */
+        for (size_t i = 1; i < count; i++)
+            if (ca_operate(calc, CA_OP_ADD))
+                return -1;
+        return 0;
+    }
+
+    ca_value_t sum;
+    if (ca_kernels->sum(calc->stack + calc->top - count, count, &sum)) {
+        tr("addition would overflow");
+        return -1;
+    }
+    calc->top -= count - 1;
+    calc->stack[calc->top - 1] = sum;
+    return 0;
+}
+
+void ca_operate_array(ca_operation_t op, ca_value_t *x, const ca_value_t *y, size_t count, unsigned char *failed)
+{
+    assert_ca_operation(op);
+    assert(ca_operation_results[op] == 1 && ca_operation_operands[op] <= 2);
+    assert(x);
+    assert(y || ca_operation_operands[op] == 1);
+    assert(failed);
+
+    ca_kernels->operate(op, x, y, count, failed);
+}
+
+const char *ca_kernels_isa(void)
+{
+    return ca_kernels->isa;
+}
@@ -0,0 +1,52 @@
+#ifndef _LIBCALC_KERNELS_H_
+#define _LIBCALC_KERNELS_H_
+
+#include "libcalc.h"
+
+/**
+ * Replace the count top values of the stack by their sum.
+ *
+ * The sum is computed by a vectorised kernel, built for several
+ * instruction sets and selected for the cpu when the library is
+ * loaded, see ca_kernels_isa. Unlike count - 1 additions, which fail
+ * as soon as a partial sum overflows, only a sum which does not fit
+ * fails, leaving the stack untouched. With a mode, the values are
+ * added one by one in its arithmetic.
+ *
+ * @param calc the library context
+ * @param count the number of values to add, at least 1
+ * @return 0 on success, -1 if there are not enough values or the sum
+ * overflows.
+ */
+int ca_sum(ca_calc_t *calc, size_t count) __attribute__ ((nonnull(1)));
+
+/**
+ * Apply an operation taking one or two values and giving one to each
+ * element of arrays, x[i] = x[i] op y[i].
+ *
+ * The operation is applied by a vectorised kernel, like ca_sum, and
+ * the elements for which it fails are flagged rather than stopping
+ * it: failed[i] is set to 1 when it fails, and left as is otherwise,
+ * so that the failures of a sequence of operations accumulate. The
+ * failing elements of x get an unspecified value, no operation traps.
+ *
+ * @param op the operation, taking one or two values and giving one
+ * @param x the first operands, replaced by the results
+ * @param y the second operands, NULL for operations taking one value
+ * @param count the number of elements
+ * @param failed the failure flag of each element
+ */
+void ca_operate_array(ca_operation_t op, ca_value_t *x, const ca_value_t *y, size_t count,
+                      unsigned char *failed) __attribute__ ((nonnull(2, 5)));
+
+/**
+ * Return the instruction set of the kernels selected for the cpu,
+ * "avx512f", "avx2", "sse4.2" or "generic".
+ *
+ * The best one supported by the cpu is selected, unless the
+ * environment variable LIBCALC_ISA names another supported one, for
+ * instance to compare them in benchmarks.
+ */
+const char *ca_kernels_isa(void);
+
+#endif /* _LIBCALC_KERNELS_H_ */
@@ -0,0 +1,224 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_memory.h"
+
+/**
+ * Size of the huge pages.
+ */
+#define CA_HUGE_PAGE_SIZE (2UL << 20)
+
+/**
+ * NUMA policy preferring a node, see mbind(2).
+ */
+#define CA_MPOL_PREFERRED 1
+
+/**
+ * Round a size up to a multiple of a power of 2.
+ */
+#define ca_round_up(S, A) (((S) + (A) - 1) & ~((A) - 1))
+
+/**
+ * Prefer the NUMA node of the calling thread for a mapping, the pages
+ * not being touched yet.
+ */
+static void ca_memory_bind(void *memory, size_t length)
+{
+    unsigned cpu, node;
+    unsigned long mask;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) {
+        tr("unable to find numa node: %m");
+        return;
+    }
+    if (node >= sizeof(mask) * CHAR_BIT)
+        return;
+
+    mask = 1UL << node;
+    if (syscall(SYS_mbind, memory, length, CA_MPOL_PREFERRED, &mask, sizeof(mask) * CHAR_BIT, 0) < 0)
+        tr("unable to bind memory to numa node %u: %m", node);
+}
+
+/**
+ * Map zeroed memory.
+ *
+ * @param length the size to map, updated to the mapped size
+ * @param flags a combination of ca_memory_flags_t
+ * @return the memory, NULL on failure.
+ */
+static void *ca_memory_map(size_t *length, unsigned flags)
+{
+    void *memory = MAP_FAILED;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if ((flags & CA_MEMORY_HUGE_PAGES) && *length >= CA_HUGE_PAGE_SIZE) {
+        size_t huge = ca_round_up(*length, CA_HUGE_PAGE_SIZE);
+        memory = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+            *length = huge;
+    }
+
+    if (memory == MAP_FAILED) {
+        *length = ca_round_up(*length, page);
+        memory = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            tr("unable to map memory: %m");
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        /* no reserved huge pages, ask for transparent ones */
+        if ((flags & CA_MEMORY_HUGE_PAGES) && *length >= CA_HUGE_PAGE_SIZE)
+            madvise(memory, *length, MADV_HUGEPAGE);
+#endif
+    }
+
+    if (flags & CA_MEMORY_NUMA_LOCAL)
+        ca_memory_bind(memory, *length);
+
+    return memory;
+}
+
+int ca_initialize_mapped(ca_calc_t *calc, size_t size, unsigned flags)
+{
+    assert(calc);
+    assert(size);
+
+    size_t length = size * sizeof(ca_value_t);
+    calc->stack = ca_memory_map(&length, flags);
+    if (calc->stack == NULL)
+        return -1;
+
+    calc->mapped = length;
+    calc->allocator = ca_get_allocator();
+    calc->lazy = NULL;
+    calc->mode = NULL;
+    calc->spill = NULL;
+    calc->size = size;
+    calc->top = 0;
+    return 0;
+}
+
+/**
+ * Create an unlinked temporary file.
+ *
+ * @return the file descriptor, -1 on failure.
+ */
+static int ca_temporary_file(const char *directory)
+{
+    if (directory == NULL)
+        directory = getenv("TMPDIR");
+    if (directory == NULL || *directory == '\0')
+        directory = "/tmp";
+
+    size_t length = strlen(directory) + sizeof("/libcalc-XXXXXX");
+    char path[length];
+    snprintf(path, length, "%s/libcalc-XXXXXX", directory);
+
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        tr("unable to create file in %s: %m", directory);
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+int ca_initialize_file(ca_calc_t *calc, size_t size, const char *directory, size_t segment)
+{
+    assert(calc);
+    assert(size);
+
+    /* whole pages in each segment */
+    size_t page = sysconf(_SC_PAGESIZE) / sizeof(ca_value_t);
+    segment = ca_round_up(segment ? segment : CA_FILE_SEGMENT_SIZE, page);
+
+    const ca_allocator_t *allocator = ca_get_allocator();
+    struct ca_spill *spill = ca_alloc(allocator, sizeof(struct ca_spill));
+    if (spill == NULL) {
+        tr("unable to allocate stack segments");
+        return -1;
+    }
+
+    int fd = ca_temporary_file(directory);
+    if (fd < 0)
+        goto free;
+
+    size_t length = ca_round_up(size * sizeof(ca_value_t), page * sizeof(ca_value_t));
+    if (ftruncate(fd, length) < 0) {
+        tr("unable to size stack file: %m");
+        close(fd);
+        goto free;
+    }
+
+    calc->stack = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (calc->stack == MAP_FAILED) {
+        tr("unable to map stack file: %m");
+        goto free;
+    }
+
+    spill->segment = segment;
+    spill->low = 0;
+    spill->high = segment + segment / 2;
+
+    calc->mapped = length;
+    calc->allocator = allocator;
+    calc->lazy = NULL;
+    calc->mode = NULL;
+    calc->spill = spill;
+    calc->size = size;
+    calc->top = 0;
+    return 0;
+
+free:
+    ca_free(allocator, spill, sizeof(struct ca_spill));
+    return -1;
+}
+
+int ca_pool_initialize(ca_pool_t *pool, size_t count, size_t size, unsigned flags)
+{
+    assert(pool);
+    assert(count);
+    assert(size);
+
+    /* the stacks follow the contexts, each starting on a cache line */
+    size_t stack = size > CA_INLINE_STACK_SIZE ? ca_round_up(size * sizeof(ca_value_t), 64) : 0;
+    size_t contexts = ca_round_up(count * sizeof(ca_calc_t), 64);
+
+    pool->length = contexts + count * stack;
+    pool->memory = ca_memory_map(&pool->length, flags);
+    if (pool->memory == NULL)
+        return -1;
+
+    pool->calcs = pool->memory;
+    pool->count = count;
+    for (size_t i = 0; i < count; i++) {
+        ca_calc_t *calc = pool->calcs + i;
+        calc->stack = stack ? (ca_value_t *) ((char *) pool->memory + contexts + i * stack) : calc->inline_stack;
+        calc->size = size;
+        calc->top = 0;
+        calc->mapped = 0;
+        calc->allocator = ca_get_allocator();
+        calc->lazy = NULL;
+        calc->mode = NULL;
+        calc->spill = NULL;
+    }
+    return 0;
+}
+
+void ca_pool_cleanup(ca_pool_t *pool)
+{
+    assert(pool);
+    for (size_t i = 0; i < pool->count; i++)
+        ca_cleanup_state(pool->calcs + i);
+    munmap(pool->memory, pool->length);
+    memset(pool, 0, sizeof(*pool));
+}
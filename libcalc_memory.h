@@ -0,0 +1,96 @@
+#ifndef _LIBCALC_MEMORY_H_
+#define _LIBCALC_MEMORY_H_
+
+#include "libcalc.h"
+
+/**
+ * How to map the memory of large stacks and context pools.
+ */
+typedef enum ca_memory_flags {
+    /** Use huge pages, falling back to transparent huge pages, then to
+     * normal pages */
+    CA_MEMORY_HUGE_PAGES = 1 << 0,
+    /** Prefer the NUMA node of the calling thread */
+    CA_MEMORY_NUMA_LOCAL = 1 << 1
+} ca_memory_flags_t;
+
+/**
+ * Default number of values of the segments of a file stack, 1 MiB.
+ */
+#define CA_FILE_SEGMENT_SIZE (1UL << 17)
+
+/**
+ * Contexts sharing a single mapping.
+ */
+typedef struct ca_pool {
+    /** The contexts */
+    ca_calc_t *calcs;
+    /** Number of contexts */
+    size_t count;
+    /** The mapping holding the contexts and their stacks */
+    void *memory;
+    /** Size of the mapping */
+    size_t length;
+} ca_pool_t;
+
+/**
+ * Initialize the library context with a mapped stack.
+ *
+ * Large stacks mapped with huge pages take less TLB entries, and
+ * stacks mapped on the node of the thread using them avoid cross node
+ * memory traffic. The context is cleaned up with ca_cleanup.
+ *
+ * @param size size of the stack, must be greater than 0.
+ * @param flags a combination of ca_memory_flags_t
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_initialize_mapped(ca_calc_t *calc, size_t size, unsigned flags) __attribute__ ((nonnull(1)));
+
+/**
+ * Initialize the library context with a stack mapped from a temporary
+ * file, for stacks larger than the memory.
+ *
+ * The file is unlinked once created and sparse, so the stack only
+ * takes the disk space of the values pushed. The top of the stack
+ * stays in memory, the segments far below it are written out in large
+ * sequential writes and the segment below the top is read ahead before
+ * the operations reach it. The context is cleaned up with ca_cleanup.
+ *
+ * @param size size of the stack, must be greater than 0.
+ * @param directory the directory of the file, NULL for $TMPDIR or /tmp
+ * @param segment the number of values written out or read ahead at
+ * once, 0 for CA_FILE_SEGMENT_SIZE
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_initialize_file(ca_calc_t *calc, size_t size, const char *directory, size_t segment) __attribute__ ((nonnull(1)));
+
+/**
+ * Initialize a pool of contexts.
+ *
+ * The contexts and their stacks are mapped together, they are cleaned
+ * up by ca_pool_cleanup and should not be passed to ca_cleanup.
+ *
+ * @param pool the pool to initialize
+ * @param count number of contexts, must be greater than 0.
+ * @param size size of the stack of each context, must be greater than 0.
+ * @param flags a combination of ca_memory_flags_t
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_pool_initialize(ca_pool_t *pool, size_t count, size_t size, unsigned flags) __attribute__ ((nonnull(1)));
+
+/**
+ * Cleanup a pool of contexts, freeing the deferred operations and the
+ * modes of its contexts.
+ */
+void ca_pool_cleanup(ca_pool_t *pool) __attribute__ ((nonnull(1)));
+
+/**
+ * Return a context of the pool.
+ */
+__attribute__ ((nonnull(1)))
+static inline ca_calc_t *ca_pool_get(ca_pool_t *pool, size_t index)
+{
+    return pool->calcs + index;
+}
+
+#endif /* _LIBCALC_MEMORY_H_ */
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "libcalc.h"
 
@@ -18,14 +19,520 @@
     assert(C->top <= C->size);                  \
     } while (0)
 
+/*
+ * Allocations through an allocator, see ca_allocator_t.
+ */
+
+static inline void *ca_alloc(const ca_allocator_t *allocator, size_t size)
+{
+    return allocator->alloc(allocator->data, size);
+}
+
+static inline void *ca_realloc(const ca_allocator_t *allocator, void *ptr, size_t old_size, size_t size)
+{
+    return allocator->realloc(allocator->data, ptr, old_size, size);
+}
+
+static inline void ca_free(const ca_allocator_t *allocator, void *ptr, size_t size)
+{
+    if (ptr)
+        allocator->free(allocator->data, ptr, size);
+}
+
+/**
+ * The segments of a stack mapped from a file, see ca_initialize_file.
+ *
+ * The kernel writes the pages of the stack to the file and reads them
+ * back as needed. When the top moves to another segment, the segments
+ * far below it are paged out in a batch, and the segment below it is
+ * read ahead before the operations reach it.
+ */
+struct ca_spill {
+    /** Number of values of a segment, a multiple of the page size */
+    size_t segment;
+    /** The top is in the current segment while it is in [low, high) */
+    size_t low;
+    size_t high;
+};
+
+/**
+ * Free the deferred operations, the mode and the segments of a context,
+ * leaving its stack to the caller.
+ */
+void ca_cleanup_state(ca_calc_t *calc) __attribute__ ((nonnull(1)));
+
 /**
  * Number of available operations
  */
-#define CA_OPERATION_COUNT (CA_OP_RIGHT_SHIFT + 1)
+#define CA_OPERATION_COUNT (CA_OP_POWER + 1)
 
 /**
  * Check that an operation is valid.
  */
 #define assert_ca_operation(O) assert(CA_OPERATION_COUNT > (size_t) (O))
 
-#endif /* _LIBCALC_PRIV_H_ */
+/**
+ * The operations, indexed by ca_operation_t.
+ */
+extern int (*const ca_operations[CA_OPERATION_COUNT])(ca_calc_t *calc);
+
+/**
+ * Number of values an operation takes from the stack, indexed by
+ * ca_operation_t.
+ */
+extern const unsigned char ca_operation_operands[CA_OPERATION_COUNT];
+
+/**
+ * Number of values an operation pushes on the stack, indexed by
+ * ca_operation_t.
+ */
+extern const unsigned char ca_operation_results[CA_OPERATION_COUNT];
+
+/**
+ * Maximum number of operations fused in a superinstruction.
+ */
+#define CA_SUPERINSTRUCTION_LENGTH 3
+
+/**
+ * Consecutive operations applied in a single dispatch.
+ *
+ * The superinstructions are generated by mksuper from a profile of the
+ * runs, see ca_profile_save.
+ */
+typedef struct ca_superinstruction {
+    /** Number of fused operations */
+    unsigned length;
+    /** The fused operations */
+    ca_operation_t ops[CA_SUPERINSTRUCTION_LENGTH];
+    /** Number of values the operations take from the stack */
+    unsigned operands;
+    /** Apply the operations, leaving the stack untouched on failure */
+    int (*run)(ca_calc_t *calc);
+} ca_superinstruction_t;
+
+/**
+ * The generated superinstructions.
+ */
+extern const ca_superinstruction_t ca_superinstructions[];
+
+/**
+ * Number of generated superinstructions.
+ */
+extern const size_t ca_superinstruction_count;
+
+/*
+ * The arithmetic of the operations on values, shared by the operations
+ * on the stack and the fused instructions. Each stores its result and
+ * returns 0, or returns -1 when the operation is not possible.
+ */
+
+static inline int ca_value_add(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    if ((y > 0 && x > CA_VALUE_MAX - y) || (y < 0 && x < CA_VALUE_MIN - y)) {
+        tr("addition would overflow");
+        return -1;
+    }
+    *result = x + y;
+    return 0;
+}
+
+static inline int ca_value_substract(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    if ((y > 0 && x < CA_VALUE_MIN + y) || (y < 0 && x > CA_VALUE_MAX + y)) {
+        tr("substraction would overflow");
+        return -1;
+    }
+    *result = x - y;
+    return 0;
+}
+
+static inline int ca_value_multiply(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    /* never divide CA_VALUE_MIN by -1, which traps */
+    if ((x > 0 && y > 0 && x > CA_VALUE_MAX / y) || (x < 0 && y < 0 && x < CA_VALUE_MAX / y) ||
+        (x > 0 && y < 0 && y < CA_VALUE_MIN / x) || (x < 0 && y > 0 && x < CA_VALUE_MIN / y)) {
+        tr("multiplication would overflow");
+        return -1;
+    }
+    *result = x * y;
+    return 0;
+}
+
+static inline int ca_value_divide(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    if (y == 0) {
+        tr("cannot divide by 0");
+        return -1;
+    }
+    if (y == -1 && x == CA_VALUE_MIN) {
+        tr("division would overflow");
+        return -1;
+    }
+    *result = x / y;
+    return 0;
+}
+
+static inline int ca_value_square_root(ca_value_t x, ca_value_t *result)
+{
+    if (x < 0) {
+        tr("complex numbers are not supported, cannot fetch square root of negative numbers");
+        return -1;
+    }
+
+    /* lets keep it simple, do a binary search */
+    ca_value_t min = 0, max = x;
+    ca_value_t middle = ((min + max) >> 1) + 1;
+
+    do {
+        ca_value_t d = x / middle;
+        if (middle == d)
+            break;
+        else if (middle > d)
+            max = middle;
+        else
+            min = middle;
+        middle = (min + max) >>  1;
+    } while (max - min > 1);
+
+    *result = middle;
+    return 0;
+}
+
+static inline int ca_value_modulo(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    if (y == 0) {
+        tr("cannot calculate modulo by 0");
+        return -1;
+    }
+    /* x % -1 overflows for CA_VALUE_MIN */
+    *result = y == -1 ? 0 : x % y;
+    return 0;
+}
+
+static inline int ca_value_left_shift(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    *result = x << y;
+    return 0;
+}
+
+static inline int ca_value_right_shift(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    *result = x >> y;
+    return 0;
+}
+
+static inline int ca_value_equal(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    *result = x == y;
+    return 0;
+}
+
+static inline int ca_value_not_equal(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    *result = x != y;
+    return 0;
+}
+
+static inline int ca_value_less(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    *result = x < y;
+    return 0;
+}
+
+static inline int ca_value_less_equal(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    *result = x <= y;
+    return 0;
+}
+
+static inline int ca_value_greater(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    *result = x > y;
+    return 0;
+}
+
+static inline int ca_value_greater_equal(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    *result = x >= y;
+    return 0;
+}
+
+static inline int ca_value_power(ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    if (y < 0) {
+        tr("negative exponents are not supported");
+        return -1;
+    }
+
+    /* square and multiply, not squaring past the last bit so that only
+     * the overflows of the result fail */
+    ca_value_t power = 1;
+    for (; y; y >>= 1) {
+        if ((y & 1) && ca_value_multiply(power, x, &power))
+            return -1;
+        if (y > 1 && ca_value_multiply(x, x, &x))
+            return -1;
+    }
+    *result = power;
+    return 0;
+}
+
+/**
+ * The kinds of arithmetic of a context, see ca_set_modulus and
+ * ca_set_decimal.
+ */
+typedef enum ca_mode_kind {
+    /** Modulo an odd modulus */
+    CA_MODE_MODULAR,
+    /** Fixed point decimals */
+    CA_MODE_DECIMAL
+} ca_mode_kind_t;
+
+/**
+ * The arithmetic of a context, when it is not the one of plain integers.
+ */
+struct ca_mode {
+    ca_mode_kind_t kind;
+    union {
+        /** Parameters of CA_MODE_MODULAR, with R = 2^64 */
+        struct {
+            /** The modulus, odd and lower than 2^63 */
+            uint64_t modulus;
+            /** -modulus^-1 mod R */
+            uint64_t inverse;
+            /** R^2 mod modulus, to convert values to the Montgomery form */
+            uint64_t r2;
+        } modular;
+        /** Parameters of CA_MODE_DECIMAL */
+        struct {
+            /** Number of digits after the decimal point */
+            unsigned digits;
+            /** 10^digits, the value of 1 */
+            ca_value_t scale;
+        } decimal;
+    };
+};
+
+/*
+ * The arithmetic modulo an odd modulus. The values on the stack are
+ * kept reduced to [0, modulus) and products are reduced by Montgomery
+ * reduction rather than divisions.
+ */
+
+/**
+ * Return t R^-1 mod modulus, t being lower than modulus R.
+ */
+static inline uint64_t ca_modular_reduce(const struct ca_mode *mode, unsigned __int128 t)
+{
+    uint64_t q = (uint64_t) t * mode->modular.inverse;
+    /* no overflow, t + q modulus < 2 modulus R < 2^128 */
+    uint64_t r = (t + (unsigned __int128) q * mode->modular.modulus) >> 64;
+    return r >= mode->modular.modulus ? r - mode->modular.modulus : r;
+}
+
+/**
+ * Return a value reduced to [0, modulus).
+ */
+static inline uint64_t ca_modular_value(const struct ca_mode *mode, ca_value_t x)
+{
+    ca_value_t modulus = mode->modular.modulus;
+    if ((uint64_t) x < (uint64_t) modulus)
+        return x;
+    x %= modulus;
+    return x < 0 ? x + modulus : x;
+}
+
+/**
+ * Return x y mod modulus, x and y being reduced.
+ */
+static inline uint64_t ca_modular_multiply(const struct ca_mode *mode, uint64_t x, uint64_t y)
+{
+    /* x y R^-1, then back to x y by a product with R^2 */
+    return ca_modular_reduce(mode, (unsigned __int128) ca_modular_reduce(mode, (unsigned __int128) x * y) * mode->modular.r2);
+}
+
+/**
+ * Return x^y mod modulus, x being reduced.
+ */
+static inline uint64_t ca_modular_power(const struct ca_mode *mode, uint64_t x, uint64_t y)
+{
+    /* square and multiply in the Montgomery form x R, with a single
+     * reduction per product */
+    uint64_t base = ca_modular_reduce(mode, (unsigned __int128) x * mode->modular.r2);
+    uint64_t power = ca_modular_reduce(mode, mode->modular.r2);
+
+    for (; y; y >>= 1) {
+        if (y & 1)
+            power = ca_modular_reduce(mode, (unsigned __int128) power * base);
+        base = ca_modular_reduce(mode, (unsigned __int128) base * base);
+    }
+    return ca_modular_reduce(mode, power);
+}
+
+/**
+ * Apply an operation taking two values and giving one modulo the modulus.
+ *
+ * @return 0 on success, -1 on failure, 1 if the operation is computed
+ * like plain integers.
+ */
+static inline int ca_modular_binary(const struct ca_mode *mode, ca_operation_t op,
+                                    ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    uint64_t modulus = mode->modular.modulus, a, b;
+
+    switch (op) {
+    case CA_OP_ADD:
+        a = ca_modular_value(mode, x);
+        b = ca_modular_value(mode, y);
+        /* no overflow, both are lower than 2^63 */
+        *result = a + b >= modulus ? a + b - modulus : a + b;
+        return 0;
+    case CA_OP_SUBSTRACT:
+        a = ca_modular_value(mode, x);
+        b = ca_modular_value(mode, y);
+        *result = a >= b ? a - b : a + modulus - b;
+        return 0;
+    case CA_OP_MULTIPLY:
+        *result = ca_modular_multiply(mode, ca_modular_value(mode, x), ca_modular_value(mode, y));
+        return 0;
+    case CA_OP_POWER:
+        if (y < 0) {
+            tr("negative exponents are not supported");
+            return -1;
+        }
+        *result = ca_modular_power(mode, ca_modular_value(mode, x), y);
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * The arithmetic of fixed point decimals, values being stored
+ * multiplied by the scale. Sums and differences are the ones of plain
+ * integers, products and quotients are rescaled on 128 bit
+ * intermediates and rounded half away from zero.
+ */
+
+/**
+ * Return the quotient of n by d rounded half away from zero, failing
+ * if it overflows.
+ */
+static inline int ca_decimal_round(__int128 n, __int128 d, ca_value_t *result)
+{
+    __int128 q = n / d, r = n % d;
+
+    if (r < 0)
+        r = -r;
+    if (2 * r >= (d < 0 ? -d : d))
+        q += (n < 0) == (d < 0) ? 1 : -1;
+    if (q > CA_VALUE_MAX || q < CA_VALUE_MIN) {
+        tr("decimal would overflow");
+        return -1;
+    }
+    *result = q;
+    return 0;
+}
+
+static inline int ca_decimal_multiply(const struct ca_mode *mode, ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    return ca_decimal_round((__int128) x * y, mode->decimal.scale, result);
+}
+
+static inline int ca_decimal_divide(const struct ca_mode *mode, ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    if (y == 0) {
+        tr("cannot divide by 0");
+        return -1;
+    }
+    return ca_decimal_round((__int128) x * mode->decimal.scale, y, result);
+}
+
+/**
+ * Raise a decimal to an integral power, rounding each product.
+ */
+static inline int ca_decimal_power(const struct ca_mode *mode, ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    if (y < 0 || y % mode->decimal.scale) {
+        tr("exponents should be positive integers");
+        return -1;
+    }
+
+    ca_value_t power = mode->decimal.scale;
+    for (y /= mode->decimal.scale; y; y >>= 1) {
+        if ((y & 1) && ca_decimal_multiply(mode, power, x, &power))
+            return -1;
+        if (y > 1 && ca_decimal_multiply(mode, x, x, &x))
+            return -1;
+    }
+    *result = power;
+    return 0;
+}
+
+/**
+ * Calculate the square root of a decimal, rounded down.
+ */
+static inline int ca_decimal_square_root(const struct ca_mode *mode, ca_value_t x, ca_value_t *result)
+{
+    if (x < 0) {
+        tr("complex numbers are not supported, cannot fetch square root of negative numbers");
+        return -1;
+    }
+
+    /* the root of x scale, bit by bit from the highest one, which is
+     * below 2^62 since x scale < 2^126 */
+    unsigned __int128 n = (unsigned __int128) x * mode->decimal.scale;
+    uint64_t root = 0;
+    for (int bit = 62; bit >= 0; bit--) {
+        uint64_t candidate = root | (1ULL << bit);
+        if ((unsigned __int128) candidate * candidate <= n)
+            root = candidate;
+    }
+    *result = root;
+    return 0;
+}
+
+static inline int ca_decimal_binary(const struct ca_mode *mode, ca_operation_t op,
+                                    ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    switch (op) {
+    case CA_OP_MULTIPLY:
+        return ca_decimal_multiply(mode, x, y, result);
+    case CA_OP_DIVIDE:
+        return ca_decimal_divide(mode, x, y, result);
+    case CA_OP_POWER:
+        return ca_decimal_power(mode, x, y, result);
+    default:
+        return 1;
+    }
+}
+
+/**
+ * Apply an operation taking two values and giving one in the
+ * arithmetic of a mode.
+ *
+ * @return 0 on success, -1 on failure, 1 if the mode computes the
+ * operation like plain integers.
+ */
+static inline int ca_mode_binary(const struct ca_mode *mode, ca_operation_t op,
+                                 ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    if (mode->kind == CA_MODE_DECIMAL)
+        return ca_decimal_binary(mode, op, x, y, result);
+    return ca_modular_binary(mode, op, x, y, result);
+}
+
+/**
+ * Calculate a square root in the arithmetic of a mode.
+ *
+ * @return 0 on success, -1 on failure, 1 if the mode computes it like
+ * plain integers.
+ */
+static inline int ca_mode_square_root(const struct ca_mode *mode, ca_value_t x, ca_value_t *result)
+{
+    if (mode->kind == CA_MODE_DECIMAL)
+        return ca_decimal_square_root(mode, x, result);
+    return 1;
+}
+
+#endif /* _LIBCALC_PRIV_H_ */
\ No newline at end of file
@@ -0,0 +1,113 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_profile.h"
+
+#define N CA_OPERATION_COUNT
+
+int ca_profile_initialize(ca_profile_t *profile)
+{
+    assert(profile);
+
+    profile->allocator = ca_get_allocator();
+    profile->pairs = ca_alloc(profile->allocator, N * N * sizeof(unsigned long));
+    profile->triples = ca_alloc(profile->allocator, N * N * N * sizeof(unsigned long));
+    if (profile->pairs == NULL || profile->triples == NULL) {
+        tr("unable to create profile: %m");
+        ca_profile_cleanup(profile);
+        return -1;
+    }
+    memset(profile->pairs, 0, N * N * sizeof(unsigned long));
+    memset(profile->triples, 0, N * N * N * sizeof(unsigned long));
+    return 0;
+}
+
+void ca_profile_cleanup(ca_profile_t *profile)
+{
+    assert(profile);
+    ca_free(profile->allocator, profile->pairs, N * N * sizeof(unsigned long));
+    ca_free(profile->allocator, profile->triples, N * N * N * sizeof(unsigned long));
+    profile->pairs = NULL;
+    profile->triples = NULL;
+}
+
+/**
+ * Count an operation following the ones in history, history[1] being
+ * the last one.
+ */
+static void ca_profile_count(ca_profile_t *profile, int history[2], ca_operation_t op)
+{
+    if (history[1] >= 0)
+        profile->pairs[history[1] * N + op] += 1;
+    if (history[0] >= 0)
+        profile->triples[(history[0] * N + history[1]) * N + op] += 1;
+    history[0] = history[1];
+    history[1] = op;
+}
+
+int ca_profile_run(ca_profile_t *profile, ca_calc_t *calc, const ca_program_t *prog,
+                   const ca_value_t *vars)
+{
+    assert(profile);
+    assert(prog);
+
+    int history[2] = { -1, -1 };
+    ca_cursor_t cursor;
+    int retval;
+
+    ca_cursor_init(&cursor, vars);
+    do {
+        const ca_instruction_t *ins = prog->code + cursor.pc;
+
+        if (cursor.pc < prog->length) {
+            if (ins->code == CA_INS_OPERATE) {
+                ca_profile_count(profile, history, ins->operand);
+            } else if (ins->code == CA_INS_SUPER) {
+                const ca_superinstruction_t *super = ca_superinstructions + ins->operand;
+                for (unsigned i = 0; i < super->length; i++)
+                    ca_profile_count(profile, history, super->ops[i]);
+            } else {
+                history[0] = history[1] = -1;
+            }
+        }
+
+        retval = ca_run_budget(calc, prog, &cursor, 1);
+    } while (retval == 1);
+
+    return retval;
+}
+
+int ca_profile_save(const ca_profile_t *profile, const char *path)
+{
+    assert(profile);
+    assert(path);
+
+    FILE *out = fopen(path, "a");
+    if (out == NULL) {
+        tr("unable to open %s: %m", path);
+        return -1;
+    }
+
+    for (size_t a = 0; a < N; a++) {
+        for (size_t b = 0; b < N; b++) {
+            if (profile->pairs[a * N + b])
+                fprintf(out, "%lu %s %s\n", profile->pairs[a * N + b],
+                        ca_operation_name(a), ca_operation_name(b));
+            for (size_t c = 0; c < N; c++) {
+                unsigned long count = profile->triples[(a * N + b) * N + c];
+                if (count)
+                    fprintf(out, "%lu %s %s %s\n", count, ca_operation_name(a),
+                            ca_operation_name(b), ca_operation_name(c));
+            }
+        }
+    }
+
+    if (fclose(out)) {
+        tr("unable to write %s: %m", path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef _LIBCALC_PROFILE_H_
+#define _LIBCALC_PROFILE_H_
+
+#include "libcalc_program.h"
+
+/**
+ * How often consecutive operations run.
+ *
+ * The profiles saved by ca_profile_save are read by mksuper, which
+ * generates the superinstructions fusing the most frequent operation
+ * pairs and triples. Build the library with SUPERINSTRUCTIONS_PROFILE
+ * set to the saved profiles to use them.
+ */
+typedef struct ca_profile {
+    /** Number of runs of each pair of operations */
+    unsigned long *pairs;
+    /** Number of runs of each triple of operations */
+    unsigned long *triples;
+    /** Allocator of the counts */
+    const ca_allocator_t *allocator;
+} ca_profile_t;
+
+/**
+ * Initialize a profile.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_profile_initialize(ca_profile_t *profile) __attribute__ ((nonnull(1)));
+
+/**
+ * Cleanup a profile.
+ */
+void ca_profile_cleanup(ca_profile_t *profile) __attribute__ ((nonnull(1)));
+
+/**
+ * Run a program like ca_run, counting the operations it applies in a
+ * row.
+ *
+ * The program runs one instruction at a time, profiling is not meant
+ * for production runs.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_profile_run(ca_profile_t *profile, ca_calc_t *calc, const ca_program_t *prog,
+                   const ca_value_t *vars) __attribute__ ((nonnull(1, 2, 3)));
+
+/**
+ * Append a profile to a file.
+ *
+ * Each line holds a number of runs followed by the names of the
+ * operations, profiles of several runs can be appended to the same
+ * file.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_profile_save(const ca_profile_t *profile, const char *path) __attribute__ ((nonnull(1, 2)));
+
+#endif /* _LIBCALC_PROFILE_H_ */
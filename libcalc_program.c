@@ -0,0 +1,1141 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_program.h"
+#include "libcalc_kernels.h"
+
+/**
+ * The kind of tokens found in an expression.
+ */
+typedef enum ca_token_type {
+    CA_TOKEN_END,
+    CA_TOKEN_NUMBER,
+    CA_TOKEN_IDENTIFIER,
+    CA_TOKEN_LABEL,
+    CA_TOKEN_OPERATOR,
+    CA_TOKEN_OPEN,
+    CA_TOKEN_CLOSE
+} ca_token_type_t;
+
+/**
+ * A token of an expression.
+ */
+typedef struct ca_token {
+    ca_token_type_t type;
+    /** The text of the token */
+    const char *start;
+    size_t length;
+    /** The value of a number */
+    ca_value_t value;
+    /** The operation of an operator */
+    ca_operation_t op;
+} ca_token_t;
+
+/**
+ * A label of a rpn expression, or a jump to it.
+ */
+typedef struct ca_label {
+    const char *name;
+    size_t length;
+    /** The labelled instruction, or the jump */
+    size_t index;
+} ca_label_t;
+
+/**
+ * The compilation state.
+ */
+typedef struct ca_compiler {
+    ca_program_t *prog;
+    ca_syntax_t syntax;
+    /** Where to read the next token */
+    const char *source;
+    /** The current token */
+    ca_token_t token;
+    /** The labels defined so far */
+    ca_label_t *labels;
+    size_t label_count;
+    /** The jumps to resolve once every label is known */
+    ca_label_t *jumps;
+    size_t jump_count;
+} ca_compiler_t;
+
+/**
+ * Infix precedence of operators only available in rpn expressions.
+ */
+#define CA_RPN_ONLY -1
+
+/**
+ * The operators, longest symbols first.
+ */
+static const struct {
+    const char *symbol;
+    ca_operation_t op;
+    /** Infix precedence, 0 for functions */
+    int precedence;
+} ca_operators[] = {
+    { "sqrt", CA_OP_SQUARE_ROOT, 0 },
+    { "swap", CA_OP_SWAP, CA_RPN_ONLY },
+    { "over", CA_OP_OVER, CA_RPN_ONLY },
+    { "drop", CA_OP_DROP, CA_RPN_ONLY },
+    { "dup", CA_OP_DUPLICATE, CA_RPN_ONLY },
+    { "rot", CA_OP_ROTATE, CA_RPN_ONLY },
+    { "==", CA_OP_EQUAL, 1 },
+    { "!=", CA_OP_NOT_EQUAL, 1 },
+    { "<=", CA_OP_LESS_EQUAL, 2 },
+    { ">=", CA_OP_GREATER_EQUAL, 2 },
+    { "**", CA_OP_POWER, 6 },
+    { "<<", CA_OP_LEFT_SHIFT, 3 },
+    { ">>", CA_OP_RIGHT_SHIFT, 3 },
+    { "<", CA_OP_LESS, 2 },
+    { ">", CA_OP_GREATER, 2 },
+    { "+", CA_OP_ADD, 4 },
+    { "-", CA_OP_SUBSTRACT, 4 },
+    { "*", CA_OP_MULTIPLY, 5 },
+    { "/", CA_OP_DIVIDE, 5 },
+    { "%", CA_OP_MODULO, 5 },
+};
+
+#define CA_OPERATOR_COUNT (sizeof(ca_operators) / sizeof(ca_operators[0]))
+
+/**
+ * The jumps of rpn expressions.
+ */
+static const struct {
+    const char *keyword;
+    ca_opcode_t code;
+} ca_jumps[] = {
+    { "jmp", CA_INS_JUMP },
+    { "jz", CA_INS_JUMP_IF_ZERO },
+    { "jnz", CA_INS_JUMP_IF_NOT_ZERO },
+};
+
+#define CA_JUMP_COUNT (sizeof(ca_jumps) / sizeof(ca_jumps[0]))
+
+/**
+ * Return the infix precedence of an operation.
+ */
+static int ca_precedence(ca_operation_t op)
+{
+    for (size_t i = 0; i < CA_OPERATOR_COUNT; i++)
+        if (ca_operators[i].op == op)
+            return ca_operators[i].precedence;
+    return CA_RPN_ONLY;
+}
+
+/**
+ * Compare the current token to a word.
+ */
+static bool ca_token_is(const ca_token_t *token, const char *word)
+{
+    return strlen(word) == token->length && strncmp(token->start, word, token->length) == 0;
+}
+
+/**
+ * Read the next token.
+ *
+ * @param operand true if an operand is expected, so that a sign
+ * starts a number in infix expressions.
+ */
+static int ca_next_token(ca_compiler_t *c, bool operand)
+{
+    const char *s = c->source;
+    ca_token_t *token = &c->token;
+
+    while (isspace((unsigned char) *s))
+        s++;
+
+    token->start = s;
+
+    if (*s == '\0') {
+        token->type = CA_TOKEN_END;
+        token->length = 0;
+        return 0;
+    }
+
+    bool sign = (*s == '-' || *s == '+') && isdigit((unsigned char) s[1]);
+    if (isdigit((unsigned char) *s) || (sign && (operand || c->syntax == CA_SYNTAX_RPN))) {
+        char *end;
+        errno = 0;
+        token->value = strtol(s, &end, 10);
+        if (errno == ERANGE) {
+            tr("integer is out of range: %.*s", (int) (end - s), s);
+            return -1;
+        }
+        token->type = CA_TOKEN_NUMBER;
+        token->length = end - s;
+        c->source = end;
+        return 0;
+    }
+
+    if (isalpha((unsigned char) *s) || *s == '_') {
+        const char *end = s;
+        while (isalnum((unsigned char) *end) || *end == '_')
+            end++;
+        token->type = CA_TOKEN_IDENTIFIER;
+        token->length = end - s;
+        c->source = end;
+        if (*end == ':') {
+            token->type = CA_TOKEN_LABEL;
+            c->source = end + 1;
+            return 0;
+        }
+    } else if (*s == '(' || *s == ')') {
+        token->type = *s == '(' ? CA_TOKEN_OPEN : CA_TOKEN_CLOSE;
+        token->length = 1;
+        c->source = s + 1;
+        return 0;
+    } else {
+        token->type = CA_TOKEN_OPERATOR;
+        token->length = 0;
+    }
+
+    for (size_t i = 0; i < CA_OPERATOR_COUNT; i++) {
+        size_t length = strlen(ca_operators[i].symbol);
+        if (strncmp(s, ca_operators[i].symbol, length) != 0)
+            continue;
+        if (token->type == CA_TOKEN_IDENTIFIER && token->length != length)
+            continue;
+        token->type = CA_TOKEN_OPERATOR;
+        token->op = ca_operators[i].op;
+        token->length = length;
+        c->source = s + length;
+        return 0;
+    }
+
+    if (token->length == 0) {
+        tr("unexpected character '%c'", *s);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Append an instruction to the program.
+ */
+static int ca_emit(ca_compiler_t *c, ca_opcode_t code, ca_value_t operand)
+{
+    ca_program_t *prog = c->prog;
+
+    if (prog->length == prog->capacity) {
+        size_t capacity = prog->capacity ? prog->capacity * 2 : 16;
+        ca_instruction_t *code = ca_realloc(prog->allocator, prog->code, prog->capacity * sizeof(ca_instruction_t),
+                                            capacity * sizeof(ca_instruction_t));
+        if (code == NULL) {
+            tr("unable to grow program: %m");
+            return -1;
+        }
+        prog->code = code;
+        prog->capacity = capacity;
+    }
+
+    prog->code[prog->length].code = code;
+    prog->code[prog->length].operand = operand;
+    prog->length += 1;
+    return 0;
+}
+
+/**
+ * Emit the load of the variable named by the current token, creating
+ * its slot on first use.
+ */
+static int ca_emit_variable(ca_compiler_t *c)
+{
+    ca_program_t *prog = c->prog;
+    size_t slot;
+
+    for (slot = 0; slot < prog->variable_count; slot++)
+        if (ca_token_is(&c->token, prog->variables[slot]))
+            break;
+
+    if (slot == prog->variable_count) {
+        char *name = ca_alloc(prog->allocator, c->token.length + 1);
+        if (name == NULL) {
+            tr("unable to copy variable name: %m");
+            return -1;
+        }
+        memcpy(name, c->token.start, c->token.length);
+        name[c->token.length] = '\0';
+
+        char **variables = ca_realloc(prog->allocator, prog->variables, slot * sizeof(char *),
+                                     (slot + 1) * sizeof(char *));
+        if (variables == NULL) {
+            tr("unable to grow variables: %m");
+            ca_free(prog->allocator, name, c->token.length + 1);
+            return -1;
+        }
+        prog->variables = variables;
+        prog->variables[slot] = name;
+        prog->variable_count += 1;
+    }
+
+    return ca_emit(c, CA_INS_LOAD, slot);
+}
+
+/**
+ * Record the current token as a label of the next instruction, or as
+ * the target of the next instruction when it is a jump.
+ */
+static int ca_add_label(const ca_allocator_t *allocator, ca_label_t **labels, size_t *count,
+                        const ca_token_t *token, size_t index)
+{
+    ca_label_t *grown = ca_realloc(allocator, *labels, *count * sizeof(ca_label_t),
+                                   (*count + 1) * sizeof(ca_label_t));
+    if (grown == NULL) {
+        tr("unable to grow labels: %m");
+        return -1;
+    }
+    *labels = grown;
+    grown[*count].name = token->start;
+    grown[*count].length = token->length;
+    grown[*count].index = index;
+    *count += 1;
+    return 0;
+}
+
+/**
+ * Set the targets of the jumps once every label is known.
+ */
+static int ca_resolve_jumps(ca_compiler_t *c)
+{
+    for (size_t i = 0; i < c->jump_count; i++) {
+        const ca_label_t *jump = c->jumps + i;
+        size_t l;
+
+        for (l = 0; l < c->label_count; l++)
+            if (c->labels[l].length == jump->length &&
+                strncmp(c->labels[l].name, jump->name, jump->length) == 0)
+                break;
+
+        if (l == c->label_count) {
+            tr("undefined label %.*s", (int) jump->length, jump->name);
+            return -1;
+        }
+        c->prog->code[jump->index].operand = c->labels[l].index;
+    }
+    return 0;
+}
+
+static int ca_compile_rpn(ca_compiler_t *c)
+{
+    for (;;) {
+        if (ca_next_token(c, true))
+            return -1;
+
+        switch (c->token.type) {
+        case CA_TOKEN_END:
+            return ca_resolve_jumps(c);
+        case CA_TOKEN_NUMBER:
+            if (ca_emit(c, CA_INS_PUSH, c->token.value))
+                return -1;
+            break;
+        case CA_TOKEN_IDENTIFIER: {
+            size_t j;
+            for (j = 0; j < CA_JUMP_COUNT; j++)
+                if (ca_token_is(&c->token, ca_jumps[j].keyword))
+                    break;
+            if (j == CA_JUMP_COUNT) {
+                if (ca_emit_variable(c))
+                    return -1;
+                break;
+            }
+            if (ca_next_token(c, false))
+                return -1;
+            if (c->token.type != CA_TOKEN_IDENTIFIER) {
+                tr("%s should be followed by a label", ca_jumps[j].keyword);
+                return -1;
+            }
+            if (ca_add_label(c->prog->allocator, &c->jumps, &c->jump_count, &c->token, c->prog->length) ||
+                ca_emit(c, ca_jumps[j].code, 0))
+                return -1;
+            break;
+        }
+        case CA_TOKEN_LABEL:
+            if (ca_add_label(c->prog->allocator, &c->labels, &c->label_count, &c->token, c->prog->length))
+                return -1;
+            break;
+        case CA_TOKEN_OPERATOR:
+            if (ca_emit(c, CA_INS_OPERATE, c->token.op))
+                return -1;
+            break;
+        default:
+            tr("parenthesis are not allowed in rpn expressions");
+            return -1;
+        }
+    }
+}
+
+static int ca_compile_infix(ca_compiler_t *c, int precedence);
+
+/**
+ * Compile an operand of an infix expression, reading the token
+ * following it.
+ */
+static int ca_compile_operand(ca_compiler_t *c)
+{
+    if (ca_next_token(c, true))
+        return -1;
+
+    switch (c->token.type) {
+    case CA_TOKEN_NUMBER:
+        if (ca_emit(c, CA_INS_PUSH, c->token.value))
+            return -1;
+        break;
+    case CA_TOKEN_IDENTIFIER:
+        if (ca_emit_variable(c))
+            return -1;
+        break;
+    case CA_TOKEN_OPEN:
+        if (ca_compile_infix(c, 1))
+            return -1;
+        if (c->token.type != CA_TOKEN_CLOSE) {
+            tr("missing closing parenthesis");
+            return -1;
+        }
+        break;
+    case CA_TOKEN_OPERATOR:
+        if (c->token.op == CA_OP_SUBSTRACT) {
+            /* negate by substracting from 0 */
+            if (ca_emit(c, CA_INS_PUSH, 0) || ca_compile_operand(c))
+                return -1;
+            return ca_emit(c, CA_INS_OPERATE, CA_OP_SUBSTRACT);
+        }
+        if (ca_precedence(c->token.op) == 0) {
+            ca_operation_t op = c->token.op;
+            if (ca_next_token(c, false))
+                return -1;
+            if (c->token.type != CA_TOKEN_OPEN) {
+                tr("function call needs parenthesis");
+                return -1;
+            }
+            if (ca_compile_infix(c, 1))
+                return -1;
+            if (c->token.type != CA_TOKEN_CLOSE) {
+                tr("missing closing parenthesis");
+                return -1;
+            }
+            if (ca_emit(c, CA_INS_OPERATE, op))
+                return -1;
+            break;
+        }
+        /* fall through */
+    default:
+        tr("expected an operand at '%s'", c->token.start);
+        return -1;
+    }
+
+    return ca_next_token(c, false);
+}
+
+/**
+ * Compile an infix expression by precedence climbing, stopping at the
+ * first token that is not an operator of at least the given
+ * precedence.
+ */
+static int ca_compile_infix(ca_compiler_t *c, int precedence)
+{
+    if (ca_compile_operand(c))
+        return -1;
+
+    while (c->token.type == CA_TOKEN_OPERATOR && ca_precedence(c->token.op) >= precedence) {
+        ca_operation_t op = c->token.op;
+        /* powers are right associative */
+        if (ca_compile_infix(c, ca_precedence(op) + (op != CA_OP_POWER)))
+            return -1;
+        if (ca_emit(c, CA_INS_OPERATE, op))
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Record the stack height on entry of an instruction, checking that
+ * every path reaching it agrees on it.
+ */
+static int ca_verify_flow(size_t *heights, size_t *pending, size_t *count, size_t pc, size_t height)
+{
+    if (heights[pc] == SIZE_MAX) {
+        heights[pc] = height;
+        pending[(*count)++] = pc;
+    } else if (heights[pc] != height) {
+        tr("stack holds %zu or %zu values at instruction %zu", heights[pc], height, pc);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check that running the program never underflows the stack and leaves
+ * exactly one value on it, and compute the depth it needs.
+ */
+static int ca_program_verify(ca_program_t *prog)
+{
+    size_t length = prog->length;
+    size_t *heights = ca_alloc(prog->allocator, (length + 1) * sizeof(size_t));
+    size_t *pending = ca_alloc(prog->allocator, (length + 1) * sizeof(size_t));
+    size_t count = 0;
+    int retval = -1;
+
+    if (heights == NULL || pending == NULL) {
+        tr("unable to verify program: %m");
+        goto out;
+    }
+
+    for (size_t pc = 0; pc <= length; pc++)
+        heights[pc] = SIZE_MAX;
+
+    prog->depth = 0;
+    if (ca_verify_flow(heights, pending, &count, 0, 0))
+        goto out;
+
+    /* follow every path once, each instruction has a single height */
+    while (count) {
+        size_t pc = pending[--count];
+        size_t height = heights[pc];
+        size_t needed = 0, next = pc + 1;
+        bool branch = false, fallthrough = true;
+
+        if (pc == length)
+            continue;
+
+        const ca_instruction_t *ins = prog->code + pc;
+        switch (ins->code) {
+        case CA_INS_PUSH:
+        case CA_INS_LOAD:
+            if (ins->code == CA_INS_LOAD && (size_t) ins->operand >= prog->variable_count) {
+                tr("instruction %zu loads an unknown variable", pc);
+                goto out;
+            }
+            height += 1;
+            break;
+        case CA_INS_OPERATE:
+            if ((size_t) ins->operand >= CA_OPERATION_COUNT) {
+                tr("instruction %zu applies an unknown operation", pc);
+                goto out;
+            }
+            needed = ca_operation_operands[ins->operand];
+            if (height >= needed)
+                height += ca_operation_results[ins->operand] - needed;
+            break;
+        case CA_INS_DIVIDE_CONST:
+        case CA_INS_MODULO_CONST:
+            if ((size_t) ins->operand >= prog->divider_count) {
+                tr("instruction %zu uses an unknown divider", pc);
+                goto out;
+            }
+            needed = 1;
+            break;
+        case CA_INS_SUPER:
+            if ((size_t) ins->operand >= ca_superinstruction_count) {
+                tr("instruction %zu uses an unknown superinstruction", pc);
+                goto out;
+            }
+            needed = ca_superinstructions[ins->operand].operands;
+            if (height >= needed)
+                height -= needed - 1;
+            break;
+        case CA_INS_JUMP:
+            fallthrough = false;
+            branch = true;
+            break;
+        case CA_INS_JUMP_IF_ZERO:
+        case CA_INS_JUMP_IF_NOT_ZERO:
+            needed = 1;
+            height -= height >= needed;
+            branch = true;
+            break;
+        default:
+            tr("instruction %zu is unknown", pc);
+            goto out;
+        }
+
+        if (heights[pc] < needed) {
+            tr("instruction %zu needs %zu operand, stack holds %zu", pc, needed, heights[pc]);
+            goto out;
+        }
+        if (branch && (ins->operand < 0 || (size_t) ins->operand > length)) {
+            tr("instruction %zu jumps out of the program", pc);
+            goto out;
+        }
+        if (height > prog->depth)
+            prog->depth = height;
+
+        if (fallthrough && ca_verify_flow(heights, pending, &count, next, height))
+            goto out;
+        if (branch && ca_verify_flow(heights, pending, &count, ins->operand, height))
+            goto out;
+    }
+
+    if (heights[length] == SIZE_MAX) {
+        tr("program never reaches its end");
+        goto out;
+    }
+    if (heights[length] != 1) {
+        tr("expression should leave one value on the stack, leaves %zu", heights[length]);
+        goto out;
+    }
+    retval = 0;
+
+out:
+    ca_free(prog->allocator, pending, (length + 1) * sizeof(size_t));
+    ca_free(prog->allocator, heights, (length + 1) * sizeof(size_t));
+    return retval;
+}
+
+/**
+ * Return the index of the divider of a constant, adding it if needed.
+ */
+static long ca_program_divider(ca_program_t *prog, ca_value_t divisor)
+{
+    size_t i;
+
+    for (i = 0; i < prog->divider_count; i++)
+        if (prog->dividers[i].divisor == divisor)
+            return i;
+
+    ca_divider_t divider;
+    if (ca_divider_init(&divider, divisor))
+        return -1;
+
+    ca_divider_t *dividers = ca_realloc(prog->allocator, prog->dividers, i * sizeof(ca_divider_t),
+                                        (i + 1) * sizeof(ca_divider_t));
+    if (dividers == NULL) {
+        tr("unable to grow dividers: %m");
+        return -1;
+    }
+    prog->dividers = dividers;
+    prog->dividers[i] = divider;
+    prog->divider_count += 1;
+    return i;
+}
+
+/**
+ * Return the longest superinstruction fusing the operations starting
+ * at an instruction, -1 if there is none.
+ */
+static long ca_program_superinstruction(const ca_program_t *prog, size_t index, const bool *targets)
+{
+    long found = -1;
+
+    for (size_t i = 0; i < ca_superinstruction_count; i++) {
+        const ca_superinstruction_t *super = ca_superinstructions + i;
+        unsigned k;
+
+        if (index + super->length > prog->length)
+            continue;
+        if (found >= 0 && ca_superinstructions[found].length >= super->length)
+            continue;
+
+        for (k = 0; k < super->length; k++) {
+            const ca_instruction_t *ins = prog->code + index + k;
+            if (ins->code != CA_INS_OPERATE || ins->operand != super->ops[k] || (k && targets[index + k]))
+                break;
+        }
+        if (k == super->length)
+            found = i;
+    }
+    return found;
+}
+
+/**
+ * Return true if the instruction is a jump.
+ */
+static inline bool ca_is_jump(const ca_instruction_t *ins)
+{
+    return ins->code == CA_INS_JUMP || ins->code == CA_INS_JUMP_IF_ZERO || ins->code == CA_INS_JUMP_IF_NOT_ZERO;
+}
+
+/**
+ * Replace the divisions and modulos by a pushed constant and the
+ * operations fused by superinstructions, keeping the jumps on the same
+ * instructions.
+ */
+static int ca_program_optimize(ca_program_t *prog)
+{
+    size_t original = prog->length + 1;
+    size_t *moved = ca_alloc(prog->allocator, original * sizeof(size_t));
+    bool *targets = ca_alloc(prog->allocator, original * sizeof(bool));
+    size_t length = 0;
+    int retval = -1;
+
+    if (moved == NULL || targets == NULL) {
+        tr("unable to optimize program: %m");
+        goto out;
+    }
+    memset(targets, 0, original * sizeof(bool));
+
+    for (size_t i = 0; i < prog->length; i++)
+        if (ca_is_jump(prog->code + i))
+            targets[prog->code[i].operand] = true;
+
+    for (size_t i = 0; i < prog->length; i++) {
+        ca_instruction_t *ins = prog->code + i;
+
+        moved[i] = length;
+        if (i + 1 < prog->length && !targets[i + 1] &&
+            ins[0].code == CA_INS_PUSH && ins[0].operand != 0 && ins[1].code == CA_INS_OPERATE &&
+            (ins[1].operand == CA_OP_DIVIDE || ins[1].operand == CA_OP_MODULO)) {
+            long divider = ca_program_divider(prog, ins[0].operand);
+            if (divider < 0)
+                goto out;
+            prog->code[length].code = ins[1].operand == CA_OP_DIVIDE ? CA_INS_DIVIDE_CONST : CA_INS_MODULO_CONST;
+            prog->code[length].operand = divider;
+            length += 1;
+            i += 1;
+            continue;
+        }
+
+        long super = ca_program_superinstruction(prog, i, targets);
+        if (super >= 0) {
+            prog->code[length].code = CA_INS_SUPER;
+            prog->code[length].operand = super;
+            length += 1;
+            i += ca_superinstructions[super].length - 1;
+            continue;
+        }
+
+        prog->code[length++] = *ins;
+    }
+    moved[prog->length] = length;
+
+    for (size_t i = 0; i < length; i++)
+        if (ca_is_jump(prog->code + i))
+            prog->code[i].operand = moved[prog->code[i].operand];
+
+    prog->length = length;
+    retval = 0;
+
+out:
+    ca_free(prog->allocator, targets, original * sizeof(bool));
+    ca_free(prog->allocator, moved, original * sizeof(size_t));
+    return retval;
+}
+
+int ca_compile(ca_program_t *prog, const char *source, ca_syntax_t syntax)
+{
+    return ca_compile_allocator(prog, source, syntax, NULL);
+}
+
+int ca_compile_allocator(ca_program_t *prog, const char *source, ca_syntax_t syntax,
+                         const ca_allocator_t *allocator)
+{
+    assert(prog);
+    assert(source);
+
+    memset(prog, 0, sizeof(*prog));
+    prog->allocator = allocator ? allocator : ca_get_allocator();
+
+    ca_compiler_t c = {
+        .prog = prog,
+        .syntax = syntax,
+        .source = source,
+    };
+
+    int retval;
+    if (syntax == CA_SYNTAX_RPN) {
+        retval = ca_compile_rpn(&c);
+    } else {
+        retval = ca_compile_infix(&c, 1);
+        if (retval == 0 && c.token.type != CA_TOKEN_END) {
+            tr("unexpected token at '%s'", c.token.start);
+            retval = -1;
+        }
+    }
+    ca_free(prog->allocator, c.labels, c.label_count * sizeof(ca_label_t));
+    ca_free(prog->allocator, c.jumps, c.jump_count * sizeof(ca_label_t));
+
+    if (retval == 0)
+        retval = ca_program_verify(prog);
+
+    if (retval == 0)
+        retval = ca_program_optimize(prog);
+
+    if (retval == 0)
+        retval = ca_initialize_allocator(&prog->scratch, prog->depth, prog->allocator);
+
+    if (retval) {
+        ca_program_cleanup(prog);
+        return -1;
+    }
+    return 0;
+}
+
+void ca_program_cleanup(ca_program_t *prog)
+{
+    assert(prog);
+
+    for (size_t i = 0; i < prog->variable_count; i++)
+        ca_free(prog->allocator, prog->variables[i], strlen(prog->variables[i]) + 1);
+    ca_free(prog->allocator, prog->variables, prog->variable_count * sizeof(char *));
+    ca_free(prog->allocator, prog->dividers, prog->divider_count * sizeof(ca_divider_t));
+    ca_free(prog->allocator, prog->code, prog->capacity * sizeof(ca_instruction_t));
+    if (prog->scratch.stack)
+        ca_cleanup(&prog->scratch);
+    memset(prog, 0, sizeof(*prog));
+}
+
+int ca_program_variable(const ca_program_t *prog, const char *name)
+{
+    assert(prog);
+    assert(name);
+
+    for (size_t i = 0; i < prog->variable_count; i++)
+        if (strcmp(prog->variables[i], name) == 0)
+            return i;
+    return -1;
+}
+
+/**
+ * Divide the top value by a constant.
+ */
+static int ca_op_divide_by(ca_calc_t *calc, const ca_divider_t *divider)
+{
+    ca_value_t *x = calc->stack + calc->top - 1;
+
+    if (divider->divisor == -1 && *x == CA_VALUE_MIN) {
+        tr("division would overflow");
+        return -1;
+    }
+
+    *x = ca_divider_divide(divider, *x);
+    return 0;
+}
+
+/**
+ * Calculate the modulo of the top value by a constant.
+ */
+static int ca_op_modulo_by(ca_calc_t *calc, const ca_divider_t *divider)
+{
+    ca_value_t *x = calc->stack + calc->top - 1;
+
+    *x = ca_divider_modulo(divider, *x);
+    return 0;
+}
+
+/**
+ * Apply an operation of a constant to the top value in the arithmetic
+ * of the mode of the context.
+ *
+ * @return 1 if the mode computes it like plain integers.
+ */
+static int ca_op_mode_by(ca_calc_t *calc, ca_operation_t op, const ca_divider_t *divider)
+{
+    ca_value_t *x = calc->stack + calc->top - 1;
+    return ca_mode_binary(calc->mode, op, *x, divider->divisor, x);
+}
+
+/**
+ * Apply the operations of a superinstruction.
+ */
+static int ca_op_super(ca_calc_t *calc, const ca_superinstruction_t *super)
+{
+    /* the fused operations compute with plain integers */
+    if (calc->mode) {
+        for (unsigned i = 0; i < super->length; i++)
+            if (ca_operate(calc, super->ops[i]))
+                return -1;
+        return 0;
+    }
+
+    if (super->run(calc) == 0)
+        return 0;
+
+    /* the fused operations leave the stack untouched on failure, apply
+     * them one by one to fail like them */
+    for (unsigned i = 0; i < super->length; i++)
+        if (ca_operations[super->ops[i]](calc))
+            return -1;
+    return 0;
+}
+
+/**
+ * Run the instructions of a program on an eager context.
+ */
+static int ca_run_steps(ca_calc_t *calc, const ca_program_t *prog, ca_cursor_t *cursor, size_t max_steps)
+{
+    if (cursor->pc == 0 && ca_space_left(calc) < prog->depth) {
+        tr("stack should have %zu space left", prog->depth);
+        return -1;
+    }
+
+    const ca_value_t *vars = cursor->vars;
+    const ca_instruction_t *ins = prog->code + cursor->pc, *end = prog->code + prog->length;
+    int retval;
+
+    /* the program was verified at compilation, only the operations
+     * themselves may fail */
+    for (; max_steps && ins < end; max_steps--) {
+        switch (ins->code) {
+        case CA_INS_PUSH:
+            calc->stack[calc->top++] = ins->operand;
+            break;
+        case CA_INS_LOAD:
+            calc->stack[calc->top++] = vars[ins->operand];
+            break;
+        case CA_INS_OPERATE:
+            if (calc->mode ? ca_operate(calc, ins->operand) : ca_operations[ins->operand](calc))
+                goto failure;
+            break;
+        case CA_INS_DIVIDE_CONST:
+            if (calc->mode && (retval = ca_op_mode_by(calc, CA_OP_DIVIDE, prog->dividers + ins->operand)) <= 0) {
+                if (retval)
+                    goto failure;
+            } else if (ca_op_divide_by(calc, prog->dividers + ins->operand)) {
+                goto failure;
+            }
+            break;
+        case CA_INS_MODULO_CONST:
+            if (calc->mode && (retval = ca_op_mode_by(calc, CA_OP_MODULO, prog->dividers + ins->operand)) <= 0) {
+                if (retval)
+                    goto failure;
+            } else if (ca_op_modulo_by(calc, prog->dividers + ins->operand)) {
+                goto failure;
+            }
+            break;
+        case CA_INS_SUPER:
+            if (ca_op_super(calc, ca_superinstructions + ins->operand))
+                goto failure;
+            break;
+        case CA_INS_JUMP:
+            ins = prog->code + ins->operand;
+            continue;
+        case CA_INS_JUMP_IF_ZERO:
+            if (calc->stack[--calc->top] == 0) {
+                ins = prog->code + ins->operand;
+                continue;
+            }
+            break;
+        case CA_INS_JUMP_IF_NOT_ZERO:
+            if (calc->stack[--calc->top] != 0) {
+                ins = prog->code + ins->operand;
+                continue;
+            }
+            break;
+        }
+        ins++;
+    }
+
+    cursor->pc = ins - prog->code;
+    return cursor->pc < prog->length ? 1 : 0;
+
+failure:
+    cursor->pc = ins - prog->code;
+    return -1;
+}
+
+int ca_run_budget(ca_calc_t *calc, const ca_program_t *prog, ca_cursor_t *cursor, size_t max_steps)
+{
+    assert_calc(calc);
+    assert(prog);
+    assert(cursor);
+    assert(cursor->vars || prog->variable_count == 0);
+    assert(cursor->pc <= prog->length);
+
+    if (calc->lazy == NULL)
+        return ca_run_steps(calc, prog, cursor, max_steps);
+
+    /* the operations of the program are applied immediately, after the
+     * deferred ones */
+    struct ca_lazy *lazy = calc->lazy;
+    if (ca_flush(calc))
+        return -1;
+    calc->lazy = NULL;
+    int retval = ca_run_steps(calc, prog, cursor, max_steps);
+    calc->lazy = lazy;
+    return retval;
+}
+
+int ca_run(ca_calc_t *calc, const ca_program_t *prog, const ca_value_t *vars)
+{
+    ca_cursor_t cursor;
+
+    ca_cursor_init(&cursor, vars);
+    return ca_run_budget(calc, prog, &cursor, SIZE_MAX);
+}
+
+int ca_eval(ca_program_t *prog, const ca_value_t *vars, size_t count, ca_value_t *result)
+{
+    assert(prog);
+    assert(result);
+
+    if (count != prog->variable_count) {
+        tr("program has %zu variables, got %zu values", prog->variable_count, count);
+        return -1;
+    }
+
+    prog->scratch.top = 0;
+    if (ca_run(&prog->scratch, prog, vars))
+        return -1;
+    *result = ca_pop(&prog->scratch);
+    return 0;
+}
+
+/**
+ * Apply an operation to the values of a block on the stack, each level
+ * of the stack holding the values of the rows in its own array.
+ */
+static void ca_block_operate(ca_value_t **levels, size_t *top, ca_operation_t op, size_t count,
+                             unsigned char *failed)
+{
+    ca_value_t **stack = levels + *top, *t;
+
+    switch (op) {
+    case CA_OP_DUPLICATE:
+        memcpy(stack[0], stack[-1], count * sizeof(ca_value_t));
+        break;
+    case CA_OP_OVER:
+        memcpy(stack[0], stack[-2], count * sizeof(ca_value_t));
+        break;
+    case CA_OP_SWAP:
+        t = stack[-1];
+        stack[-1] = stack[-2];
+        stack[-2] = t;
+        break;
+    case CA_OP_ROTATE:
+        t = stack[-3];
+        stack[-3] = stack[-2];
+        stack[-2] = stack[-1];
+        stack[-1] = t;
+        break;
+    case CA_OP_DROP:
+        break;
+    case CA_OP_SQUARE_ROOT:
+        ca_operate_array(op, stack[-1], NULL, count, failed);
+        break;
+    default:
+        ca_operate_array(op, stack[-2], stack[-1], count, failed);
+        break;
+    }
+    *top += ca_operation_results[op] - ca_operation_operands[op];
+}
+
+int ca_program_has_jumps(const ca_program_t *prog)
+{
+    assert(prog);
+
+    for (size_t pc = 0; pc < prog->length; pc++) {
+        ca_opcode_t code = prog->code[pc].code;
+        if (code == CA_INS_JUMP || code == CA_INS_JUMP_IF_ZERO || code == CA_INS_JUMP_IF_NOT_ZERO)
+            return 1;
+    }
+    return 0;
+}
+
+size_t ca_eval_block(const ca_program_t *prog, const ca_value_t *vars, size_t slot_stride, size_t row_stride,
+                     size_t count, ca_value_t *stack, unsigned char *failed, ca_value_t *results)
+{
+    assert(prog);
+    assert(stack);
+    assert(failed);
+    assert(results);
+    assert(count <= CA_EVAL_BLOCK);
+    assert(!ca_program_has_jumps(prog));
+
+    ca_value_t *levels[prog->depth];
+    size_t top = 0, failures = 0;
+
+    for (size_t i = 0; i < prog->depth; i++)
+        levels[i] = stack + i * CA_EVAL_BLOCK;
+    memset(failed, 0, count);
+
+    for (size_t pc = 0; pc < prog->length; pc++) {
+        const ca_instruction_t *ins = prog->code + pc;
+        ca_value_t *x = top ? levels[top - 1] : NULL;
+
+        switch (ins->code) {
+        case CA_INS_PUSH:
+            x = levels[top++];
+            for (size_t i = 0; i < count; i++)
+                x[i] = ins->operand;
+            break;
+        case CA_INS_LOAD: {
+            const ca_value_t *slot = vars + ins->operand * slot_stride;
+            x = levels[top++];
+            if (row_stride == 1) {
+                memcpy(x, slot, count * sizeof(ca_value_t));
+            } else {
+                for (size_t i = 0; i < count; i++)
+                    x[i] = slot[i * row_stride];
+            }
+            break;
+        }
+        case CA_INS_OPERATE:
+            ca_block_operate(levels, &top, ins->operand, count, failed);
+            break;
+        case CA_INS_DIVIDE_CONST: {
+            const ca_divider_t *divider = prog->dividers + ins->operand;
+            if (divider->divisor == -1)
+                for (size_t i = 0; i < count; i++)
+                    failed[i] |= x[i] == CA_VALUE_MIN;
+            for (size_t i = 0; i < count; i++)
+                x[i] = ca_divider_divide(divider, x[i]);
+            break;
+        }
+        case CA_INS_MODULO_CONST:
+            for (size_t i = 0; i < count; i++)
+                x[i] = ca_divider_modulo(prog->dividers + ins->operand, x[i]);
+            break;
+        case CA_INS_SUPER: {
+            const ca_superinstruction_t *super = ca_superinstructions + ins->operand;
+            for (unsigned i = 0; i < super->length; i++)
+                ca_block_operate(levels, &top, super->ops[i], count, failed);
+            break;
+        }
+        default:
+            /* no jumps in the programs evaluated by blocks */
+            assert(0);
+        }
+    }
+
+    assert(top == 1);
+    for (size_t i = 0; i < count; i++) {
+        failures += failed[i];
+        if (!failed[i])
+            results[i] = levels[0][i];
+    }
+    return failures;
+}
+
+int ca_eval_many(ca_program_t *prog, const ca_value_t *vars, size_t count,
+                 ca_value_t *results, int *status)
+{
+    assert(prog);
+    assert(results);
+
+    size_t length = prog->depth * CA_EVAL_BLOCK * sizeof(ca_value_t);
+    ca_value_t *stack = ca_program_has_jumps(prog) ? NULL : ca_alloc(prog->allocator, length);
+    size_t failures = 0;
+
+    if (stack == NULL) {
+        /* the instructions of programs with jumps depend on the values,
+         * run them row by row */
+        for (size_t i = 0; i < count; i++) {
+            prog->scratch.top = 0;
+            int s = ca_run(&prog->scratch, prog, vars + i * prog->variable_count);
+            if (s == 0)
+                results[i] = ca_pop(&prog->scratch);
+            if (status)
+                status[i] = s;
+            failures += s != 0;
+        }
+        return failures ? -1 : 0;
+    }
+
+    unsigned char failed[CA_EVAL_BLOCK];
+    for (size_t first = 0; first < count; first += CA_EVAL_BLOCK) {
+        size_t n = count - first < CA_EVAL_BLOCK ? count - first : CA_EVAL_BLOCK;
+        failures += ca_eval_block(prog, vars + first * prog->variable_count, 1, prog->variable_count, n,
+                                  stack, failed, results + first);
+        if (status)
+            for (size_t i = 0; i < n; i++)
+                status[first + i] = failed[i] ? -1 : 0;
+    }
+    ca_free(prog->allocator, stack, length);
+    return failures ? -1 : 0;
+}
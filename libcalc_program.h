@@ -0,0 +1,269 @@
+#ifndef _LIBCALC_PROGRAM_H_
+#define _LIBCALC_PROGRAM_H_
+
+#include "libcalc.h"
+#include "libcalc_divide.h"
+
+/**
+ * The syntax of an expression to compile.
+ */
+typedef enum ca_syntax {
+    /** Reverse polish notation, as typed in the calculator: "a b + 2 *" */
+    CA_SYNTAX_RPN,
+    /** Usual infix notation: "(a + b) * 2" */
+    CA_SYNTAX_INFIX
+} ca_syntax_t;
+
+/**
+ * The instructions of a compiled program.
+ */
+typedef enum ca_opcode {
+    /** Push the operand on the stack */
+    CA_INS_PUSH,
+    /** Push the variable slot designated by the operand on the stack */
+    CA_INS_LOAD,
+    /** Apply the ca_operation_t designated by the operand */
+    CA_INS_OPERATE,
+    /** Divide the top value by the divider designated by the operand */
+    CA_INS_DIVIDE_CONST,
+    /** Modulo of the top value by the divider designated by the operand */
+    CA_INS_MODULO_CONST,
+    /** Continue at the instruction designated by the operand */
+    CA_INS_JUMP,
+    /** Pop a value, jump if it is 0 */
+    CA_INS_JUMP_IF_ZERO,
+    /** Pop a value, jump if it is not 0 */
+    CA_INS_JUMP_IF_NOT_ZERO,
+    /** Apply the consecutive operations of the superinstruction
+     * designated by the operand */
+    CA_INS_SUPER
+} ca_opcode_t;
+
+/**
+ * A compiled instruction.
+ */
+typedef struct ca_instruction {
+    /** The instruction */
+    ca_opcode_t code;
+    /** Its operand */
+    ca_value_t operand;
+} ca_instruction_t;
+
+/**
+ * A compiled expression.
+ */
+typedef struct ca_program {
+    /** The instructions */
+    ca_instruction_t *code;
+    /** Number of instructions */
+    size_t length;
+    /** Number of allocated instructions */
+    size_t capacity;
+    /** Names of the variable slots */
+    char **variables;
+    /** Number of variable slots */
+    size_t variable_count;
+    /** Precomputed constant divisors */
+    ca_divider_t *dividers;
+    /** Number of constant divisors */
+    size_t divider_count;
+    /** Maximum number of values the program holds on the stack */
+    size_t depth;
+    /** Context used by ca_eval and ca_eval_many, shared by their callers */
+    ca_calc_t scratch;
+    /** Allocator of the program */
+    const ca_allocator_t *allocator;
+} ca_program_t;
+
+/**
+ * The position of a suspended program run.
+ */
+typedef struct ca_cursor {
+    /** Index of the next instruction to run */
+    size_t pc;
+    /** The values of the variable slots */
+    const ca_value_t *vars;
+} ca_cursor_t;
+
+/**
+ * Compile an expression.
+ *
+ * Identifiers in the expression are variable slots, numbered in order
+ * of first appearance. The expression is validated once so that
+ * running the program never underflows the stack and leaves exactly
+ * one value on it. Divisions and modulos by a constant are replaced by
+ * a multiplication by a precomputed magic number, and the most frequent
+ * consecutive operations by a superinstruction, see ca_profile_t.
+ *
+ * Rpn expressions may also use the stack operations dup, swap, over,
+ * rot and drop, and jumps: "name:" labels the next instruction, "jmp
+ * name" jumps to it, "jz name" and "jnz name" pop a value and jump if
+ * it is zero or not zero. Every path reaching a label must leave the
+ * same number of values on the stack. Both syntaxes support the
+ * comparisons ==, !=, <, <=, > and >=, which give 1 or 0.
+ *
+ * @param prog the program to initialize
+ * @param source the expression
+ * @param syntax the syntax of the expression
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_compile(ca_program_t *prog, const char *source, ca_syntax_t syntax) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Compile an expression like ca_compile, allocating the program with
+ * an allocator.
+ *
+ * @param allocator the allocator of the program, NULL for the default one.
+ */
+int ca_compile_allocator(ca_program_t *prog, const char *source, ca_syntax_t syntax,
+                         const ca_allocator_t *allocator) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Cleanup a compiled program.
+ */
+void ca_program_cleanup(ca_program_t *prog) __attribute__ ((nonnull(1)));
+
+/**
+ * Return the slot of a variable.
+ *
+ * @return the index of the slot in the bindings, -1 if the program
+ * does not use the variable.
+ */
+int ca_program_variable(const ca_program_t *prog, const char *name) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Run a program on a context.
+ *
+ * The result is pushed on the stack of the context. On failure, the
+ * stack is left as it was when the failing operation was applied. A
+ * program looping forever never returns, use ca_run_budget to bound
+ * the run.
+ *
+ * @param calc the library context, must have prog->depth space left
+ * @param prog the program
+ * @param vars the values of the variable slots
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_run(ca_calc_t *calc, const ca_program_t *prog, const ca_value_t *vars) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Initialize a cursor to run a program from its start.
+ *
+ * @param cursor the cursor to initialize
+ * @param vars the values of the variable slots, must stay valid until
+ * the run is done
+ */
+ __attribute__ ((nonnull(1)))
+static inline void ca_cursor_init(ca_cursor_t *cursor, const ca_value_t *vars)
+{
+    cursor->pc = 0;
+    cursor->vars = vars;
+}
+
+/**
+ * Run at most max_steps instructions of a program on a context.
+ *
+ * The run starts at the cursor position and saves where it stopped in
+ * the cursor, so that a scheduler can interleave the runs of many
+ * programs. The stack of the context should not be modified between
+ * two calls.
+ *
+ * @param calc the library context, must have prog->depth space left
+ * when the run starts
+ * @param prog the program
+ * @param cursor the position of the run
+ * @param max_steps the maximum number of instructions to run
+ * @return 0 when the program is done, 1 when the budget is exhausted
+ * before that, -1 on failure with the cursor on the failing
+ * instruction.
+ */
+int ca_run_budget(ca_calc_t *calc, const ca_program_t *prog, ca_cursor_t *cursor,
+                  size_t max_steps) __attribute__ ((nonnull(1, 2, 3)));
+
+/**
+ * Evaluate a program.
+ *
+ * Evaluation uses prog->scratch, so it is not reentrant: a program
+ * must not be evaluated by several threads at once, or from a
+ * callback of its own evaluation. Concurrent callers should run the
+ * program with ca_run on contexts of their own.
+ *
+ * @param prog the program
+ * @param vars the values of the variable slots
+ * @param count the number of values in vars, must be prog->variable_count
+ * @param result where to store the result
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_eval(ca_program_t *prog, const ca_value_t *vars, size_t count, ca_value_t *result) __attribute__ ((nonnull(1, 4)));
+
+/**
+ * Evaluate a program over several bindings.
+ *
+ * Programs without jumps are evaluated by blocks of rows, see
+ * ca_eval_block, the others row by row. Like ca_eval, it is not
+ * reentrant.
+ *
+ * @param prog the program
+ * @param vars count rows of prog->variable_count values
+ * @param count the number of rows
+ * @param results where to store the count results
+ * @param status if not NULL, where to store the count ca_eval return values
+ * @return 0 if every evaluation succeeded, -1 otherwise.
+ */
+int ca_eval_many(ca_program_t *prog, const ca_value_t *vars, size_t count,
+                 ca_value_t *results, int *status) __attribute__ ((nonnull(1, 4)));
+
+/**
+ * Number of rows evaluated together by ca_eval_block.
+ */
+#define CA_EVAL_BLOCK 512
+
+/**
+ * Return true if a program has jumps, so that its instructions depend
+ * on the values and it cannot be evaluated by ca_eval_block.
+ */
+int ca_program_has_jumps(const ca_program_t *prog) __attribute__ ((nonnull(1)));
+
+/**
+ * Evaluate a program without jumps on a block of rows, applying each
+ * instruction to the whole block with the vectorised kernels of
+ * ca_operate_array rather than running the program row by row.
+ *
+ * The value of variable slot i for row r is vars[i * slot_stride + r *
+ * row_stride]: rows of prog->variable_count values have a slot_stride
+ * of 1, columns of values a row_stride of 1.
+ *
+ * @param prog the program, which is only read
+ * @param vars the values of the variable slots
+ * @param slot_stride the distance between the values of two slots
+ * @param row_stride the distance between the values of two rows
+ * @param count the number of rows, at most CA_EVAL_BLOCK
+ * @param stack room for prog->depth * CA_EVAL_BLOCK values
+ * @param failed where to store 1 for each row whose evaluation fails,
+ * 0 for the others
+ * @param results where to store the results of the rows which succeed,
+ * the others being left untouched
+ * @return the number of rows whose evaluation failed.
+ */
+size_t ca_eval_block(const ca_program_t *prog, const ca_value_t *vars, size_t slot_stride, size_t row_stride,
+                     size_t count, ca_value_t *stack, unsigned char *failed,
+                     ca_value_t *results) __attribute__ ((nonnull(1, 6, 7, 8)));
+
+/**
+ * A function generated by mkfunc from an expression fixed at build
+ * time, computing the same result as ca_eval on its program.
+ */
+typedef struct ca_generated {
+    /** Name of the function */
+    const char *name;
+    /** The expression */
+    const char *source;
+    /** The syntax of the expression */
+    ca_syntax_t syntax;
+    /** Number of variable slots */
+    size_t variable_count;
+    /** The function, storing the result and returning 0 on success, -1 otherwise */
+    int (*run)(const ca_value_t *vars, ca_value_t *result);
+} ca_generated_t;
+
+#endif /* _LIBCALC_PROGRAM_H_ */
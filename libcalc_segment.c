@@ -0,0 +1,211 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_segment.h"
+
+/**
+ * Identifies an initialized segment, "libcalc1".
+ */
+#define CA_SEGMENT_MAGIC 0x31636c616362696cULL
+
+/**
+ * Offset of the stack, on its own cache line so that reading it does
+ * not contend with the sequence number.
+ */
+#define CA_SEGMENT_STACK_OFFSET ((sizeof(ca_segment_header_t) + 63) & ~(size_t) 63)
+
+/**
+ * Setup the process local view of a mapped segment.
+ */
+static void ca_segment_attach(ca_segment_t *segment, void *memory, size_t length, int writer)
+{
+    segment->header = memory;
+    segment->length = length;
+    segment->stack = (const ca_value_t *) ((char *) memory + segment->header->stack_offset);
+    segment->writer = writer;
+
+    /* the writer applies the operations on a context whose stack is
+     * in the segment, readers do not use it */
+    memset(&segment->calc, 0, sizeof(segment->calc));
+    segment->calc.stack = (ca_value_t *) segment->stack;
+    segment->calc.size = segment->header->size;
+    segment->calc.top = segment->header->top;
+    segment->calc.allocator = ca_get_allocator();
+}
+
+int ca_segment_create(ca_segment_t *segment, const char *name, size_t size)
+{
+    assert(segment);
+    assert(name);
+    assert(size);
+
+    size_t length = CA_SEGMENT_STACK_OFFSET + size * sizeof(ca_value_t);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        tr("unable to create segment %s: %m", name);
+        return -1;
+    }
+    if (ftruncate(fd, length) < 0) {
+        tr("unable to size segment %s: %m", name);
+        goto error;
+    }
+
+    void *memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        tr("unable to map segment %s: %m", name);
+        goto error;
+    }
+    close(fd);
+
+    ca_segment_header_t *header = memory;
+    header->sequence = 0;
+    header->size = size;
+    header->top = 0;
+    header->stack_offset = CA_SEGMENT_STACK_OFFSET;
+    /* readers opening the segment now see it initialized or not */
+    __atomic_store_n(&header->magic, CA_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+
+    ca_segment_attach(segment, memory, length, 1);
+    return 0;
+
+error:
+    close(fd);
+    shm_unlink(name);
+    return -1;
+}
+
+int ca_segment_open(ca_segment_t *segment, const char *name)
+{
+    assert(segment);
+    assert(name);
+
+    struct stat st;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        tr("unable to open segment %s: %m", name);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        tr("unable to stat segment %s: %m", name);
+        close(fd);
+        return -1;
+    }
+
+    size_t length = st.st_size;
+    void *memory = length >= sizeof(ca_segment_header_t) ?
+        mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        tr("unable to map segment %s", name);
+        return -1;
+    }
+
+    const ca_segment_header_t *header = memory;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != CA_SEGMENT_MAGIC ||
+        header->stack_offset > length || header->size > (length - header->stack_offset) / sizeof(ca_value_t)) {
+        tr("segment %s is not a stack", name);
+        munmap(memory, length);
+        return -1;
+    }
+
+    ca_segment_attach(segment, memory, length, 0);
+    return 0;
+}
+
+void ca_segment_close(ca_segment_t *segment)
+{
+    assert(segment);
+    munmap(segment->header, segment->length);
+    memset(segment, 0, sizeof(*segment));
+}
+
+int ca_segment_unlink(const char *name)
+{
+    assert(name);
+    if (shm_unlink(name) < 0) {
+        tr("unable to unlink segment %s: %m", name);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Start changing the stack, readers retry until ca_segment_write_end.
+ */
+static void ca_segment_write_begin(ca_segment_t *segment)
+{
+    assert(segment->writer);
+    __atomic_store_n(&segment->header->sequence, segment->header->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Publish the changes of the stack.
+ */
+static void ca_segment_write_end(ca_segment_t *segment)
+{
+    __atomic_store_n(&segment->header->top, segment->calc.top, __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->header->sequence, segment->header->sequence + 1, __ATOMIC_RELEASE);
+}
+
+int ca_segment_push(ca_segment_t *segment, ca_value_t value)
+{
+    assert(segment);
+    if (ca_space_left(&segment->calc) == 0) {
+        tr("stack is full");
+        return -1;
+    }
+
+    ca_segment_write_begin(segment);
+    ca_push(&segment->calc, value);
+    ca_segment_write_end(segment);
+    return 0;
+}
+
+int ca_segment_pop(ca_segment_t *segment, ca_value_t *value)
+{
+    assert(segment);
+    assert(value);
+    if (segment->calc.top == 0) {
+        tr("stack is empty");
+        return -1;
+    }
+
+    ca_segment_write_begin(segment);
+    *value = ca_pop(&segment->calc);
+    ca_segment_write_end(segment);
+    return 0;
+}
+
+int ca_segment_operate(ca_segment_t *segment, ca_operation_t op)
+{
+    assert(segment);
+
+    ca_segment_write_begin(segment);
+    int status = ca_operate(&segment->calc, op);
+    ca_segment_write_end(segment);
+    return status;
+}
+
+int ca_segment_top(const ca_segment_t *segment, ca_value_t *value)
+{
+    assert(segment);
+    assert(value);
+
+    uint64_t sequence;
+    size_t count;
+
+    do {
+        sequence = ca_segment_read_begin(segment);
+        count = ca_segment_count(segment);
+        if (count)
+            *value = ca_segment_value(segment, count - 1);
+    } while (!ca_segment_read_end(segment, sequence));
+
+    return count ? 0 : -1;
+}
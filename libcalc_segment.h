@@ -0,0 +1,158 @@
+#ifndef _LIBCALC_SEGMENT_H_
+#define _LIBCALC_SEGMENT_H_
+
+#include <stdint.h>
+
+#include "libcalc.h"
+
+/**
+ * The start of a shared memory segment, followed by the stack.
+ *
+ * It holds offsets rather than pointers, since each process maps the
+ * segment at its own address.
+ */
+typedef struct ca_segment_header {
+    /** Identifies an initialized segment */
+    uint64_t magic;
+    /** Incremented before and after each change, odd while the stack
+     * is being changed */
+    uint64_t sequence;
+    /** Size of the stack */
+    uint64_t size;
+    /** Index of the top of the stack */
+    uint64_t top;
+    /** Offset of the stack from the start of the segment */
+    uint64_t stack_offset;
+} ca_segment_header_t;
+
+/**
+ * A library context in a POSIX shared memory segment, changed by a
+ * single writer process and observed by any number of readers.
+ *
+ * Readers access the stack in place, without system calls nor
+ * locks: they note the sequence number with ca_segment_read_begin,
+ * read the stack, and check with ca_segment_read_end that the writer
+ * did not change it meanwhile, retrying otherwise. A writer dying
+ * while changing the stack leaves the readers waiting.
+ */
+typedef struct ca_segment {
+    /** The mapped segment */
+    ca_segment_header_t *header;
+    /** Size of the mapping */
+    size_t length;
+    /** The stack, as mapped in this process */
+    const ca_value_t *stack;
+    /** The context of the writer, its stack in the segment */
+    ca_calc_t calc;
+    /** Whether this process is the writer */
+    int writer;
+} ca_segment_t;
+
+/**
+ * Create a segment and open it as its writer.
+ *
+ * @param segment the segment to initialize
+ * @param name the name of the segment, see shm_open(3), must not exist
+ * @param size size of the stack, must be greater than 0.
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_segment_create(ca_segment_t *segment, const char *name, size_t size) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Open an existing segment as a reader.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_segment_open(ca_segment_t *segment, const char *name) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Unmap a segment, which stays available to the other processes.
+ */
+void ca_segment_close(ca_segment_t *segment) __attribute__ ((nonnull(1)));
+
+/**
+ * Remove the name of a segment, it is freed once every process closed it.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_segment_unlink(const char *name) __attribute__ ((nonnull(1)));
+
+/**
+ * Push a value on the stack, from the writer.
+ *
+ * @return 0 on success, -1 if the stack is full.
+ */
+int ca_segment_push(ca_segment_t *segment, ca_value_t value) __attribute__ ((nonnull(1)));
+
+/**
+ * Pop a value from the stack, from the writer.
+ *
+ * @return 0 on success, -1 if the stack is empty.
+ */
+int ca_segment_pop(ca_segment_t *segment, ca_value_t *value) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Apply an operation to elements on the stack, from the writer.
+ */
+int ca_segment_operate(ca_segment_t *segment, ca_operation_t op) __attribute__ ((nonnull(1)));
+
+/**
+ * Start reading a segment.
+ *
+ * @return the sequence number to pass to ca_segment_read_end.
+ */
+ __attribute__ ((nonnull(1)))
+static inline uint64_t ca_segment_read_begin(const ca_segment_t *segment)
+{
+    uint64_t sequence;
+
+    /* wait for the writer to be done */
+    while ((sequence = __atomic_load_n(&segment->header->sequence, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return sequence;
+}
+
+/**
+ * Finish reading a segment.
+ *
+ * @param sequence the result of ca_segment_read_begin
+ * @return 1 if the values read since are consistent, 0 if the writer
+ * changed the stack meanwhile and they should be read again.
+ */
+ __attribute__ ((nonnull(1)))
+static inline int ca_segment_read_end(const ca_segment_t *segment, uint64_t sequence)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&segment->header->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+/**
+ * Return the number of values on the stack, between ca_segment_read_begin
+ * and ca_segment_read_end.
+ */
+ __attribute__ ((nonnull(1)))
+static inline size_t ca_segment_count(const ca_segment_t *segment)
+{
+    return __atomic_load_n(&segment->header->top, __ATOMIC_RELAXED);
+}
+
+/**
+ * Return the value at an index of the stack, 0 being the bottom,
+ * between ca_segment_read_begin and ca_segment_read_end.
+ *
+ * @param index the index, must be lower than ca_segment_count
+ */
+ __attribute__ ((nonnull(1)))
+static inline ca_value_t ca_segment_value(const ca_segment_t *segment, size_t index)
+{
+    return __atomic_load_n(segment->stack + index, __ATOMIC_RELAXED);
+}
+
+/**
+ * Read the top of the stack.
+ *
+ * @return 0 on success, -1 if the stack is empty.
+ */
+int ca_segment_top(const ca_segment_t *segment, ca_value_t *value) __attribute__ ((nonnull(1, 2)));
+
+#endif /* _LIBCALC_SEGMENT_H_ */
@@ -0,0 +1,234 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>
+
+#include "libcalc_priv.h"
+#include "libcalc_shared.h"
+
+/**
+ * The state of a slot.
+ */
+enum {
+    CA_SLOT_IDLE,
+    CA_SLOT_PENDING,
+    CA_SLOT_DONE
+};
+
+/**
+ * The kind of requests.
+ */
+enum {
+    CA_REQUEST_PUSH,
+    CA_REQUEST_POP,
+    CA_REQUEST_OPERATE,
+    CA_REQUEST_ACCUMULATE
+};
+
+/**
+ * Number of passes over the slots a combiner does before releasing
+ * the lock.
+ */
+#define CA_COMBINE_PASSES 4
+
+/**
+ * Number of spins before yielding the processor while waiting.
+ */
+#define CA_SPIN_COUNT 128
+
+static inline void ca_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__ ("" ::: "memory");
+#endif
+}
+
+/**
+ * Size of the allocation holding the slots, with room to align them on
+ * a cache line.
+ */
+static size_t ca_shared_memory_size(size_t threads)
+{
+    return threads * sizeof(ca_shared_slot_t) + sizeof(ca_shared_slot_t) - 1;
+}
+
+int ca_shared_initialize(ca_shared_calc_t *shared, size_t size, size_t threads)
+{
+    assert(shared);
+    assert(threads);
+
+    if (ca_initialize(&shared->calc, size))
+        return -1;
+
+    shared->memory = ca_alloc(shared->calc.allocator, ca_shared_memory_size(threads));
+    if (shared->memory == NULL) {
+        tr("unable to create slots: %m");
+        ca_cleanup(&shared->calc);
+        return -1;
+    }
+    shared->slots = (ca_shared_slot_t *) (((uintptr_t) shared->memory + sizeof(ca_shared_slot_t) - 1) &
+                                          ~(uintptr_t) (sizeof(ca_shared_slot_t) - 1));
+    memset(shared->slots, 0, threads * sizeof(ca_shared_slot_t));
+
+    shared->slot_count = threads;
+    shared->attached = 0;
+    shared->lock = 0;
+    return 0;
+}
+
+void ca_shared_cleanup(ca_shared_calc_t *shared)
+{
+    assert(shared);
+    ca_free(shared->calc.allocator, shared->memory, ca_shared_memory_size(shared->slot_count));
+    ca_cleanup(&shared->calc);
+}
+
+ca_shared_slot_t *ca_shared_attach(ca_shared_calc_t *shared)
+{
+    assert(shared);
+
+    size_t index = __atomic_fetch_add(&shared->attached, 1, __ATOMIC_RELAXED);
+    if (index >= shared->slot_count) {
+        tr("all %zu slots are taken", shared->slot_count);
+        return NULL;
+    }
+    return shared->slots + index;
+}
+
+/**
+ * Apply a request to the context, called by the combiner.
+ */
+static int ca_shared_apply(ca_calc_t *calc, ca_shared_slot_t *slot)
+{
+    switch (slot->kind) {
+    case CA_REQUEST_PUSH:
+        if (ca_space_left(calc) == 0) {
+            tr("stack is full");
+            return -1;
+        }
+        ca_push(calc, slot->value);
+        return 0;
+    case CA_REQUEST_POP:
+        if (ca_count(calc) == 0) {
+            tr("stack is empty");
+            return -1;
+        }
+        slot->value = ca_pop(calc);
+        return 0;
+    case CA_REQUEST_OPERATE:
+        return ca_operate(calc, slot->op);
+    case CA_REQUEST_ACCUMULATE:
+        if (ca_space_left(calc) == 0) {
+            tr("stack is full");
+            return -1;
+        }
+        size_t count = ca_count(calc);
+        ca_push(calc, slot->value);
+        if (ca_operate(calc, slot->op)) {
+            /* drop the pushed value, unless the failed operation took it
+             * like a square root does */
+            if (ca_count(calc) > count)
+                ca_remove(calc, ca_count(calc) - count);
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Apply every pending request.
+ */
+static void ca_shared_combine(ca_shared_calc_t *shared)
+{
+    size_t count = __atomic_load_n(&shared->attached, __ATOMIC_ACQUIRE);
+    if (count > shared->slot_count)
+        count = shared->slot_count;
+
+    for (unsigned pass = 0; pass < CA_COMBINE_PASSES; pass++) {
+        size_t applied = 0;
+        for (size_t i = 0; i < count; i++) {
+            ca_shared_slot_t *slot = shared->slots + i;
+            if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != CA_SLOT_PENDING)
+                continue;
+            slot->status = ca_shared_apply(&shared->calc, slot);
+            __atomic_store_n(&slot->state, CA_SLOT_DONE, __ATOMIC_RELEASE);
+            applied += 1;
+        }
+        if (applied == 0)
+            break;
+    }
+}
+
+/**
+ * Publish the request of a slot and wait for it to be applied,
+ * combining the pending requests when the combiner lock is free.
+ */
+static int ca_shared_request(ca_shared_calc_t *shared, ca_shared_slot_t *slot)
+{
+    unsigned spins = 0;
+
+    __atomic_store_n(&slot->state, CA_SLOT_PENDING, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != CA_SLOT_DONE) {
+        if (__atomic_load_n(&shared->lock, __ATOMIC_RELAXED) == 0 &&
+            __atomic_exchange_n(&shared->lock, 1, __ATOMIC_ACQUIRE) == 0) {
+            ca_shared_combine(shared);
+            __atomic_store_n(&shared->lock, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (++spins % CA_SPIN_COUNT == 0)
+            sched_yield();
+        else
+            ca_relax();
+    }
+
+    __atomic_store_n(&slot->state, CA_SLOT_IDLE, __ATOMIC_RELAXED);
+    return slot->status;
+}
+
+int ca_shared_push(ca_shared_calc_t *shared, ca_shared_slot_t *slot, ca_value_t value)
+{
+    assert(shared);
+    assert(slot);
+    slot->kind = CA_REQUEST_PUSH;
+    slot->value = value;
+    return ca_shared_request(shared, slot);
+}
+
+int ca_shared_pop(ca_shared_calc_t *shared, ca_shared_slot_t *slot, ca_value_t *value)
+{
+    assert(shared);
+    assert(slot);
+    assert(value);
+    slot->kind = CA_REQUEST_POP;
+    if (ca_shared_request(shared, slot))
+        return -1;
+    *value = slot->value;
+    return 0;
+}
+
+int ca_shared_operate(ca_shared_calc_t *shared, ca_shared_slot_t *slot, ca_operation_t op)
+{
+    assert(shared);
+    assert(slot);
+    assert_ca_operation(op);
+    slot->kind = CA_REQUEST_OPERATE;
+    slot->op = op;
+    return ca_shared_request(shared, slot);
+}
+
+int ca_shared_accumulate(ca_shared_calc_t *shared, ca_shared_slot_t *slot,
+                         ca_operation_t op, ca_value_t value)
+{
+    assert(shared);
+    assert(slot);
+    assert_ca_operation(op);
+    slot->kind = CA_REQUEST_ACCUMULATE;
+    slot->op = op;
+    slot->value = value;
+    return ca_shared_request(shared, slot);
+}
@@ -0,0 +1,101 @@
+#ifndef _LIBCALC_SHARED_H_
+#define _LIBCALC_SHARED_H_
+
+#include "libcalc.h"
+
+/**
+ * A request published by a thread to a shared context.
+ *
+ * Each slot lives on its own cache line so that threads publishing
+ * requests do not contend with each other.
+ */
+typedef struct ca_shared_slot {
+    /** Idle, pending or done */
+    int state;
+    /** What to do */
+    int kind;
+    /** The operation to apply */
+    ca_operation_t op;
+    /** The value to push, or the popped value */
+    ca_value_t value;
+    /** The result of the request */
+    int status;
+} __attribute__ ((aligned(64))) ca_shared_slot_t;
+
+/**
+ * A library context shared by several threads.
+ *
+ * Requests are applied by flat combining: a thread publishes its
+ * request in its slot, and whichever thread takes the combiner lock
+ * applies every pending request in one pass over the slots while the
+ * others wait for their slot to be done. The stack is only touched by
+ * the combiner, which keeps it in its cache.
+ */
+typedef struct ca_shared_calc {
+    /** The context, only accessed by the combiner */
+    ca_calc_t calc;
+    /** Held by the combiner */
+    int lock;
+    /** One slot per thread */
+    ca_shared_slot_t *slots;
+    /** The allocation holding the slots */
+    void *memory;
+    /** Number of slots */
+    size_t slot_count;
+    /** Number of attached threads */
+    size_t attached;
+} ca_shared_calc_t;
+
+/**
+ * Initialize a shared context.
+ *
+ * @param shared the context to initialize
+ * @param size size of the stack, must be greater than 0.
+ * @param threads the maximum number of threads using the context
+ * @return 0 on success, -1 otherwise.
+ */
+int ca_shared_initialize(ca_shared_calc_t *shared, size_t size, size_t threads) __attribute__ ((nonnull(1)));
+
+/**
+ * Cleanup a shared context.
+ */
+void ca_shared_cleanup(ca_shared_calc_t *shared) __attribute__ ((nonnull(1)));
+
+/**
+ * Attach the calling thread to a shared context.
+ *
+ * @return the slot of the thread, NULL if every slot is taken.
+ */
+ca_shared_slot_t *ca_shared_attach(ca_shared_calc_t *shared) __attribute__ ((nonnull(1)));
+
+/**
+ * Push a value on the stack.
+ *
+ * @return 0 on success, -1 if the stack is full.
+ */
+int ca_shared_push(ca_shared_calc_t *shared, ca_shared_slot_t *slot, ca_value_t value) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Pop a value from the stack.
+ *
+ * @return 0 on success, -1 if the stack is empty.
+ */
+int ca_shared_pop(ca_shared_calc_t *shared, ca_shared_slot_t *slot, ca_value_t *value) __attribute__ ((nonnull(1, 2, 3)));
+
+/**
+ * Apply an operation to elements on the stack.
+ */
+int ca_shared_operate(ca_shared_calc_t *shared, ca_shared_slot_t *slot, ca_operation_t op) __attribute__ ((nonnull(1, 2)));
+
+/**
+ * Push a value and apply an operation to it and the previous top of
+ * the stack, as a single step.
+ *
+ * This is how several threads feed an accumulator: with a commutative
+ * operation like CA_OP_ADD the order in which the threads are
+ * combined does not matter.
+ */
+int ca_shared_accumulate(ca_shared_calc_t *shared, ca_shared_slot_t *slot,
+                         ca_operation_t op, ca_value_t value) __attribute__ ((nonnull(1, 2)));
+
+#endif /* _LIBCALC_SHARED_H_ */
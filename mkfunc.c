@@ -0,0 +1,409 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "libcalc_priv.h"
+#include "libcalc_program.h"
+
+/**
+ * Maximum length of a line of the function list.
+ */
+#define LINE_SIZE 4096
+
+/**
+ * A function to generate.
+ */
+typedef struct function {
+    char *name;
+    char *source;
+    ca_syntax_t syntax;
+    /** The compiled expression, allocated since programs cannot move */
+    ca_program_t *prog;
+} function_t;
+
+static function_t *functions;
+static size_t function_count;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: mkfunc [-t table] list...\n"
+            "\n"
+            "Generate C functions from the expressions of the lists, writing their\n"
+            "source on stdout. Each line of a list holds the name of a function,\n"
+            "the syntax of its expression, rpn or infix, and the expression:\n"
+            "\n"
+            "    hypot rpn a a * b b * + sqrt\n"
+            "\n"
+            "The functions are declared as\n"
+            "\n"
+            "    int name(const ca_value_t *vars, ca_value_t *result)\n"
+            "\n"
+            "taking the variables in order of first appearance, and fail like\n"
+            "ca_eval. With -t, a ca_generated_t table of the functions is generated.\n");
+    exit(1);
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        perror("mkfunc");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void read_list(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    char line[LINE_SIZE];
+    unsigned number = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        char *save, *name, *syntax, *source;
+
+        number += 1;
+        line[strcspn(line, "\n")] = '\0';
+        name = strtok_r(line, " \t", &save);
+        if (name == NULL || name[0] == '#')
+            continue;
+        syntax = strtok_r(NULL, " \t", &save);
+        source = strtok_r(NULL, "", &save);
+        if (source)
+            source += strspn(source, " \t");
+        if (syntax == NULL || source == NULL || (strcmp(syntax, "rpn") && strcmp(syntax, "infix"))) {
+            fprintf(stderr, "%s:%u: expected a name, rpn or infix and an expression\n", path, number);
+            exit(1);
+        }
+
+        functions = xrealloc(functions, (function_count + 1) * sizeof(function_t));
+        function_t *f = functions + function_count;
+        f->name = strdup(name);
+        f->source = strdup(source);
+        f->syntax = strcmp(syntax, "rpn") == 0 ? CA_SYNTAX_RPN : CA_SYNTAX_INFIX;
+        f->prog = malloc(sizeof(ca_program_t));
+        if (f->name == NULL || f->source == NULL || f->prog == NULL) {
+            perror("mkfunc");
+            exit(1);
+        }
+        if (ca_compile(f->prog, f->source, f->syntax)) {
+            fprintf(stderr, "%s:%u: invalid expression\n", path, number);
+            exit(1);
+        }
+        function_count += 1;
+    }
+
+    fclose(in);
+}
+
+/**
+ * Return the number of values on the stack after applying operations,
+ * raising depth to the highest number reached.
+ */
+static long apply_heights(long height, const ca_operation_t *ops, unsigned count, long *depth)
+{
+    for (unsigned i = 0; i < count; i++) {
+        height += ca_operation_results[ops[i]] - ca_operation_operands[ops[i]];
+        if (height > *depth)
+            *depth = height;
+    }
+    return height;
+}
+
+/**
+ * Compute the number of values on the stack before each instruction,
+ * -1 for the unreachable ones, and the number of stack slots used by
+ * the reachable ones. The program was verified when compiled.
+ */
+static long *compute_heights(const ca_program_t *prog, long *depth)
+{
+    long *heights = xrealloc(NULL, (prog->length + 1) * sizeof(long));
+    size_t *pending = xrealloc(NULL, (prog->length + 1) * sizeof(size_t));
+    size_t count = 0;
+
+    for (size_t pc = 0; pc <= prog->length; pc++)
+        heights[pc] = -1;
+    heights[0] = 0;
+    *depth = 1;
+    pending[count++] = 0;
+
+    while (count) {
+        size_t pc = pending[--count];
+        long height = heights[pc];
+        size_t next[2] = { pc + 1, SIZE_MAX };
+
+        if (pc == prog->length)
+            continue;
+
+        const ca_instruction_t *ins = prog->code + pc;
+        switch (ins->code) {
+        case CA_INS_PUSH:
+        case CA_INS_LOAD:
+            height += 1;
+            if (height > *depth)
+                *depth = height;
+            break;
+        case CA_INS_OPERATE: {
+            ca_operation_t op = ins->operand;
+            height = apply_heights(height, &op, 1, depth);
+            break;
+        }
+        case CA_INS_DIVIDE_CONST:
+        case CA_INS_MODULO_CONST:
+            break;
+        case CA_INS_SUPER:
+            height = apply_heights(height, ca_superinstructions[ins->operand].ops,
+                                   ca_superinstructions[ins->operand].length, depth);
+            break;
+        case CA_INS_JUMP:
+            next[0] = ins->operand;
+            break;
+        case CA_INS_JUMP_IF_ZERO:
+        case CA_INS_JUMP_IF_NOT_ZERO:
+            height -= 1;
+            next[1] = ins->operand;
+            break;
+        }
+
+        for (unsigned i = 0; i < 2; i++) {
+            if (next[i] != SIZE_MAX && heights[next[i]] < 0) {
+                heights[next[i]] = height;
+                pending[count++] = next[i];
+            }
+        }
+    }
+
+    free(pending);
+    return heights;
+}
+
+static void print_value(FILE *out, ca_value_t value)
+{
+    if (value == CA_VALUE_MIN)
+        fprintf(out, "CA_VALUE_MIN");
+    else
+        fprintf(out, "%ldL", value);
+}
+
+/**
+ * Print an operation on the stack slots, height being the number of
+ * values before it.
+ */
+static void print_operation(FILE *out, ca_operation_t op, long height)
+{
+    long x = height - 2, y = height - 1;
+
+    switch (op) {
+    case CA_OP_SQUARE_ROOT:
+        fprintf(out, "    if (ca_value_square_root(s%ld, &s%ld))\n        return -1;\n", y, y);
+        break;
+    case CA_OP_DUPLICATE:
+        fprintf(out, "    s%ld = s%ld;\n", height, y);
+        break;
+    case CA_OP_OVER:
+        fprintf(out, "    s%ld = s%ld;\n", height, x);
+        break;
+    case CA_OP_SWAP:
+        fprintf(out, "    t = s%ld;\n    s%ld = s%ld;\n    s%ld = t;\n", x, x, y, y);
+        break;
+    case CA_OP_ROTATE:
+        fprintf(out, "    t = s%ld;\n    s%ld = s%ld;\n    s%ld = s%ld;\n    s%ld = t;\n",
+                height - 3, height - 3, x, x, y, y);
+        break;
+    case CA_OP_DROP:
+        break;
+    default:
+        fprintf(out, "    if (ca_value_%s(s%ld, s%ld, &s%ld))\n        return -1;\n", ca_operation_name(op), x, y, x);
+        break;
+    }
+}
+
+/**
+ * Return whether a program uses the temporary of the swap and rotate
+ * operations.
+ */
+static int uses_temporary(const ca_program_t *prog)
+{
+    for (size_t pc = 0; pc < prog->length; pc++) {
+        const ca_instruction_t *ins = prog->code + pc;
+
+        if (ins->code == CA_INS_OPERATE && (ins->operand == CA_OP_SWAP || ins->operand == CA_OP_ROTATE))
+            return 1;
+        if (ins->code != CA_INS_SUPER)
+            continue;
+        for (unsigned i = 0; i < ca_superinstructions[ins->operand].length; i++) {
+            ca_operation_t op = ca_superinstructions[ins->operand].ops[i];
+            if (op == CA_OP_SWAP || op == CA_OP_ROTATE)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Print the function of a program, each stack slot being a local
+ * variable and each jump a goto.
+ */
+static void print_function(FILE *out, const function_t *f)
+{
+    const ca_program_t *prog = f->prog;
+    long depth;
+    long *heights = compute_heights(prog, &depth);
+    char *targets = xrealloc(NULL, prog->length + 1);
+
+    memset(targets, 0, prog->length + 1);
+    for (size_t pc = 0; pc < prog->length; pc++)
+        if (prog->code[pc].code == CA_INS_JUMP || prog->code[pc].code == CA_INS_JUMP_IF_ZERO ||
+            prog->code[pc].code == CA_INS_JUMP_IF_NOT_ZERO)
+            targets[prog->code[pc].operand] = 1;
+
+    fprintf(out, "/* %s: %s */\n", f->syntax == CA_SYNTAX_RPN ? "rpn" : "infix", f->source);
+    if (prog->variable_count) {
+        fprintf(out, "/* vars:");
+        for (size_t i = 0; i < prog->variable_count; i++)
+            fprintf(out, " %s", prog->variables[i]);
+        fprintf(out, " */\n");
+    }
+    fprintf(out, "int %s(const ca_value_t *vars, ca_value_t *result)\n{\n", f->name);
+    fprintf(out, "    ca_value_t");
+    for (long i = 0; i < depth; i++)
+        fprintf(out, "%s s%ld", i ? "," : "", i);
+    fprintf(out, ";\n");
+    if (uses_temporary(prog))
+        fprintf(out, "    ca_value_t t;\n");
+    if (prog->variable_count == 0)
+        fprintf(out, "    (void) vars;\n");
+    fprintf(out, "\n");
+
+    for (size_t pc = 0; pc < prog->length; pc++) {
+        const ca_instruction_t *ins = prog->code + pc;
+        long h = heights[pc];
+        ca_value_t d = ins->operand;
+
+        if (targets[pc])
+            fprintf(out, "l%zu:\n", pc);
+        if (h < 0)
+            continue;
+
+        switch (ins->code) {
+        case CA_INS_PUSH:
+            fprintf(out, "    s%ld = ", h);
+            print_value(out, ins->operand);
+            fprintf(out, ";\n");
+            break;
+        case CA_INS_LOAD:
+            fprintf(out, "    s%ld = vars[%ld];\n", h, ins->operand);
+            break;
+        case CA_INS_OPERATE:
+            print_operation(out, ins->operand, h);
+            break;
+        case CA_INS_DIVIDE_CONST:
+            d = prog->dividers[ins->operand].divisor;
+            if (d == -1)
+                fprintf(out, "    if (s%ld == CA_VALUE_MIN) {\n        tr(\"division would overflow\");\n"
+                        "        return -1;\n    }\n", h - 1);
+            fprintf(out, "    s%ld = s%ld / ", h - 1, h - 1);
+            print_value(out, d);
+            fprintf(out, ";\n");
+            break;
+        case CA_INS_MODULO_CONST:
+            d = prog->dividers[ins->operand].divisor;
+            /* x % -1 overflows for CA_VALUE_MIN */
+            if (d == 1 || d == -1)
+                fprintf(out, "    s%ld = 0;\n", h - 1);
+            else {
+                fprintf(out, "    s%ld = s%ld %% ", h - 1, h - 1);
+                print_value(out, d);
+                fprintf(out, ";\n");
+            }
+            break;
+        case CA_INS_SUPER: {
+            const ca_superinstruction_t *super = ca_superinstructions + ins->operand;
+            for (unsigned i = 0; i < super->length; i++) {
+                print_operation(out, super->ops[i], h);
+                h = apply_heights(h, super->ops + i, 1, &depth);
+            }
+            break;
+        }
+        case CA_INS_JUMP:
+            fprintf(out, "    goto l%ld;\n", ins->operand);
+            break;
+        case CA_INS_JUMP_IF_ZERO:
+            fprintf(out, "    if (s%ld == 0)\n        goto l%ld;\n", h - 1, ins->operand);
+            break;
+        case CA_INS_JUMP_IF_NOT_ZERO:
+            fprintf(out, "    if (s%ld != 0)\n        goto l%ld;\n", h - 1, ins->operand);
+            break;
+        }
+    }
+
+    if (targets[prog->length])
+        fprintf(out, "l%zu:\n", prog->length);
+    fprintf(out, "    *result = s0;\n    return 0;\n}\n\n");
+
+    free(targets);
+    free(heights);
+}
+
+static void print_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+int main(int argc, char **argv)
+{
+    const char *table = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't')
+            table = optarg;
+        else
+            usage();
+    }
+    if (optind == argc)
+        usage();
+
+    for (int i = optind; i < argc; i++)
+        read_list(argv[i]);
+
+    FILE *out = stdout;
+    fprintf(out, "/* generated by mkfunc, do not edit */\n\n#include \"libcalc_priv.h\"\n#include \"libcalc_program.h\"\n\n");
+    for (size_t i = 0; i < function_count; i++)
+        print_function(out, functions + i);
+
+    if (table) {
+        fprintf(out, "const ca_generated_t %s[] = {\n", table);
+        for (size_t i = 0; i < function_count; i++) {
+            fprintf(out, "    { \"%s\", ", functions[i].name);
+            print_string(out, functions[i].source);
+            fprintf(out, ", %s, %zu, %s },\n", functions[i].syntax == CA_SYNTAX_RPN ? "CA_SYNTAX_RPN" : "CA_SYNTAX_INFIX",
+                    functions[i].prog->variable_count, functions[i].name);
+        }
+        if (function_count == 0)
+            fprintf(out, "    { NULL, NULL, 0, 0, NULL },\n");
+        fprintf(out, "};\n\nconst size_t %s_count = %zu;\n", table, function_count);
+    }
+
+    for (size_t i = 0; i < function_count; i++) {
+        ca_program_cleanup(functions[i].prog);
+        free(functions[i].prog);
+        free(functions[i].name);
+        free(functions[i].source);
+    }
+    free(functions);
+    return 0;
+}
@@ -0,0 +1,642 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "libcalc.h"
+
+#define DEFAULT_COMMANDS 100000
+#define DEFAULT_PROGRAMS 100
+#define DEFAULT_LENGTH 16
+#define DEFAULT_VARIABLES 2
+#define MAX_VARIABLES 26
+
+/**
+ * Values pushed beyond the maximum depth to make an operation fail, or
+ * to give the amount of a shift or the exponent of a power.
+ */
+#define DEPTH_SLACK 3
+
+/**
+ * Number of operations drawn before giving up on finding one which
+ * applies to the stack.
+ */
+#define MAX_DRAWS 16
+
+#define OPERATION_COUNT (CA_OP_POWER + 1)
+
+/**
+ * The operations, as typed in the calculator and in rpn expressions.
+ */
+static const struct {
+    const char *name;
+    const char *symbol;
+    /** Number of values taken and given back */
+    unsigned operands;
+    unsigned results;
+} operations[OPERATION_COUNT] = {
+    [CA_OP_ADD] = { "add", "+", 2, 1 },
+    [CA_OP_SUBSTRACT] = { "substract", "-", 2, 1 },
+    [CA_OP_MULTIPLY] = { "multiply", "*", 2, 1 },
+    [CA_OP_DIVIDE] = { "divide", "/", 2, 1 },
+    [CA_OP_SQUARE_ROOT] = { "square_root", "sqrt", 1, 1 },
+    [CA_OP_MODULO] = { "modulo", "%", 2, 1 },
+    [CA_OP_LEFT_SHIFT] = { "left_shift", "<<", 2, 1 },
+    [CA_OP_RIGHT_SHIFT] = { "right_shift", ">>", 2, 1 },
+    [CA_OP_DUPLICATE] = { "duplicate", "dup", 1, 2 },
+    [CA_OP_SWAP] = { "swap", "swap", 2, 2 },
+    [CA_OP_OVER] = { "over", "over", 2, 3 },
+    [CA_OP_ROTATE] = { "rotate", "rot", 3, 3 },
+    [CA_OP_DROP] = { "drop", "drop", 1, 0 },
+    [CA_OP_EQUAL] = { "equal", "==", 2, 1 },
+    [CA_OP_NOT_EQUAL] = { "not_equal", "!=", 2, 1 },
+    [CA_OP_LESS] = { "less", "<", 2, 1 },
+    [CA_OP_LESS_EQUAL] = { "less_equal", "<=", 2, 1 },
+    [CA_OP_GREATER] = { "greater", ">", 2, 1 },
+    [CA_OP_GREATER_EQUAL] = { "greater_equal", ">=", 2, 1 },
+    [CA_OP_POWER] = { "power", "**", 2, 1 },
+};
+
+/**
+ * The distributions of the pushed values.
+ */
+typedef enum value_kind {
+    /** 0 to 99 */
+    VALUE_SMALL,
+    /** Any 32 bit integer */
+    VALUE_WORD,
+    /** Any number of bits, each magnitude being as likely */
+    VALUE_WIDE,
+    /** Within 16 of CA_VALUE_MAX or CA_VALUE_MIN */
+    VALUE_EDGE,
+    VALUE_KIND_COUNT
+} value_kind_t;
+
+static const char *const value_names[VALUE_KIND_COUNT] = { "small", "word", "wide", "edge" };
+
+/**
+ * What to generate.
+ */
+static unsigned op_weights[OPERATION_COUNT];
+static unsigned value_weights[VALUE_KIND_COUNT] = { 6, 2, 1, 1 };
+static size_t min_depth = 1, max_depth = 16;
+static double failure_rate;
+static size_t variable_count = DEFAULT_VARIABLES;
+
+/**
+ * The state of the generator.
+ */
+typedef struct generator {
+    /** The values the consumer will have on its stack */
+    ca_value_t *stack;
+    size_t depth;
+    /** Number of failures to generate once the stack has room for
+     * their operands */
+    size_t pending;
+    /** The depth to move to */
+    size_t target;
+    /** Generating programs, failing operations taking their operands
+     * like the others */
+    int programs;
+    /** The values of the variables of the current program */
+    ca_value_t vars[MAX_VARIABLES];
+    /** What was generated */
+    size_t pushes;
+    size_t operations;
+    size_t failures;
+    size_t depth_sum;
+} generator_t;
+
+static uint64_t seed = 1;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: mkload [-p] [-n count] [-s seed] [-m mix] [-d min:max] [-v values]\n"
+            "              [-f rate] [-l length] [-x variables]\n"
+            "\n"
+            "Generate a synthetic workload on stdout: a stream of calculator commands,\n"
+            "one per line, which can be fed to the calculator or to calcd, or with -p\n"
+            "rpn programs in the list format of mkfunc. The same options and seed\n"
+            "always generate the same workload.\n"
+            "\n"
+            "  -n count       number of commands, %d, or of programs, %d\n"
+            "  -s seed        seed of the generator, 1\n"
+            "  -m mix         weights of the operations, as name=weight,... with the\n"
+            "                 names of ca_operation_name, the eight arithmetic\n"
+            "                 operations by default\n"
+            "  -d min:max     range of the stack depth, 1:16, the consumer stack\n"
+            "                 should have room for %d more values\n"
+            "  -v values      weights of the values pushed, small=6,word=2,wide=1,edge=1:\n"
+            "                 small values, 32 bit values, values of any magnitude and\n"
+            "                 values near overflow\n"
+            "  -f rate        rate of the commands, or of the programs, made to fail, 0\n"
+            "  -l length      number of operations of each program, %d\n"
+            "  -x variables   number of variables of each program, %d\n"
+            "\n"
+            "Shifts and powers are given a small amount or exponent, and operations\n"
+            "which would fail on the values are only generated to reach the failure\n"
+            "rate. A summary of the workload is printed on stderr.\n",
+            DEFAULT_COMMANDS, DEFAULT_PROGRAMS, DEPTH_SLACK, DEFAULT_LENGTH, DEFAULT_VARIABLES);
+    exit(1);
+}
+
+/**
+ * Return the next random number, by splitmix64 so that workloads do
+ * not depend on the C library.
+ */
+static uint64_t next(void)
+{
+    uint64_t z = (seed += 0x9e3779b97f4a7c15UL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t below(uint64_t n)
+{
+    return next() % n;
+}
+
+static double uniform(void)
+{
+    return (next() >> 11) * 0x1.0p-53;
+}
+
+/**
+ * Draw an index by weight, -1 if every weight is 0.
+ */
+static long pick(const unsigned *weights, size_t count)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += weights[i];
+    if (total == 0)
+        return -1;
+
+    uint64_t r = below(total);
+    for (size_t i = 0;; i++) {
+        if (r < weights[i])
+            return i;
+        r -= weights[i];
+    }
+}
+
+/**
+ * Parse weights given as name=weight,...
+ */
+static void parse_weights(const char *spec, const char *const *names, size_t count, unsigned *weights)
+{
+    memset(weights, 0, count * sizeof(unsigned));
+
+    while (*spec) {
+        size_t length = strcspn(spec, "=");
+        size_t i;
+
+        for (i = 0; i < count; i++) {
+            if (strlen(names[i]) == length && strncmp(names[i], spec, length) == 0)
+                break;
+        }
+        if (i == count || spec[length] != '=') {
+            fprintf(stderr, "mkload: unknown weight %.*s\n", (int) length, spec);
+            exit(1);
+        }
+
+        char *end;
+        weights[i] = strtoul(spec + length + 1, &end, 10);
+        if (*end != ',' && *end != '\0') {
+            fprintf(stderr, "mkload: invalid weight %s\n", spec);
+            exit(1);
+        }
+        spec = *end ? end + 1 : end;
+    }
+}
+
+static ca_value_t draw_value(void)
+{
+    ca_value_t offset = below(16);
+
+    switch (pick(value_weights, VALUE_KIND_COUNT)) {
+    case VALUE_SMALL:
+        return below(100);
+    case VALUE_WORD:
+        return (int32_t) next();
+    case VALUE_WIDE: {
+        ca_value_t value = (ca_value_t) (next() >> (1 + below(63)));
+        return below(2) ? -value : value;
+    }
+    case VALUE_EDGE:
+        return below(2) ? CA_VALUE_MAX - offset : CA_VALUE_MIN + offset;
+    default:
+        fprintf(stderr, "mkload: every value weight is 0\n");
+        exit(1);
+    }
+}
+
+static ca_value_t square_root(ca_value_t x)
+{
+    ca_value_t low = 0, high = 3037000500;
+
+    /* the largest root whose square is at most x */
+    while (high - low > 1) {
+        ca_value_t middle = low + (high - low) / 2;
+        if (middle * middle <= x)
+            low = middle;
+        else
+            high = middle;
+    }
+    return x < 1 ? 0 : low;
+}
+
+/**
+ * Compute an arithmetic operation like the library.
+ *
+ * @return 0 on success, -1 if the operation fails.
+ */
+static int compute(ca_operation_t op, ca_value_t x, ca_value_t y, ca_value_t *result)
+{
+    switch (op) {
+    case CA_OP_ADD:
+        return __builtin_add_overflow(x, y, result) ? -1 : 0;
+    case CA_OP_SUBSTRACT:
+        return __builtin_sub_overflow(x, y, result) ? -1 : 0;
+    case CA_OP_MULTIPLY:
+        return __builtin_mul_overflow(x, y, result) ? -1 : 0;
+    case CA_OP_DIVIDE:
+        if (y == 0 || (y == -1 && x == CA_VALUE_MIN))
+            return -1;
+        *result = x / y;
+        return 0;
+    case CA_OP_MODULO:
+        if (y == 0)
+            return -1;
+        *result = y == -1 ? 0 : x % y;
+        return 0;
+    case CA_OP_SQUARE_ROOT:
+        if (x < 0)
+            return -1;
+        *result = square_root(x);
+        return 0;
+    case CA_OP_LEFT_SHIFT:
+        *result = (ca_value_t) ((uint64_t) x << y);
+        return 0;
+    case CA_OP_RIGHT_SHIFT:
+        *result = x >> y;
+        return 0;
+    case CA_OP_POWER:
+        if (y < 0)
+            return -1;
+        *result = 1;
+        for (ca_value_t i = 0; i < y; i++)
+            if (__builtin_mul_overflow(*result, x, result))
+                return -1;
+        return 0;
+    case CA_OP_EQUAL:
+        *result = x == y;
+        return 0;
+    case CA_OP_NOT_EQUAL:
+        *result = x != y;
+        return 0;
+    case CA_OP_LESS:
+        *result = x < y;
+        return 0;
+    case CA_OP_LESS_EQUAL:
+        *result = x <= y;
+        return 0;
+    case CA_OP_GREATER:
+        *result = x > y;
+        return 0;
+    case CA_OP_GREATER_EQUAL:
+        *result = x >= y;
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Return true if an operation may be made to fail.
+ */
+static int failable(ca_operation_t op)
+{
+    return op <= CA_OP_MODULO || op == CA_OP_POWER;
+}
+
+/**
+ * Return true if an operation takes a small amount pushed right before
+ * it.
+ */
+static int shaped(ca_operation_t op)
+{
+    return op == CA_OP_LEFT_SHIFT || op == CA_OP_RIGHT_SHIFT || op == CA_OP_POWER;
+}
+
+static void emit(generator_t *g, const char *token)
+{
+    if (g->programs)
+        printf(" %s", token);
+    else
+        printf("%s\n", token);
+}
+
+static void push(generator_t *g, ca_value_t value)
+{
+    char text[32];
+
+    snprintf(text, sizeof(text), "%ld", value);
+    emit(g, text);
+    g->stack[g->depth++] = value;
+    g->pushes += 1;
+}
+
+static void push_random(generator_t *g)
+{
+    if (g->programs && variable_count && below(2)) {
+        char name[2] = { 'a' + below(variable_count), '\0' };
+        emit(g, name);
+        g->stack[g->depth++] = g->vars[name[0] - 'a'];
+        g->pushes += 1;
+        return;
+    }
+    push(g, draw_value());
+}
+
+/**
+ * Apply an operation to the stack and emit it.
+ */
+static void apply(generator_t *g, ca_operation_t op, int fails)
+{
+    unsigned operands = operations[op].operands, results = operations[op].results;
+    ca_value_t *top = g->stack + g->depth, result = 0;
+
+    emit(g, operations[op].symbol);
+    g->operations += 1;
+
+    if (fails) {
+        g->failures += 1;
+        /* a failing command leaves the stack untouched but for a square
+         * root, which removes its operand, a program stops but was
+         * verified as if the operation succeeded */
+        if (!g->programs && op == CA_OP_SQUARE_ROOT) {
+            g->depth -= 1;
+        } else if (g->programs) {
+            g->depth -= operands;
+            for (unsigned i = 0; i < results; i++)
+                g->stack[g->depth++] = 0;
+        }
+        return;
+    }
+
+    switch (op) {
+    case CA_OP_DUPLICATE:
+        top[0] = top[-1];
+        break;
+    case CA_OP_SWAP:
+        result = top[-1];
+        top[-1] = top[-2];
+        top[-2] = result;
+        break;
+    case CA_OP_OVER:
+        top[0] = top[-2];
+        break;
+    case CA_OP_ROTATE:
+        result = top[-3];
+        top[-3] = top[-2];
+        top[-2] = top[-1];
+        top[-1] = result;
+        break;
+    case CA_OP_DROP:
+        break;
+    default:
+        compute(op, operands == 2 ? top[-2] : top[-1], top[-1], &result);
+        top[-(int) operands] = result;
+        break;
+    }
+    g->depth = g->depth - operands + results;
+}
+
+/**
+ * Push the operands making an operation fail, then apply it.
+ */
+static void fail(generator_t *g, ca_operation_t op)
+{
+    switch (op) {
+    case CA_OP_ADD:
+        push(g, CA_VALUE_MAX);
+        push(g, 1);
+        break;
+    case CA_OP_SUBSTRACT:
+        push(g, CA_VALUE_MIN);
+        push(g, 1);
+        break;
+    case CA_OP_MULTIPLY:
+        push(g, CA_VALUE_MAX);
+        push(g, 2);
+        break;
+    case CA_OP_DIVIDE:
+    case CA_OP_MODULO:
+        push(g, 0);
+        break;
+    default:
+        /* square roots of negative values, negative exponents */
+        push(g, -1);
+        break;
+    }
+    apply(g, op, 1);
+}
+
+/**
+ * Return true if an operation can be applied to the stack without
+ * failing, pushing the amount of shifts and powers.
+ *
+ * @param decrease true if the operation should not make the stack grow
+ */
+static int try_apply(generator_t *g, ca_operation_t op, int decrease)
+{
+    unsigned operands = operations[op].operands;
+    int growth = (int) operations[op].results - (int) operands;
+    ca_value_t *top = g->stack + g->depth, result, amount = 0;
+
+    if (shaped(op)) {
+        if (g->depth < 1)
+            return 0;
+        amount = below(op == CA_OP_POWER ? 4 : 64);
+        if (compute(op, top[-1], amount, &result))
+            return 0;
+        push(g, amount);
+        apply(g, op, 0);
+        return 1;
+    }
+
+    if (g->depth < operands || (growth > 0 && (decrease || g->depth + growth > max_depth)))
+        return 0;
+    if (operations[op].results == 1 && compute(op, operands == 2 ? top[-2] : top[-1], top[-1], &result))
+        return 0;
+    apply(g, op, 0);
+    return 1;
+}
+
+/**
+ * Generate a command, moving the stack toward its target depth.
+ *
+ * @param rate the probability that the operation fails
+ * @return 1 if an operation was generated, 0 for a push.
+ */
+static int step(generator_t *g, double rate)
+{
+    if (g->depth < g->target || g->depth == 0) {
+        push_random(g);
+        return 0;
+    }
+
+    g->depth_sum += g->depth;
+    if (below(8) == 0)
+        g->target = min_depth + below(max_depth - min_depth + 1);
+
+    if (rate > 0 && uniform() < rate)
+        g->pending += 1;
+
+    /* the operands of failed commands stay on the stack */
+    if (g->pending && g->depth <= max_depth) {
+        unsigned weights[OPERATION_COUNT];
+        for (size_t i = 0; i < OPERATION_COUNT; i++)
+            weights[i] = failable(i) ? op_weights[i] : 0;
+        long op = pick(weights, OPERATION_COUNT);
+        g->pending -= 1;
+        if (op >= 0) {
+            fail(g, op);
+            return 1;
+        }
+    }
+
+    for (unsigned i = 0; i < MAX_DRAWS; i++)
+        if (try_apply(g, pick(op_weights, OPERATION_COUNT), g->depth > g->target))
+            return 1;
+
+    /* no operation of the mix applies to these values */
+    apply(g, CA_OP_DROP, 0);
+    return 1;
+}
+
+static void generate_stream(generator_t *g, size_t count)
+{
+    while (g->pushes + g->operations < count)
+        step(g, failure_rate);
+}
+
+static void generate_programs(generator_t *g, size_t count, size_t length)
+{
+    for (size_t p = 0; p < count; p++) {
+        /* the values the failures are computed for */
+        printf("# bindings:");
+        for (size_t i = 0; i < variable_count; i++) {
+            g->vars[i] = draw_value();
+            printf(" %c=%ld", (int) ('a' + i), g->vars[i]);
+        }
+        printf("\nload%zu rpn", p);
+
+        /* the failure rate is the rate of the programs failing, at one
+         * of their operations */
+        size_t failing = uniform() < failure_rate ? below(length) : length;
+
+        g->depth = 0;
+        g->pending = 0;
+        g->target = min_depth + below(max_depth - min_depth + 1);
+        for (size_t operations = 0; operations < length;)
+            operations += step(g, operations == failing);
+
+        /* leave a single value */
+        if (g->depth == 0)
+            push_random(g);
+        while (g->depth > 1) {
+            unsigned i;
+            for (i = 0; i < MAX_DRAWS; i++) {
+                long op = pick(op_weights, OPERATION_COUNT);
+                if (operations[op].operands > operations[op].results && try_apply(g, op, 1))
+                    break;
+            }
+            if (i == MAX_DRAWS)
+                apply(g, CA_OP_DROP, 0);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = 0, length = DEFAULT_LENGTH;
+    int programs = 0;
+    int opt;
+
+    for (size_t i = 0; i <= CA_OP_RIGHT_SHIFT; i++)
+        op_weights[i] = 1;
+
+    while ((opt = getopt(argc, argv, "pn:s:m:d:v:f:l:x:")) != -1) {
+        switch (opt) {
+        case 'p':
+            programs = 1;
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'm': {
+            const char *names[OPERATION_COUNT];
+            for (size_t i = 0; i < OPERATION_COUNT; i++)
+                names[i] = operations[i].name;
+            parse_weights(optarg, names, OPERATION_COUNT, op_weights);
+            break;
+        }
+        case 'd':
+            if (sscanf(optarg, "%zu:%zu", &min_depth, &max_depth) != 2 || min_depth > max_depth || max_depth == 0)
+                usage();
+            break;
+        case 'v':
+            parse_weights(optarg, value_names, VALUE_KIND_COUNT, value_weights);
+            break;
+        case 'f':
+            failure_rate = strtod(optarg, NULL);
+            break;
+        case 'l':
+            length = strtoul(optarg, NULL, 10);
+            if (length == 0)
+                usage();
+            break;
+        case 'x':
+            variable_count = strtoul(optarg, NULL, 10);
+            if (variable_count > MAX_VARIABLES)
+                usage();
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || pick(op_weights, OPERATION_COUNT) < 0)
+        usage();
+    if (count == 0)
+        count = programs ? DEFAULT_PROGRAMS : DEFAULT_COMMANDS;
+
+    generator_t g = { .programs = programs };
+    g.stack = calloc(max_depth + DEPTH_SLACK + 1, sizeof(ca_value_t));
+    if (g.stack == NULL) {
+        perror("mkload");
+        exit(1);
+    }
+    g.target = min_depth + below(max_depth - min_depth + 1);
+
+    if (programs)
+        generate_programs(&g, count, length);
+    else
+        generate_stream(&g, count);
+
+    size_t steps = g.operations ? g.operations : 1;
+    fprintf(stderr, "mkload: %zu pushes, %zu operations, %zu failing (%.1f%% of the %s), mean depth %.1f\n",
+            g.pushes, g.operations, g.failures, 100.0 * g.failures / (programs ? count : steps),
+            programs ? "programs" : "operations", (double) g.depth_sum / steps);
+
+    free(g.stack);
+    return 0;
+}
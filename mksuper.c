@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "libcalc_priv.h"
+
+/**
+ * Default number of superinstructions to generate.
+ */
+#define DEFAULT_COUNT 16
+
+/**
+ * Consecutive operations and how many times they ran.
+ */
+typedef struct ngram {
+    unsigned long count;
+    unsigned length;
+    ca_operation_t ops[CA_SUPERINSTRUCTION_LENGTH];
+} ngram_t;
+
+static ngram_t *ngrams;
+static size_t ngram_count;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: mksuper [-n count] profile...\n"
+            "\n"
+            "Generate the superinstructions of libcalc from the operation profiles\n"
+            "saved by ca_profile_save, writing their C source on stdout.\n");
+    exit(1);
+}
+
+/**
+ * Return true if an operation can be fused: it takes one or two
+ * values and pushes a single result.
+ */
+static int fusable(ca_operation_t op)
+{
+    return ca_operation_results[op] == 1 && ca_operation_operands[op] > 0;
+}
+
+static int parse_operation(const char *name, ca_operation_t *op)
+{
+    for (size_t i = 0; i < CA_OPERATION_COUNT; i++) {
+        if (strcmp(ca_operation_name(i), name) == 0) {
+            *op = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Add the count of an ngram, merging the profiles of several runs.
+ */
+static void add_ngram(const ngram_t *ngram)
+{
+    for (size_t i = 0; i < ngram_count; i++) {
+        if (ngrams[i].length == ngram->length &&
+            memcmp(ngrams[i].ops, ngram->ops, ngram->length * sizeof(ca_operation_t)) == 0) {
+            ngrams[i].count += ngram->count;
+            return;
+        }
+    }
+
+    ngrams = realloc(ngrams, (ngram_count + 1) * sizeof(ngram_t));
+    if (ngrams == NULL) {
+        perror("mksuper");
+        exit(1);
+    }
+    ngrams[ngram_count++] = *ngram;
+}
+
+static void read_profile(const char *path)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t length;
+    unsigned number = 0;
+
+    while (getline(&line, &length, in) >= 0) {
+        ngram_t ngram = { 0, };
+        char *save, *word;
+
+        number += 1;
+        word = strtok_r(line, " \t\n", &save);
+        if (word == NULL || word[0] == '#')
+            continue;
+        ngram.count = strtoul(word, NULL, 10);
+
+        while ((word = strtok_r(NULL, " \t\n", &save))) {
+            if (ngram.length == CA_SUPERINSTRUCTION_LENGTH || parse_operation(word, ngram.ops + ngram.length)) {
+                fprintf(stderr, "%s:%u: invalid operation %s\n", path, number, word);
+                exit(1);
+            }
+            ngram.length += 1;
+        }
+
+        int keep = ngram.length > 1;
+        for (unsigned i = 0; i < ngram.length; i++)
+            keep = keep && fusable(ngram.ops[i]);
+        if (keep)
+            add_ngram(&ngram);
+    }
+
+    free(line);
+    fclose(in);
+}
+
+/**
+ * Order by number of saved dispatches.
+ */
+static int compare_ngrams(const void *a, const void *b)
+{
+    const ngram_t *x = a, *y = b;
+    unsigned long sx = x->count * (x->length - 1), sy = y->count * (y->length - 1);
+    return sx < sy ? 1 : sx > sy ? -1 : 0;
+}
+
+static void print_name(FILE *out, const ngram_t *ngram)
+{
+    fprintf(out, "ca_super");
+    for (unsigned i = 0; i < ngram->length; i++)
+        fprintf(out, "_%s", ca_operation_name(ngram->ops[i]));
+}
+
+/**
+ * Print the fused function, keeping the intermediate results in local
+ * variables and writing the stack once all operations succeeded.
+ */
+static unsigned print_function(FILE *out, const ngram_t *ngram)
+{
+    char stack[CA_SUPERINSTRUCTION_LENGTH][16];
+    unsigned height = 0, operands = 0;
+
+    fprintf(out, "/* %lu runs */\nstatic int ", ngram->count);
+    print_name(out, ngram);
+    fprintf(out, "(ca_calc_t *calc)\n{\n");
+    fprintf(out, "    ca_value_t *s = calc->stack + calc->top;\n");
+    fprintf(out, "    ca_value_t");
+    for (unsigned i = 0; i < ngram->length; i++)
+        fprintf(out, "%s t%u", i ? "," : "", i);
+    fprintf(out, ";\n\n");
+
+    for (unsigned i = 0; i < ngram->length; i++) {
+        ca_operation_t op = ngram->ops[i];
+        char args[2][16];
+
+        for (int k = ca_operation_operands[op] - 1; k >= 0; k--) {
+            if (height)
+                strcpy(args[k], stack[--height]);
+            else
+                snprintf(args[k], sizeof(args[k]), "s[-%u]", ++operands);
+        }
+
+        fprintf(out, "%sca_value_%s(", i ? " ||\n        " : "    if (", ca_operation_name(op));
+        for (unsigned k = 0; k < ca_operation_operands[op]; k++)
+            fprintf(out, "%s, ", args[k]);
+        fprintf(out, "&t%u)", i);
+        snprintf(stack[height++], sizeof(stack[0]), "t%u", i);
+    }
+    fprintf(out, ")\n        return -1;\n\n");
+
+    for (unsigned i = 0; i < height; i++)
+        fprintf(out, "    s[-%u] = %s;\n", operands - i, stack[i]);
+    fprintf(out, "    calc->top -= %u;\n    return 0;\n}\n\n", operands - height);
+    return operands;
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = DEFAULT_COUNT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n')
+            count = strtoul(optarg, NULL, 10);
+        else
+            usage();
+    }
+    if (optind == argc)
+        usage();
+
+    for (int i = optind; i < argc; i++)
+        read_profile(argv[i]);
+
+    qsort(ngrams, ngram_count, sizeof(ngram_t), compare_ngrams);
+    if (count > ngram_count)
+        count = ngram_count;
+
+    FILE *out = stdout;
+    unsigned operands[count ? count : 1];
+
+    fprintf(out, "/* generated by mksuper, do not edit */\n\n#include \"libcalc_priv.h\"\n\n");
+    for (size_t i = 0; i < count; i++)
+        operands[i] = print_function(out, ngrams + i);
+
+    fprintf(out, "const ca_superinstruction_t ca_superinstructions[] = {\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "    { %u, {", ngrams[i].length);
+        for (unsigned k = 0; k < ngrams[i].length; k++) {
+            fprintf(out, "%s CA_OP_", k ? "," : "");
+            for (const char *c = ca_operation_name(ngrams[i].ops[k]); *c; c++)
+                fputc(toupper((unsigned char) *c), out);
+        }
+        fprintf(out, " }, %u, ", operands[i]);
+        print_name(out, ngrams + i);
+        fprintf(out, " },\n");
+    }
+    if (count == 0)
+        fprintf(out, "    { 0, { 0 }, 0, NULL },\n");
+    fprintf(out, "};\n\nconst size_t ca_superinstruction_count = %zu;\n", count);
+
+    free(ngrams);
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include "libcalc.c"
+#include "libcalc_memory.h"
 
 /**
  * Set to true so that a mocked function succeeds.
@@ -61,20 +62,47 @@ static void test_initialize_cleanup(void)
 
     /* check when calloc fails */
     succeed = false;
-    check_failure(ca_initialize(&calc, 10));
+    check_failure(ca_initialize(&calc, 100));
     check(calloc_count == 1, "ca_initialize should call calloc");
 
     /* check when calloc succeeds */
     calloc_count = 0;
     succeed = true;
-    check_success(ca_initialize(&calc, 10));
+    check_success(ca_initialize(&calc, 100));
     check(calloc_count == 1, "ca_initialize should call calloc");
     check(calc.stack, "ca_initialize should allocate stack.");
-    check(calc.size == 10, "ca_initialize should set stack size.");
+    check(calc.size == 100, "ca_initialize should set stack size.");
     check(calc.top == 0, "ca_initialize should set stack top.");
 
     ca_cleanup(&calc);
     check(calloc_count == free_count, "ca_cleanup should free allocated memory");
+
+    /* check that small stacks are not allocated */
+    calloc_count = free_count = 0;
+    check_success(ca_initialize(&calc, CA_INLINE_STACK_SIZE));
+    check(calloc_count == 0, "ca_initialize should not call calloc for small stacks");
+    check(calc.stack == calc.inline_stack, "ca_initialize should use the inline stack");
+    check(calc.size == CA_INLINE_STACK_SIZE, "ca_initialize should set stack size.");
+
+    ca_cleanup(&calc);
+    check(free_count == 0, "ca_cleanup should not free the inline stack");
+}
+
+static void test_pool_cleanup(void)
+{
+    ca_pool_t pool;
+
+    succeed = true;
+    calloc_count = free_count = 0;
+    check_success(ca_pool_initialize(&pool, 4, 100, 0));
+    check_success(ca_set_lazy(ca_pool_get(&pool, 1), 8));
+    check_success(ca_set_modulus(ca_pool_get(&pool, 2), 7));
+    check_success(ca_set_lazy(ca_pool_get(&pool, 3), 8));
+    check_success(ca_set_decimal(ca_pool_get(&pool, 3), 2));
+    check(calloc_count == 4, "pool contexts should allocate their lazy queue and mode");
+
+    ca_pool_cleanup(&pool);
+    check(free_count == calloc_count, "ca_pool_cleanup should free the lazy queues and modes");
 }
 
 static void test_space_left(void)
@@ -304,6 +332,23 @@ static void test_op_multiply(void)
     calc.stack[1] = 0 - (CA_VALUE_MAX / 2 + 1);
     calc.top = 2;
     check_failure(ca_op_multiply(&calc));
+
+    calc.stack[0] = CA_VALUE_MAX;
+    calc.stack[1] = -1;
+    calc.top = 2;
+    check_success(ca_op_multiply(&calc));
+    check(calc.stack[0] == -CA_VALUE_MAX, "multiplying by -1 should negate");
+
+    calc.stack[0] = CA_VALUE_MIN;
+    calc.stack[1] = -1;
+    calc.top = 2;
+    check_failure(ca_op_multiply(&calc));
+    check(calc.top == 2, "an overflowing multiplication should leave the stack untouched");
+
+    calc.stack[0] = -1;
+    calc.stack[1] = CA_VALUE_MIN;
+    calc.top = 2;
+    check_failure(ca_op_multiply(&calc));
 }
 
 static void test_op_divide(void)
@@ -324,6 +369,11 @@ static void test_op_divide(void)
     calc.stack[1] = 0;
     calc.top = 2;
     check_failure(ca_op_divide(&calc));
+    calc.stack[0] = CA_VALUE_MIN;
+    calc.stack[1] = -1;
+    calc.top = 2;
+    check_failure(ca_op_divide(&calc));
+    check(calc.top == 2, "an overflowing division should leave the stack untouched");
 }
 
 static void test_op_square_root(void)
@@ -376,6 +426,11 @@ static void test_op_modulo(void)
     calc.stack[1] = 0;
     calc.top = 2;
     check_failure(ca_op_modulo(&calc));
+    calc.stack[0] = CA_VALUE_MIN;
+    calc.stack[1] = -1;
+    calc.top = 2;
+    check_success(ca_op_modulo(&calc));
+    check(calc.stack[0] == 0, "modulo by -1 should give 0");
 }
 
 static void test_op_left_shift(void)
@@ -408,6 +463,107 @@ static void test_op_right_shift(void)
     check(calc.stack[0] == 3, "right_shift should put the addition result on the stack");
 }
 
+static void test_op_power(void)
+{
+    calc.top = 1;
+    check_failure(ca_op_power(&calc));
+
+    calc.stack[0] = -3;
+    calc.stack[1] = 5;
+    calc.top = 2;
+    check_success(ca_op_power(&calc));
+    check(calc.top == 1, "power should remove two values and add the result on the stack");
+    check(calc.stack[0] == -243, "power should put the result on the stack");
+
+    calc.stack[0] = 7;
+    calc.stack[1] = 0;
+    calc.top = 2;
+    check_success(ca_op_power(&calc));
+    check(calc.stack[0] == 1, "a power of 0 should give 1");
+
+    /* the last square would overflow, not the result */
+    calc.stack[0] = 2;
+    calc.stack[1] = 62;
+    calc.top = 2;
+    check_success(ca_op_power(&calc));
+    check(calc.stack[0] == 1L << 62, "power should only fail when its result overflows");
+
+    calc.stack[0] = 2;
+    calc.stack[1] = 63;
+    calc.top = 2;
+    check_failure(ca_op_power(&calc));
+
+    calc.stack[0] = 2;
+    calc.stack[1] = -1;
+    calc.top = 2;
+    check_failure(ca_op_power(&calc));
+}
+
+static void test_op_duplicate(void)
+{
+    calc.size = 2;
+    calc.top = 0;
+    check_failure(ca_op_duplicate(&calc));
+
+    calc.stack[0] = 5;
+    calc.top = 1;
+    check_success(ca_op_duplicate(&calc));
+    check(calc.top == 2, "duplicate should push a value");
+    check(calc.stack[1] == 5, "duplicate should push a copy of the top value");
+    check_failure(ca_op_duplicate(&calc));
+    calc.size = 100;
+}
+
+static void test_op_swap_over_rotate_drop(void)
+{
+    calc.top = 1;
+    check_failure(ca_op_swap(&calc));
+    check_failure(ca_op_over(&calc));
+    calc.top = 2;
+    check_failure(ca_op_rotate(&calc));
+
+    calc.stack[0] = 1;
+    calc.stack[1] = 2;
+    check_success(ca_op_swap(&calc));
+    check(calc.stack[0] == 2 && calc.stack[1] == 1, "swap should exchange the two top values");
+
+    check_success(ca_op_over(&calc));
+    check(calc.top == 3, "over should push a value");
+    check(calc.stack[2] == 2, "over should push a copy of the value below the top");
+
+    calc.stack[2] = 3;
+    check_success(ca_op_rotate(&calc));
+    check(calc.stack[0] == 1 && calc.stack[1] == 3 && calc.stack[2] == 2, "rotate should move the third value on top");
+
+    check_success(ca_op_drop(&calc));
+    check(calc.top == 2, "drop should remove the top value");
+    calc.top = 0;
+    check_failure(ca_op_drop(&calc));
+}
+
+static void test_op_compare(void)
+{
+    calc.top = 1;
+    check_failure(ca_op_less(&calc));
+
+#define CHECK_COMPARE(OP, X, Y, R) do {                                 \
+        calc.stack[0] = X;                                              \
+        calc.stack[1] = Y;                                              \
+        calc.top = 2;                                                   \
+        check_success(OP(&calc));                                       \
+        check(calc.top == 1 && calc.stack[0] == R, #OP " of %ld and %ld should be %d", X, Y, R); \
+    } while (0)
+
+    CHECK_COMPARE(ca_op_equal, 3L, 3L, 1);
+    CHECK_COMPARE(ca_op_equal, 3L, -3L, 0);
+    CHECK_COMPARE(ca_op_not_equal, 3L, -3L, 1);
+    CHECK_COMPARE(ca_op_less, -3L, 3L, 1);
+    CHECK_COMPARE(ca_op_less, 3L, 3L, 0);
+    CHECK_COMPARE(ca_op_less_equal, 3L, 3L, 1);
+    CHECK_COMPARE(ca_op_greater, CA_VALUE_MAX, CA_VALUE_MIN, 1);
+    CHECK_COMPARE(ca_op_greater_equal, 2L, 3L, 0);
+}
+
 static void test_stack_for_each(void)
 {
     calc.top = 3;
@@ -427,6 +583,7 @@ static void test_stack_for_each(void)
 int main(void)
 {
     test_initialize_cleanup();
+    test_pool_cleanup();
     test_space_left();
     test_top();
     test_push_pop();
@@ -440,6 +597,10 @@ int main(void)
     test_op_modulo();
     test_op_left_shift();
     test_op_right_shift();
+    test_op_power();
+    test_op_duplicate();
+    test_op_swap_over_rotate_drop();
+    test_op_compare();
     test_stack_for_each();
     return 0;
 }